@@ -1,11 +1,257 @@
 // FileStream is the server.
 #include "../chat_common.hpp"
+#include <memory>
+#include <random>
+
+// Where the trace goes when we are stopped, empty when not tracing.
+static std::string g_tracePath;
+
+static BOOL WINAPI DumpTrace(DWORD event) {
+  trace::tracer.Stop();
+  if (trace::tracer.Dump(g_tracePath))
+    std::cout << "Trace written to " << g_tracePath.c_str() << std::endl;
+  return FALSE; // Carry on and exit.
+}
 
 int main(int argc, char *argv[]) {
-  net::NetServer server;
+  unsigned short port = CHATMIUM_PORT_NR;
+  unsigned int workers = 1;
+  bool completionPort = false;
+  unsigned int readers = 0, writers = 0;
+  DWORD flushMillis = 0;
+  bool ioStats = false;
+  unsigned short handoffPort = 0;
+  unsigned short takeoverPort = 0;
+  std::string registrar("www.shaheedabdol.co.za");
+  bool lan = false;
+  unsigned short metricsPort = 0;
+  std::string capturePath;
+  DWORD lockReportMillis = 0;
+  net::SlowConsumerPolicy policy = net::SlowPauseFiles;
+  std::vector<std::string> peers;
+  std::string peerSecret;
+  net::RateLimit limits[net::PacketClasses];
+  for (int c = 0; c < net::PacketClasses; ++c)
+    limits[c] = net::DefaultRateLimits[c];
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-slow" && i + 1 < argc) {
+      // What to do with clients that can't keep up: drop, pause or kick.
+      std::string name(argv[++i]);
+      if (name == "drop")
+        policy = net::SlowDropOldestChat;
+      else if (name == "pause")
+        policy = net::SlowPauseFiles;
+      else if (name == "kick")
+        policy = net::SlowDisconnect;
+    } else if (arg == "-port" && i + 1 < argc) {
+      // Run several servers on one machine by giving each its own port.
+      port = static_cast<unsigned short>(std::stoul(argv[++i]));
+    } else if (arg == "-rate" && i + 3 < argc) {
+      // Packets a second and burst for one class: chat, file or control.
+      std::string name(argv[++i]);
+      net::RateLimit limit{static_cast<unsigned int>(std::stoul(argv[i + 1])),
+                           static_cast<unsigned int>(std::stoul(argv[i + 2]))};
+      i += 2;
+      if (name == "chat")
+        limits[net::ClassChat] = limit;
+      else if (name == "file")
+        limits[net::ClassFile] = limit;
+      else if (name == "control")
+        limits[net::ClassControl] = limit;
+    } else if (arg == "-workers" && i + 1 < argc) {
+      // Share the port between this many workers, each with its own threads.
+      // They talk to each other on the ports just above it.
+      workers = std::stoul(argv[++i]);
+      if (workers == 0)
+        workers = 1;
+    } else if (arg == "-io" && i + 1 < argc) {
+      // How sockets are read: poll, or iocp for a completion port.
+      completionPort = std::string(argv[++i]) == "iocp";
+    } else if (arg == "-pipeline" && i + 2 < argc) {
+      // Read and send on this many reader and writer threads per worker,
+      // leaving the comms thread to route.
+      readers = std::stoul(argv[++i]);
+      writers = std::stoul(argv[++i]);
+    } else if (arg == "-flush" && i + 1 < argc) {
+      // Let small writes to a client wait this many milliseconds for more
+      // to go out with them, rather than going out every round.
+      flushMillis = std::stoul(argv[++i]);
+    } else if (arg == "-iostats") {
+      // Print the I/O counters every couple of seconds, to compare backends.
+      ioStats = true;
+    } else if (arg == "-peer" && i + 1 < argc) {
+      // Another server to federate with, as host:port. Both need the same
+      // -peersecret.
+      peers.push_back(argv[++i]);
+    } else if (arg == "-peersecret" && i + 1 < argc) {
+      // Only servers which know this may link to us as peers, or take our
+      // clients over.
+      peerSecret = argv[++i];
+    } else if (arg == "-handoff" && i + 1 < argc) {
+      // Let a newer build take over our clients on this loopback port. It
+      // needs the same -peersecret.
+      handoffPort = static_cast<unsigned short>(std::stoul(argv[++i]));
+    } else if (arg == "-takeover" && i + 1 < argc) {
+      // Take the clients over from the server handing off on this port.
+      takeoverPort = static_cast<unsigned short>(std::stoul(argv[++i]));
+    } else if (arg == "-registrar" && i + 1 < argc) {
+      // Where to register, as host[:port][/path], or off.
+      registrar = argv[++i];
+    } else if (arg == "-lan") {
+      // Announce the server to clients on the local network.
+      lan = true;
+    } else if (arg == "-metrics" && i + 1 < argc) {
+      // Serve Prometheus metrics on loopback, one port per worker from here.
+      metricsPort = static_cast<unsigned short>(std::stoul(argv[++i]));
+    } else if (arg == "-capture" && i + 1 < argc) {
+      // Record the traffic for FileStreamReplay, a file per extra worker.
+      capturePath = argv[++i];
+    } else if (arg == "-lockprof" && i + 1 < argc) {
+      // Time the server locks, reporting every this many seconds.
+      lockReportMillis = std::stoul(argv[++i]) * 1000;
+    } else if (arg == "-trace" && i + 1 < argc) {
+      // Trace chat lines through the server, written here on Ctrl+C.
+      g_tracePath = argv[++i];
+    }
+  }
+
+  if (lockReportMillis)
+    lockprof::profiler.Start();
+  if (!g_tracePath.empty()) {
+    trace::tracer.Start();
+    SetConsoleCtrlHandler(DumpTrace, TRUE);
+  }
+
+  // Handing off only works with a single worker.
+  if ((handoffPort || takeoverPort) && workers != 1) {
+    std::cout << "Handoff needs a single worker." << std::endl;
+    return 1;
+  }
+
+  // Any local process could ask for our clients, so both ends of a handoff
+  // need the secret.
+  if ((handoffPort || takeoverPort) && peerSecret.empty()) {
+    std::cout << "Handoff needs a -peersecret." << std::endl;
+    return 1;
+  }
+
+  // Get the listening socket and the clients from the old process first.
+  net::Handoff handoff = {INVALID_SOCKET, INVALID_SOCKET};
+  if (takeoverPort &&
+      !net::NetServer::TakeOver(takeoverPort, peerSecret, handoff)) {
+    std::cout << "Could not take over on port " << takeoverPort << std::endl;
+    return 1;
+  }
 
-  while (true) {
+  // Workers link over loopback, a secret made up for this run keeps other
+  // local processes from posing as one.
+  if (peerSecret.empty() && workers > 1) {
+    std::random_device random;
+    for (int i = 0; i < 4; ++i)
+      peerSecret.append(std::to_string(random()));
+  }
+
+  // The first server owns the listening socket, the other workers share it
+  // and link to every worker started before them.
+  std::vector<std::unique_ptr<net::NetServer>> servers;
+  for (unsigned int w = 0; w < workers; ++w) {
+    unsigned short busPort =
+        workers == 1 ? 0 : static_cast<unsigned short>(port + 1 + w);
+    SOCKET shared =
+        servers.empty() ? handoff.listener : servers[0]->GetAcceptSocket();
+    servers.emplace_back(new net::NetServer(port, busPort, shared));
+
+    net::NetServer &server = *servers.back();
+    server.SetSlowConsumerPolicy(policy);
+    for (int c = 0; c < net::PacketClasses; ++c)
+      server.SetRateLimit(static_cast<net::PacketClass>(c), limits[c].rate,
+                          limits[c].burst);
+    server.SetFlushDeadline(flushMillis);
+    server.SetPeerSecret(peerSecret);
+    if (readers)
+      server.UsePipeline(readers, writers);
+    if (completionPort)
+      server.UseCompletionPort();
+    if (metricsPort)
+      server.ServeMetrics(static_cast<unsigned short>(metricsPort + w));
+    if (!capturePath.empty())
+      server.StartCapture(w == 0 ? capturePath
+                                 : capturePath + "." + std::to_string(w));
+    for (unsigned int other = 0; other < w; ++other)
+      server.AddPeer("127.0.0.1", static_cast<unsigned short>(port + 1 + other));
+  }
+
+  if (takeoverPort && !servers[0]->Adopt(handoff))
+    return 1;
+  if (handoffPort)
+    servers[0]->ListenForHandoff(handoffPort);
+
+  // Only the owner of the listening socket announces it.
+  if (registrar != "off") {
+    std::string path("/covalent.php?register=fs_srv_2635_6253&port=" +
+                     std::to_string(port) + "&timeout=2");
+    std::string::size_type slash = registrar.find('/');
+    if (slash != std::string::npos) {
+      path = registrar.substr(slash);
+      registrar.erase(slash);
+    }
+    unsigned short webPort = 80;
+    std::string::size_type colon = registrar.find(':');
+    if (colon != std::string::npos) {
+      webPort =
+          static_cast<unsigned short>(std::stoul(registrar.substr(colon + 1)));
+      registrar.erase(colon);
+    }
+    servers[0]->AddAnnouncer(
+        new discovery::HttpRegistrar(registrar, webPort, path, 30000));
+  }
+  if (lan)
+    servers[0]->AddAnnouncer(new discovery::LanAnnouncer(port));
+
+  // Other servers link to the first worker, the bus carries the rest.
+  for (auto &peer : peers) {
+    std::string::size_type pos = peer.find_last_of(':');
+    if (pos == std::string::npos)
+      servers[0]->AddPeer(peer, CHATMIUM_PORT_NR);
+    else
+      servers[0]->AddPeer(
+          peer.substr(0, pos),
+          static_cast<unsigned short>(std::stoul(peer.substr(pos + 1))));
+  }
+
+  // Run until a newer process has taken our clients over.
+  DWORD lockReportAt = GetTickCount() + lockReportMillis;
+  while (!servers[0]->HandedOff()) {
     Sleep(2000);
+
+    if (lockReportMillis &&
+        static_cast<int>(GetTickCount() - lockReportAt) >= 0) {
+      std::string report;
+      lockprof::profiler.Report(report, true);
+      std::cout << report.c_str();
+      lockReportAt += lockReportMillis;
+    }
+
+    for (size_t w = 0; ioStats && w < servers.size(); ++w) {
+      net::IoStats stats;
+      servers[w]->GetIoStats(stats);
+      double in = stats.packetsIn ? static_cast<double>(stats.packetsIn) : 1;
+      double out = stats.packetsOut ? static_cast<double>(stats.packetsOut) : 1;
+      std::cout << "io[" << w << "] "
+                << (stats.backend == net::IoCompletion
+                        ? "iocp"
+                        : stats.backend == net::IoPipeline ? "pipeline"
+                                                           : "poll")
+                << " in " << stats.packetsIn << " out " << stats.packetsOut
+                << " recv/pkt " << stats.recvCalls / in << " send/pkt "
+                << stats.sendCalls / out << " p50 " << stats.p50Micros
+                << "us p99 " << stats.p99Micros << "us" << std::endl;
+    }
   }
+
+  if (!g_tracePath.empty())
+    DumpTrace(CTRL_CLOSE_EVENT);
   return 0;
 }
@@ -0,0 +1,245 @@
+// FileStreamBench times the comms codec and framer on synthetic streams.
+#include "../chat_common.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+
+// Every allocation in the process is counted, so a benchmark can report
+// how many it made per packet. Blocks the slab pool has to take from the
+// heap are added in, those it hands out again are free.
+static volatile long long g_allocations = 0;
+
+void *operator new(size_t size) {
+  InterlockedIncrement64(&g_allocations);
+  void *p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) throw() { free(p); }
+
+namespace bench {
+
+// Keep running a benchmark until it has taken at least this long.
+const double MinMillis = 200.0;
+
+// Reads as the kernel might hand them to us: a segment, a socket buffer
+// and the client's own read size.
+const size_t RecvSizes[] = {1460, 8192, comms::TransferSize};
+
+struct Result {
+  std::string name;
+  unsigned long long packets;
+  unsigned long long bytes;
+  double nsPerPacket;
+  double mbPerSecond;
+  double allocsPerPacket;
+};
+
+struct Stream {
+  std::string name;
+  std::vector<comms::Packet> packets;
+  std::vector<char> wire; // Every packet, encoded back to back.
+};
+
+comms::Packet MakePacket(unsigned int type, unsigned int sequence,
+                         size_t bytes) {
+  std::string data;
+  for (size_t i = 0; i < bytes; ++i)
+    data.push_back(static_cast<char>('a' + (i + sequence) % 26));
+  return comms::Packet{{type, 0, 0, 0, data.length(), sequence, 0}, data};
+}
+
+void Encode(const comms::Packet &packet, std::vector<char> &out) {
+  std::vector<unsigned int> frame;
+  comms::EncodeHeader(packet.hdr, frame);
+  comms::EncodePayload(packet.data, packet.hdr.len, frame);
+  const char *bytes = reinterpret_cast<const char *>(&frame[0]);
+  out.insert(out.end(), bytes, bytes + frame.size() * sizeof(unsigned int));
+}
+
+// Acks alone, room chat, file chunks and a mix of all three in the
+// proportions a busy room sees.
+void MakeStreams(std::vector<Stream> &streams) {
+  const size_t chat = 64;
+  const size_t chunk = comms::TransferSize - comms::HeaderSize;
+
+  Stream acks{"acks"}, chats{"chat"}, files{"file"}, mixed{"mixed"};
+  for (unsigned int i = 0; i < 4096; ++i) {
+    acks.packets.push_back(MakePacket(PKT_MSG_ACK, i, 0));
+    chats.packets.push_back(MakePacket(PKT_MSG, i, chat));
+  }
+  for (unsigned int i = 0; i < 64; ++i)
+    files.packets.push_back(MakePacket(PKT_FILE_IN, i, chunk));
+  for (unsigned int i = 0; i < 2048; ++i) {
+    unsigned int slot = i % 20;
+    if (slot < 14)
+      mixed.packets.push_back(MakePacket(PKT_MSG_ACK, i, 0));
+    else if (slot < 19)
+      mixed.packets.push_back(MakePacket(PKT_MSG, i, chat));
+    else
+      mixed.packets.push_back(MakePacket(PKT_FILE_IN, i, chunk));
+  }
+
+  streams.push_back(acks);
+  streams.push_back(chats);
+  streams.push_back(files);
+  streams.push_back(mixed);
+  for (auto &s : streams) {
+    for (auto &p : s.packets)
+      Encode(p, s.wire);
+  }
+}
+
+// Run |body| over the stream until MinMillis have passed. |body| does one
+// pass and returns the packets it handled.
+template <typename Body>
+Result Measure(const std::string &name, const Stream &stream, Body body) {
+  LARGE_INTEGER frequency, start, now;
+  QueryPerformanceFrequency(&frequency);
+
+  body(); // Warm up, and let any buffers reach their size.
+
+  unsigned long long packets = 0, bytes = 0;
+  long long allocations = g_allocations + slab::pool.HeapAllocations();
+  double millis = 0;
+  QueryPerformanceCounter(&start);
+  while (millis < MinMillis) {
+    packets += body();
+    bytes += stream.wire.size();
+    QueryPerformanceCounter(&now);
+    millis = (now.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+  }
+  allocations = g_allocations + slab::pool.HeapAllocations() - allocations;
+
+  Result result{name, packets, bytes, millis * 1000000.0 / packets,
+                bytes / (millis / 1000.0) / (1024.0 * 1024.0),
+                static_cast<double>(allocations) / packets};
+  return result;
+}
+
+// What SendPacket does before the send.
+Result EncodeBench(const Stream &stream) {
+  return Measure("encode/" + stream.name, stream, [&stream]() {
+    for (auto &p : stream.packets) {
+      comms::Frame frame;
+      comms::EncodeHeader(p.hdr, frame);
+      comms::EncodePayload(p.data, p.hdr.len, frame);
+    }
+    return static_cast<unsigned long long>(stream.packets.size());
+  });
+}
+
+// Decoding whole packets which are already in memory.
+Result AssignBench(const Stream &stream) {
+  std::vector<char> wire(stream.wire);
+  return Measure("assign/" + stream.name, stream, [&wire]() {
+    unsigned long long packets = 0;
+    for (size_t at = 0; at < wire.size(); ++packets) {
+      comms::Header hdr;
+      comms::Payload data;
+      comms::AssignHeader(hdr, &wire[at]);
+      comms::AssignMessage(&wire[at], hdr, data);
+      at += comms::HeaderSize + hdr.len * sizeof(unsigned int);
+    }
+    return packets;
+  });
+}
+
+// The read path, the stream arrives |recvSize| bytes at a time and
+// complete packets are taken off after every read.
+Result FrameBench(const Stream &stream, size_t recvSize) {
+  std::string name("frame/" + stream.name + "/" + std::to_string(recvSize));
+  return Measure(name, stream, [&stream, recvSize]() {
+    std::vector<char> data;
+    comms::packetQueue queue;
+    unsigned long long packets = 0;
+    for (size_t at = 0; at < stream.wire.size(); at += recvSize) {
+      size_t bytes = stream.wire.size() - at;
+      bytes = bytes < recvSize ? bytes : recvSize;
+      data.insert(data.end(), &stream.wire[at], &stream.wire[at] + bytes);
+      comms::QueueCompletePackets(data, queue);
+      packets += queue.size();
+      queue.clear();
+    }
+    return packets;
+  });
+}
+
+void WriteJson(FILE *out, const std::string &label,
+               const std::vector<Result> &results) {
+  fprintf(out, "{\n  \"label\": \"%s\",\n  \"results\": [\n", label.c_str());
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result &r = results[i];
+    fprintf(out,
+            "    {\"name\": \"%s\", \"packets\": %llu, \"bytes\": %llu, "
+            "\"ns_per_packet\": %.1f, \"mb_per_s\": %.1f, "
+            "\"allocs_per_packet\": %.2f}%s\n",
+            r.name.c_str(), r.packets, r.bytes, r.nsPerPacket, r.mbPerSecond,
+            r.allocsPerPacket, i + 1 < results.size() ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+}
+
+} // namespace bench
+
+int main(int argc, char *argv[]) {
+  std::string json;
+  std::string label("local");
+  std::string only;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-json" && i + 1 < argc) {
+      // Write the results here as well, to compare with other runs.
+      json = argv[++i];
+    } else if (arg == "-label" && i + 1 < argc) {
+      // Names the run in the JSON, a commit id for example.
+      label = argv[++i];
+    } else if (arg == "-filter" && i + 1 < argc) {
+      // Only run the benchmarks whose name contains this.
+      only = argv[++i];
+    } else {
+      std::cout << "Usage: FileStreamBench [-json path] [-label name]"
+                << " [-filter text]" << std::endl;
+      return 1;
+    }
+  }
+
+  std::vector<bench::Stream> streams;
+  bench::MakeStreams(streams);
+
+  std::vector<bench::Result> results;
+  auto run = [&](const std::string &name, std::function<bench::Result()> b) {
+    if (!only.empty() && name.find(only) == std::string::npos)
+      return;
+    bench::Result r = b();
+    results.push_back(r);
+    char line[160];
+    sprintf_s(line, sizeof(line),
+              "%-28s %10.1f ns/pkt %9.1f MB/s %6.2f allocs/pkt", r.name.c_str(),
+              r.nsPerPacket, r.mbPerSecond, r.allocsPerPacket);
+    std::cout << line << std::endl;
+  };
+
+  for (auto &s : streams) {
+    run("encode/" + s.name, [&s]() { return bench::EncodeBench(s); });
+    run("assign/" + s.name, [&s]() { return bench::AssignBench(s); });
+    for (auto size : bench::RecvSizes) {
+      run("frame/" + s.name + "/" + std::to_string(size),
+          [&s, size]() { return bench::FrameBench(s, size); });
+    }
+  }
+
+  if (!json.empty()) {
+    FILE *out = fopen(json.c_str(), "w");
+    if (!out) {
+      std::cout << "Could not write " << json.c_str() << std::endl;
+      return 1;
+    }
+    bench::WriteJson(out, label, results);
+    fclose(out);
+  }
+  return 0;
+}
@@ -68,9 +68,14 @@ public:
       m_out.sendOutput("        You must do this first.");
       m_out.sendOutput("  -con  [alias]: Connect to server.");
       m_out.sendOutput("        You must connect to chat.");
+      m_out.sendOutput("  -find: Look for servers on the local network.");
+      m_out.sendOutput("  -trace: Start tracing lines, again to save them.");
+      m_out.sendOutput("  -metrics [port]: Serve metrics on loopback.");
       m_out.sendOutput("  -ls:  List the users in this session.");
       m_out.sendOutput("  -pvt  [user] [msg]: Send private message to user.");
       m_out.sendOutput("        We'll start supporting conversations soon.");
+      m_out.sendOutput("  -join [channel]: Join a channel and talk in it.");
+      m_out.sendOutput("  -part [channel]: Leave a channel.");
       m_out.sendOutput("  -file [choose]: Send a file to all users.");
       m_out.sendOutput("  -pfil [user] [choose]: Send file to user.");
 
@@ -89,12 +94,27 @@ public:
     } else if (util::icompare(command, "-con", true)) {
       connectServer(command);
       return;
+    } else if (util::icompare(command, "-find")) {
+      findServers();
+      return;
+    } else if (util::icompare(command, "-trace")) {
+      toggleTrace();
+      return;
+    } else if (util::icompare(command, "-metrics", true)) {
+      serveMetrics(command);
+      return;
     } else if (util::icompare(command, "-ls")) {
       listUsers(); // working
       return;
     } else if (util::icompare(command, "-pvt", true)) {
       sendPrivate(command);
       return;
+    } else if (util::icompare(command, "-join", true)) {
+      joinChannel(command);
+      return;
+    } else if (util::icompare(command, "-part", true)) {
+      leaveChannel(command);
+      return;
     } else if (util::icompare(command, "-file")) {
       sendFileGeneral(); // works
       return;
@@ -141,11 +161,89 @@ public:
 	*/
   }
 
+  void findServers() {
+    std::vector<discovery::LanServer> servers;
+    discovery::FindLanServers(500, servers);
+    if (servers.empty()) {
+      m_out.sendOutput("No servers answered on the local network.");
+      return;
+    }
+    for (auto &server : servers) {
+      std::string line("  " + server.address);
+      if (server.port != CHATMIUM_PORT_NR)
+        line.append(" (port " + std::to_string(server.port) + ")");
+      m_out.sendOutput(line);
+    }
+  }
+
+  void toggleTrace() {
+    if (!trace::tracer.On()) {
+      trace::tracer.Start();
+      m_out.sendOutput("Tracing chat lines, -trace again to save them.");
+      return;
+    }
+
+    // Chrome trace JSON, open it in chrome://tracing.
+    trace::tracer.Stop();
+    std::string path(m_client.GetModuleDirectory() + "trace_" +
+                     std::to_string(GetCurrentProcessId()) + ".json");
+    if (trace::tracer.Dump(path))
+      m_out.sendOutput("Trace saved to " + path);
+    else
+      m_out.sendOutput("Could not save the trace to " + path);
+  }
+
+  void serveMetrics(const std::string &command) {
+    // Prometheus can scrape the client from here on.
+    std::string port{util::split(command, "-metrics", true)};
+    unsigned long number = std::strtoul(port.c_str(), nullptr, 10);
+    if (number == 0 || number > 0xFFFF) {
+      m_out.sendOutput("Please provide a valid port.");
+      return;
+    }
+    if (m_client.ServeMetrics(static_cast<unsigned short>(number)))
+      m_out.sendOutput("Metrics on http://127.0.0.1:" + port + "/metrics");
+    else
+      m_out.sendOutput("Could not open metrics port " + port);
+  }
+
   void listUsers() { m_client.GetUserList(); }
 
   void sendPrivate(const std::string &command) {
-    // Parse out the user name .... we will need to send this to the server for
-    // processing.
+    // Parse out the user name, the rest of the line is the message.
+    std::string::size_type start = command.find_first_not_of(' ', 4);
+    std::string::size_type end = command.find(' ', start);
+    if (start == std::string::npos || end == std::string::npos) {
+      m_out.sendOutput("Usage: -pvt [user] [msg]");
+      return;
+    }
+
+    std::string user = command.substr(start, end - start);
+    std::string::size_type text = command.find_first_not_of(' ', end);
+    if (text == std::string::npos) {
+      m_out.sendOutput("Usage: -pvt [user] [msg]");
+      return;
+    }
+
+    m_client.SendPrivate(user, command.substr(text));
+  }
+
+  void joinChannel(const std::string &command) {
+    std::string::size_type start = command.find_first_not_of(' ', 5);
+    if (start == std::string::npos) {
+      m_out.sendOutput("Usage: -join [channel]");
+      return;
+    }
+    m_client.JoinChannel(command.substr(start));
+  }
+
+  void leaveChannel(const std::string &command) {
+    std::string::size_type start = command.find_first_not_of(' ', 5);
+    if (start == std::string::npos) {
+      m_out.sendOutput("Usage: -part [channel]");
+      return;
+    }
+    m_client.LeaveChannel(command.substr(start));
   }
 
   void sendFileGeneral() {
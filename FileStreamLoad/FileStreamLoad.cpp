@@ -0,0 +1,361 @@
+// FileStreamLoad drives many headless clients at a server to measure it.
+// Its own timing, threads and output only use the standard library. The
+// wire format and sockets come from chat_common.hpp, which is Winsock.
+#include "../chat_common.hpp"
+#include <chrono>
+#include <iomanip>
+#include <memory>
+#include <thread>
+
+namespace load {
+
+enum Kind { KindChat, KindList, KindFile, Kinds };
+const char *KindNames[Kinds] = {"chat", "list", "file"};
+
+struct Options {
+  std::string host;
+  unsigned short port;
+  unsigned int clients;
+  unsigned int threads;
+  unsigned int seconds;
+  double rates[Kinds];     // Per client per second, a file is one transfer.
+  unsigned int messageBytes;
+  unsigned int chunkBytes;
+  unsigned int fileChunks;
+};
+
+// Shared by every driver thread, the metrics types are all interlocked.
+struct Totals {
+  metrics::Counter sent[Kinds];
+  metrics::Counter acked[Kinds];
+  metrics::Histogram latency[Kinds]; // Microseconds from send to ack.
+  metrics::Counter bytesOut;
+  metrics::Counter bytesIn;
+  metrics::Counter packetsIn;
+  metrics::Counter failed;
+};
+
+// Packets the server rate limits away are never acked, so only this many
+// are waited for per client.
+const size_t MaxUnacked = 1024;
+
+typedef std::chrono::steady_clock Clock;
+
+// A packet waiting for its ack.
+struct Unacked {
+  unsigned int sequence;
+  Kind kind;
+  Clock::time_point stamp;
+};
+
+struct Client {
+  SOCKET socket;
+  std::string alias;
+  bool ready; // The server has acked our alias.
+  unsigned int sequence;
+  unsigned int transfers;
+  std::vector<char> in;
+  std::vector<char> out; // Encoded and not yet taken by the socket.
+  comms::packetQueue packets;
+  std::vector<Unacked> unacked;
+  double due[Kinds]; // Milliseconds into the run.
+};
+
+class Driver {
+  const Options &m_options;
+  Totals &m_totals;
+  std::vector<Client> m_clients;
+  Clock::time_point m_start;
+  unsigned int m_first;
+
+  double Elapsed() const {
+    return std::chrono::duration<double, std::milli>(Clock::now() - m_start)
+        .count();
+  }
+
+  void Queue(Client &c, Kind kind, const comms::Packet &packet) {
+    std::vector<unsigned int> frame;
+    comms::EncodeHeader(packet.hdr, frame);
+    comms::EncodePayload(packet.data, packet.hdr.len, frame);
+    const char *bytes = reinterpret_cast<const char *>(&frame[0]);
+    c.out.insert(c.out.end(), bytes,
+                 bytes + frame.size() * sizeof(unsigned int));
+
+    if (kind == Kinds)
+      return; // Nothing to time.
+    Unacked u{packet.hdr.sequence, kind, Clock::now()};
+    if (c.unacked.size() >= MaxUnacked)
+      c.unacked.erase(c.unacked.begin()); // Dropped by the server, likely.
+    c.unacked.push_back(u);
+    m_totals.sent[kind].Increment();
+  }
+
+  void Send(Client &c, Kind kind) {
+    if (kind == KindChat) {
+      std::string data(c.alias + "|_+_|");
+      data.append(m_options.messageBytes, 'x');
+      Queue(c, kind, comms::Packet{{PKT_MSG, 0, 0, 0, data.length(),
+                                    ++c.sequence, 0},
+                                   data});
+    } else if (kind == KindList) {
+      // Always ask for the full list, that is the expensive one.
+      Queue(c, kind,
+            comms::Packet{{PKT_LST, 0, 0, 0, 0, ++c.sequence, 0}, ""});
+    } else {
+      // A transfer to the room, timed chunk by chunk.
+      unsigned int index = static_cast<unsigned int>(&c - &m_clients[0]);
+      unsigned int id = ((m_first + index) << 12) | (++c.transfers & 0xfff);
+      std::string name("load_" + std::to_string(id) + ".bin");
+      Queue(c, kind, comms::Packet{{PKT_FILE_OUT, 0, m_options.fileChunks, 0,
+                                    name.length(), ++c.sequence, id},
+                                   name});
+      std::string chunk(m_options.chunkBytes, 'f');
+      for (unsigned int i = 0; i < m_options.fileChunks; ++i) {
+        Queue(c, kind, comms::Packet{{PKT_FILE_OUT, 0, m_options.fileChunks,
+                                      i + 1, chunk.length(), ++c.sequence, id},
+                                     chunk});
+      }
+    }
+  }
+
+  void Acked(Client &c, unsigned int sequence) {
+    for (auto u = c.unacked.begin(); u != c.unacked.end(); ++u) {
+      if (u->sequence == sequence) {
+        m_totals.acked[u->kind].Increment();
+        m_totals.latency[u->kind].Record(static_cast<unsigned int>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                Clock::now() - u->stamp)
+                .count()));
+        c.unacked.erase(u);
+        return;
+      }
+    }
+  }
+
+  // Returns false when the connection has gone.
+  bool Service(Client &c, char *stack, double now) {
+    if (!c.out.empty()) {
+      int sent = send(c.socket, &c.out[0], static_cast<int>(c.out.size()), 0);
+      if (sent == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)
+        return false;
+      if (sent > 0) {
+        c.out.erase(c.out.begin(), c.out.begin() + sent);
+        m_totals.bytesOut.Add(sent);
+      }
+    }
+
+    size_t before = c.in.size();
+    bool open = comms::ReadSocketFully(c.socket, stack, c.in);
+    m_totals.bytesIn.Add(c.in.size() - before);
+    comms::QueueCompletePackets(c.in, c.packets);
+    m_totals.packetsIn.Add(c.packets.size());
+    for (auto &p : c.packets) {
+      switch (p.packet.hdr.type) {
+      case PKT_ALIAS_ACK:
+        c.ready = true;
+        break;
+      case PKT_MSG_ACK:
+      case PKT_LST_ACK:
+      case PKT_FILE_OUT_ACK:
+        Acked(c, p.packet.hdr.sequence);
+        break;
+      }
+    }
+    c.packets.clear();
+    if (!open)
+      return false;
+
+    // Keep to the schedule, but don't let a stall turn into a flood.
+    for (int k = 0; c.ready && k < Kinds; ++k) {
+      if (m_options.rates[k] <= 0)
+        continue;
+      double interval = 1000.0 / m_options.rates[k];
+      if (c.due[k] < now - 1000)
+        c.due[k] = now;
+      while (c.due[k] <= now) {
+        Send(c, static_cast<Kind>(k));
+        c.due[k] += interval;
+      }
+    }
+    return true;
+  }
+
+public:
+  Driver(const Options &options, Totals &totals, unsigned int first,
+         unsigned int count)
+      : m_options(options), m_totals(totals), m_first(first) {
+    m_clients.resize(count);
+  }
+
+  // Connect our share of the clients and send their aliases. Returns how
+  // many connected.
+  unsigned int Connect(const SOCKADDR_IN &addr) {
+    unsigned int connected = 0;
+    for (unsigned int i = 0; i < m_clients.size(); ++i) {
+      Client &c = m_clients[i];
+      c.socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+      c.alias = "L" + std::to_string(m_first + i);
+      c.ready = false;
+      c.sequence = 4;
+      c.transfers = 0;
+      if (c.socket == INVALID_SOCKET ||
+          connect(c.socket, (LPSOCKADDR)&addr, sizeof(addr)) == SOCKET_ERROR) {
+        if (c.socket != INVALID_SOCKET)
+          ::closesocket(c.socket);
+        c.socket = INVALID_SOCKET;
+        m_totals.failed.Increment();
+        continue;
+      }
+      unsigned long mode = 1;
+      ioctlsocket(c.socket, FIONBIO, &mode); //  Non-blocking.
+
+      // The backlog sent with the alias ack is read and ignored.
+      Queue(c, Kinds, comms::Packet{{PKT_ALIAS, 0, 0, 0, c.alias.length(), 4,
+                                     0},
+                                    c.alias});
+      ++connected;
+    }
+    return connected;
+  }
+
+  void Run() {
+    m_start = Clock::now();
+
+    // Spread the first sends out so the clients don't all fire at once.
+    for (unsigned int i = 0; i < m_clients.size(); ++i) {
+      for (int k = 0; k < Kinds; ++k) {
+        m_clients[i].due[k] =
+            m_options.rates[k] > 0
+                ? (1000.0 / m_options.rates[k]) * i / m_clients.size()
+                : 0;
+      }
+    }
+
+    char stack[comms::TransferSize];
+    double end = m_options.seconds * 1000.0;
+    double now;
+    while ((now = Elapsed()) < end) {
+      for (auto &c : m_clients) {
+        if (c.socket != INVALID_SOCKET && !Service(c, stack, now)) {
+          ::closesocket(c.socket);
+          c.socket = INVALID_SOCKET;
+          m_totals.failed.Increment();
+        }
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    for (auto &c : m_clients) {
+      if (c.socket != INVALID_SOCKET)
+        ::closesocket(c.socket);
+    }
+  }
+};
+
+} // namespace load
+
+int main(int argc, char *argv[]) {
+  load::Options options{"127.0.0.1", CHATMIUM_PORT_NR, 100, 1, 30,
+                        {1.0, 0.0, 0.0}, 32, 4096, 16};
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-host" && i + 1 < argc) {
+      options.host = argv[++i];
+    } else if (arg == "-port" && i + 1 < argc) {
+      options.port = static_cast<unsigned short>(std::stoul(argv[++i]));
+    } else if (arg == "-clients" && i + 1 < argc) {
+      options.clients = std::stoul(argv[++i]);
+    } else if (arg == "-threads" && i + 1 < argc) {
+      // Clients are split evenly between this many driver threads.
+      options.threads = std::stoul(argv[++i]);
+    } else if (arg == "-seconds" && i + 1 < argc) {
+      options.seconds = std::stoul(argv[++i]);
+    } else if (arg == "-chat" && i + 1 < argc) {
+      // Messages a second, per client.
+      options.rates[load::KindChat] = std::stod(argv[++i]);
+    } else if (arg == "-list" && i + 1 < argc) {
+      // Full user list fetches a second, per client.
+      options.rates[load::KindList] = std::stod(argv[++i]);
+    } else if (arg == "-file" && i + 1 < argc) {
+      // File transfers to the room a second, per client.
+      options.rates[load::KindFile] = std::stod(argv[++i]);
+    } else if (arg == "-msg" && i + 1 < argc) {
+      options.messageBytes = std::stoul(argv[++i]);
+    } else if (arg == "-chunk" && i + 1 < argc) {
+      options.chunkBytes = std::stoul(argv[++i]);
+    } else if (arg == "-chunks" && i + 1 < argc) {
+      options.fileChunks = std::stoul(argv[++i]);
+    } else {
+      std::cout << "Usage: FileStreamLoad [-host ip] [-port n] [-clients n]"
+                << " [-threads n] [-seconds n] [-chat rate] [-list rate]"
+                << " [-file rate] [-msg bytes] [-chunk bytes] [-chunks n]"
+                << std::endl;
+      return 1;
+    }
+  }
+  if (options.threads == 0)
+    options.threads = 1;
+  if (options.chunkBytes > comms::TransferSize - comms::HeaderSize)
+    options.chunkBytes = comms::TransferSize - comms::HeaderSize;
+
+  // The server limits every client to DefaultRateLimits unless it was
+  // started with -rate, anything over that is measured as throttling.
+  WSADATA w;
+  if (WSAStartup(0x0202, &w)) {
+    std::cout << "Could not initialize Winsock." << std::endl;
+    return 1;
+  }
+
+  SOCKADDR_IN addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(options.port);
+  addr.sin_addr.s_addr = inet_addr(options.host.c_str());
+
+  load::Totals totals;
+  std::vector<std::unique_ptr<load::Driver>> drivers;
+  unsigned int connected = 0;
+  load::Clock::time_point connectStart = load::Clock::now();
+  for (unsigned int t = 0; t < options.threads; ++t) {
+    unsigned int first = options.clients * t / options.threads;
+    unsigned int last = options.clients * (t + 1) / options.threads;
+    drivers.emplace_back(
+        new load::Driver(options, totals, first, last - first));
+    connected += drivers.back()->Connect(addr);
+  }
+  long long connectMillis =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          load::Clock::now() - connectStart)
+          .count();
+  std::cout << "Connected " << connected << " of " << options.clients
+            << " clients in " << connectMillis << " ms" << std::endl;
+  if (connected == 0)
+    return 1;
+
+  std::vector<std::thread> threads;
+  for (auto &d : drivers)
+    threads.emplace_back(&load::Driver::Run, d.get());
+  for (auto &t : threads)
+    t.join();
+
+  double seconds = options.seconds ? options.seconds : 1;
+  std::cout << "kind      sent     acked    acked/s   p50us   p90us   p99us"
+            << "  p999us" << std::endl;
+  for (int k = 0; k < load::Kinds; ++k) {
+    const metrics::Histogram &h = totals.latency[k];
+    std::cout << std::left << std::setw(6) << load::KindNames[k] << std::right
+              << " " << std::setw(8) << totals.sent[k].Value() << "  "
+              << std::setw(8) << totals.acked[k].Value() << "  "
+              << std::setw(9) << std::fixed << std::setprecision(1)
+              << totals.acked[k].Value() / seconds << "  " << std::setw(6)
+              << h.Quantile(0.5) << "  " << std::setw(6) << h.Quantile(0.9)
+              << "  " << std::setw(6) << h.Quantile(0.99) << "  "
+              << std::setw(6) << h.Quantile(0.999) << std::endl;
+  }
+  std::cout << "out " << totals.bytesOut.Value() / seconds / 1024
+            << " KB/s, in " << totals.bytesIn.Value() / seconds / 1024
+            << " KB/s, "
+            << totals.packetsIn.Value() / seconds << " packets/s in, "
+            << totals.failed.Value() << " connections failed" << std::endl;
+  return 0;
+}
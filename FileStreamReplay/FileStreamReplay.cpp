@@ -0,0 +1,333 @@
+// FileStreamReplay feeds a capture taken with FileStream -capture into a
+// server running in this process, to measure it against real traffic. With
+// -compare it is replayed on each socket backend and they are reported side
+// by side.
+#include "../chat_common.hpp"
+#include <map>
+
+namespace replay {
+
+struct Options {
+  std::string path;
+  double speed; // 1 replays as captured, 0 as fast as the server takes it.
+  unsigned short port;
+  bool completionPort;
+  unsigned int readers; // Pipeline stages, 0 for none.
+  unsigned int writers;
+  DWORD flushMillis; // How long small writes may wait for company.
+  bool compare;      // Replay on poll, then iocp, and report them together.
+};
+
+// After the last record, wait this long for the server to go quiet.
+const DWORD SettleMillis = 1000;
+
+// Capture time, mapped onto the wall clock by the speed. At speed 0 every
+// record is due as soon as the one before it went.
+class Clock {
+  LARGE_INTEGER m_frequency;
+  LARGE_INTEGER m_start;
+  double m_speed;
+
+public:
+  explicit Clock(double speed) : m_speed(speed) {
+    QueryPerformanceFrequency(&m_frequency);
+    QueryPerformanceCounter(&m_start);
+  }
+
+  double WallMillis() const {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (now.QuadPart - m_start.QuadPart) * 1000.0 / m_frequency.QuadPart;
+  }
+
+  bool Due(unsigned long long micros) const {
+    return m_speed <= 0 || micros / 1000.0 <= WallMillis() * m_speed;
+  }
+};
+
+// A connection from the capture, replayed over loopback.
+struct Connection {
+  SOCKET socket;
+  std::vector<char> out; // Captured input the socket has not taken yet.
+};
+
+struct Totals {
+  unsigned long long records;
+  unsigned long long connections;
+  unsigned long long failed;
+  unsigned long long bytesFed;
+  unsigned long long bytesCaptured; // What the server sent in the capture.
+  unsigned long long bytesReceived; // What it sends us now.
+  unsigned long long lastMicros;
+};
+
+class Replayer {
+  const Options &m_options;
+  SOCKADDR_IN m_addr;
+  std::map<unsigned int, Connection> m_connections; // By captured socket.
+  char m_stack[comms::TransferSize];
+
+  Connection &Open(unsigned int id) {
+    Close(id);
+    Connection &c = m_connections[id];
+    c.socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (c.socket == INVALID_SOCKET ||
+        connect(c.socket, (LPSOCKADDR)&m_addr, sizeof(m_addr)) ==
+            SOCKET_ERROR) {
+      if (c.socket != INVALID_SOCKET)
+        ::closesocket(c.socket);
+      c.socket = INVALID_SOCKET;
+      ++totals.failed;
+      return c;
+    }
+    unsigned long mode = 1;
+    ioctlsocket(c.socket, FIONBIO, &mode); //  Non-blocking.
+    ++totals.connections;
+    return c;
+  }
+
+  void Close(unsigned int id) {
+    auto it = m_connections.find(id);
+    if (it == m_connections.end())
+      return;
+    if (it->second.socket != INVALID_SOCKET)
+      ::closesocket(it->second.socket);
+    m_connections.erase(it);
+  }
+
+  // Feed what is waiting and throw away what the server sent. Returns the
+  // bytes moved either way.
+  unsigned long long Pump() {
+    unsigned long long moved = 0;
+    for (auto &entry : m_connections) {
+      Connection &c = entry.second;
+      if (c.socket == INVALID_SOCKET)
+        continue;
+
+      if (!c.out.empty()) {
+        int sent = send(c.socket, &c.out[0], static_cast<int>(c.out.size()), 0);
+        if (sent > 0) {
+          c.out.erase(c.out.begin(), c.out.begin() + sent);
+          moved += sent;
+        } else if (WSAGetLastError() != WSAEWOULDBLOCK) {
+          c.out.clear();
+        }
+      }
+
+      std::vector<char> in;
+      bool open = comms::ReadSocketFully(c.socket, m_stack, in);
+      totals.bytesReceived += in.size();
+      moved += in.size();
+      if (!open) {
+        // The server hung up, as it may have in the capture too.
+        ::closesocket(c.socket);
+        c.socket = INVALID_SOCKET;
+      }
+    }
+    return moved;
+  }
+
+public:
+  Totals totals;
+
+  explicit Replayer(const Options &options) : m_options(options) {
+    ZeroMemory(&m_addr, sizeof(m_addr));
+    m_addr.sin_family = AF_INET;
+    m_addr.sin_port = htons(options.port);
+    m_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    totals = Totals{0, 0, 0, 0, 0, 0, 0};
+  }
+
+  ~Replayer() {
+    for (auto &entry : m_connections) {
+      if (entry.second.socket != INVALID_SOCKET)
+        ::closesocket(entry.second.socket);
+    }
+  }
+
+  bool Run(Clock &clock) {
+    capture::Reader reader;
+    if (!reader.Open(m_options.path)) {
+      std::cout << "Not a capture: " << m_options.path.c_str() << std::endl;
+      return false;
+    }
+
+    capture::RecordHeader header;
+    std::string data;
+    while (reader.Next(header, data)) {
+      while (!clock.Due(header.micros)) {
+        Pump();
+        Sleep(1);
+      }
+      ++totals.records;
+      totals.lastMicros = header.micros;
+
+      switch (header.kind) {
+      case capture::KindOpen:
+        Open(header.connection);
+        break;
+      case capture::KindIn: {
+        // Clients which were there before the capture started still count.
+        auto it = m_connections.find(header.connection);
+        Connection &c =
+            it == m_connections.end() ? Open(header.connection) : it->second;
+        c.out.insert(c.out.end(), data.begin(), data.end());
+        totals.bytesFed += data.size();
+      } break;
+      case capture::KindOut:
+        totals.bytesCaptured += data.size();
+        break;
+      case capture::KindClose:
+        Close(header.connection);
+        break;
+      }
+      Pump();
+    }
+
+    // Give the server its last tick or two to route what it was given.
+    DWORD quiet = GetTickCount();
+    while (GetTickCount() - quiet < SettleMillis) {
+      if (Pump())
+        quiet = GetTickCount();
+      Sleep(1);
+    }
+    return true;
+  }
+};
+
+// What one replay into one server came to.
+struct Result {
+  Totals totals;
+  net::IoStats stats;
+  double seconds;
+};
+
+// Replay the capture into a server of our own on |options.port|.
+bool Replay(const Options &options, Result &result) {
+  // The server reads the wall clock, not ours, so its rate limits are
+  // scaled to match. Everything in a capture already got past them once.
+  net::NetServer server(options.port);
+  for (int c = 0; c < net::PacketClasses; ++c) {
+    net::RateLimit limit = net::DefaultRateLimits[c];
+    double scale = options.speed > 0 ? options.speed : 1000.0;
+    server.SetRateLimit(static_cast<net::PacketClass>(c),
+                        static_cast<unsigned int>(limit.rate * scale),
+                        static_cast<unsigned int>(limit.burst * scale));
+  }
+  server.SetFlushDeadline(options.flushMillis);
+  if (options.readers)
+    server.UsePipeline(options.readers, options.writers);
+  if (options.completionPort)
+    server.UseCompletionPort();
+
+  Clock clock(options.speed);
+  Replayer replayer(options);
+  if (!replayer.Run(clock))
+    return false;
+  double wallMillis = clock.WallMillis();
+
+  result.totals = replayer.totals;
+  server.GetIoStats(result.stats);
+  result.seconds = wallMillis > 0 ? wallMillis / 1000.0 : 1;
+  return true;
+}
+
+const char *BackendName(net::IoBackend backend) {
+  return backend == net::IoCompletion
+             ? "iocp"
+             : backend == net::IoPipeline ? "pipeline" : "poll";
+}
+
+void Report(const Result &result) {
+  const Totals &t = result.totals;
+  const net::IoStats &stats = result.stats;
+  double seconds = result.seconds;
+  std::cout << "Replayed " << t.records << " records, " << t.connections
+            << " connections (" << t.failed << " failed), "
+            << t.lastMicros / 1000000.0 << " s captured in " << seconds
+            << " s" << std::endl;
+  std::cout << "fed " << t.bytesFed / 1024 << " KB, server sent "
+            << t.bytesReceived / 1024 << " KB (" << t.bytesCaptured / 1024
+            << " KB in the capture)" << std::endl;
+  std::cout << BackendName(stats.backend) << " in " << stats.packetsIn
+            << " out " << stats.packetsOut << " packets, "
+            << stats.packetsOut / seconds << " out/s, recv " << stats.recvCalls
+            << " send " << stats.sendCalls << " calls, p50 "
+            << stats.p50Micros << "us p99 " << stats.p99Micros << "us"
+            << std::endl;
+}
+
+// One line per backend, so the runs of a -compare line up.
+void ReportLine(const Result &result) {
+  const net::IoStats &stats = result.stats;
+  double in = stats.packetsIn ? static_cast<double>(stats.packetsIn) : 1;
+  double out = stats.packetsOut ? static_cast<double>(stats.packetsOut) : 1;
+  std::cout << BackendName(stats.backend) << "\t" << stats.recvCalls / in
+            << "\t\t" << stats.sendCalls / out << "\t\t"
+            << (stats.recvCalls + stats.sendCalls) / in << "\t\t"
+            << stats.p50Micros << "us\t" << stats.p99Micros << "us"
+            << std::endl;
+}
+
+} // namespace replay
+
+int main(int argc, char *argv[]) {
+  replay::Options options{"", 1.0, CHATMIUM_PORT_NR + 100, false, 0, 0, 0,
+                          false};
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-speed" && i + 1 < argc) {
+      // How many times faster than captured, 0 for as fast as it goes.
+      options.speed = std::stod(argv[++i]);
+    } else if (arg == "-port" && i + 1 < argc) {
+      // The loopback port the server in this process listens on.
+      options.port = static_cast<unsigned short>(std::stoul(argv[++i]));
+    } else if (arg == "-io" && i + 1 < argc) {
+      options.completionPort = std::string(argv[++i]) == "iocp";
+    } else if (arg == "-pipeline" && i + 2 < argc) {
+      options.readers = std::stoul(argv[++i]);
+      options.writers = std::stoul(argv[++i]);
+    } else if (arg == "-flush" && i + 1 < argc) {
+      options.flushMillis = std::stoul(argv[++i]);
+    } else if (arg == "-compare") {
+      // Replay twice, on poll and then on iocp, one port up.
+      options.compare = true;
+    } else if (options.path.empty() && arg[0] != '-') {
+      options.path = arg;
+    } else {
+      options.path.clear();
+      break;
+    }
+  }
+  if (options.path.empty()) {
+    std::cout << "Usage: FileStreamReplay capture [-speed n] [-port n]"
+              << " [-io poll|iocp] [-pipeline readers writers]"
+              << " [-flush millis] [-compare]" << std::endl;
+    return 1;
+  }
+
+  if (!options.compare) {
+    replay::Result result;
+    if (!replay::Replay(options, result))
+      return 1;
+    replay::Report(result);
+    return 0;
+  }
+
+  // The first server never stops, so the second gets a port of its own.
+  replay::Result results[2];
+  for (int run = 0; run < 2; ++run) {
+    replay::Options backend(options);
+    backend.completionPort = run == 1;
+    backend.port = static_cast<unsigned short>(options.port + run);
+    if (!replay::Replay(backend, results[run]))
+      return 1;
+    replay::Report(results[run]);
+  }
+  std::cout << "backend\trecv/pkt in\tsend/pkt out\tcalls/pkt in\tp50\tp99"
+            << std::endl;
+  for (auto &result : results)
+    replay::ReportLine(result);
+  return 0;
+}
@@ -0,0 +1,244 @@
+#ifndef _BINLOG_HPP
+#define _BINLOG_HPP
+#pragma once
+
+#include <Windows.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Logging off the hot paths. A log call copies its format and arguments
+// into a ring owned by the calling thread, and a background thread turns
+// them into text. Levels below BINLOG_LEVEL compile to nothing, arguments
+// and all.
+#ifndef BINLOG_LEVEL
+#define BINLOG_LEVEL 1
+#endif
+
+#if BINLOG_LEVEL <= 0
+#define LOG_DEBUG(...) binlog::logger.Log(binlog::LevelDebug, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+
+#if BINLOG_LEVEL <= 1
+#define LOG_INFO(...) binlog::logger.Log(binlog::LevelInfo, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
+
+#define LOG_WARN(...) binlog::logger.Log(binlog::LevelWarn, __VA_ARGS__)
+
+namespace binlog {
+
+enum Level { LevelDebug, LevelInfo, LevelWarn };
+
+// Records each thread may have waiting, any more are dropped and counted.
+// A power of two, so a slot is a count masked and stays right as it wraps.
+const unsigned long RingRecords = 4096;
+
+// A record holds this many integers and one string, cut short to fit.
+const unsigned int MaxArgs = 4;
+const unsigned int TextBytes = 48;
+
+// How often the background thread writes out what has been logged.
+const DWORD DrainMillis = 10;
+
+struct Record {
+  const char *format; // A literal, printf style, %s is the text.
+  LONGLONG stamp;     // Orders the records of different threads.
+  unsigned char level;
+  unsigned char args;
+  long long arg[MaxArgs];
+  char text[TextBytes];
+};
+
+// The owning thread moves the head, the drain moves the tail. Both only
+// count up, wrapping, and head - tail is what is waiting.
+struct Ring {
+  volatile unsigned long head;
+  volatile unsigned long tail;
+  volatile LONG dropped;
+  Record records[RingRecords];
+};
+
+void Put(Record &r, const char *text, size_t length) {
+  length = length < TextBytes - 1 ? length : TextBytes - 1;
+  memcpy(r.text, text, length);
+  r.text[length] = 0;
+}
+void Put(Record &r, const std::string &text) {
+  Put(r, text.c_str(), text.length());
+}
+void Put(Record &r, const char *text) { Put(r, text, strlen(text)); }
+template <typename T> void Put(Record &r, const T &value) {
+  if (r.args < MaxArgs)
+    r.arg[r.args++] = static_cast<long long>(value);
+}
+
+inline void Pack(Record &r) {}
+template <typename T, typename... Rest>
+void Pack(Record &r, const T &value, const Rest &... rest) {
+  Put(r, value);
+  Pack(r, rest...);
+}
+
+// Expand |r| as printf would. Integer conversions all take a long long,
+// whatever length the format gives them.
+void Format(const Record &r, std::string &out) {
+  unsigned int next = 0;
+  char buffer[64];
+  for (const char *p = r.format; *p; ++p) {
+    if (*p != '%') {
+      out.push_back(*p);
+      continue;
+    }
+    if (p[1] == '%') {
+      out.push_back('%');
+      ++p;
+      continue;
+    }
+
+    std::string spec("%");
+    const char *q = p + 1;
+    for (; *q && !strchr("diuxXs", *q); ++q) {
+      if (!strchr("lhzIL", *q))
+        spec.push_back(*q);
+    }
+    if (!*q)
+      break;
+    if (*q == 's') {
+      out.append(r.text);
+    } else {
+      spec.append("ll");
+      spec.push_back(*q);
+      sprintf_s(buffer, sizeof(buffer), spec.c_str(),
+                next < r.args ? r.arg[next++] : 0ll);
+      out.append(buffer);
+    }
+    p = q;
+  }
+  out.push_back('\n');
+}
+
+class Logger {
+  DWORD m_slot;
+  CRITICAL_SECTION m_mutex; // Guards m_rings.
+  CRITICAL_SECTION m_drain; // One drain at a time.
+  std::vector<Ring *> m_rings; // Never freed, a thread may log until exit.
+  HANDLE m_thread;
+  volatile LONG m_stop;
+
+  static DWORD WINAPI DrainThread(LPVOID param) {
+    Logger *logger = reinterpret_cast<Logger *>(param);
+    while (!logger->m_stop) {
+      Sleep(DrainMillis);
+      logger->Drain();
+    }
+    return 0;
+  }
+
+  Ring *ThreadRing() {
+    Ring *ring = reinterpret_cast<Ring *>(TlsGetValue(m_slot));
+    if (ring)
+      return ring;
+
+    ring = new Ring;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+    TlsSetValue(m_slot, ring);
+    EnterCriticalSection(&m_mutex);
+    m_rings.push_back(ring);
+    // Only processes which log pay for the thread.
+    if (!m_thread)
+      m_thread = CreateThread(NULL, 0, DrainThread, this, 0, NULL);
+    LeaveCriticalSection(&m_mutex);
+    return ring;
+  }
+
+public:
+  Logger() : m_slot(TlsAlloc()), m_thread(NULL), m_stop(0) {
+    InitializeCriticalSection(&m_mutex);
+    InitializeCriticalSection(&m_drain);
+  }
+
+  // Whatever is still in the rings is written before we go.
+  ~Logger() {
+    InterlockedExchange(&m_stop, 1);
+    if (m_thread) {
+      WaitForSingleObject(m_thread, 1000);
+      CloseHandle(m_thread);
+    }
+    Drain();
+  }
+
+  template <typename... Args>
+  void Log(Level level, const char *format, const Args &... args) {
+    Ring *ring = ThreadRing();
+    unsigned long head = ring->head;
+    if (head - ring->tail >= RingRecords) {
+      InterlockedIncrement(&ring->dropped);
+      return;
+    }
+
+    Record &r = ring->records[head & (RingRecords - 1)];
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    r.format = format;
+    r.stamp = now.QuadPart;
+    r.level = static_cast<unsigned char>(level);
+    r.args = 0;
+    r.text[0] = 0;
+    Pack(r, args...);
+    MemoryBarrier();
+    ring->head = head + 1; // Publish it.
+  }
+
+  // Write out everything logged so far, in the order it was logged.
+  void Drain() {
+    EnterCriticalSection(&m_drain);
+    EnterCriticalSection(&m_mutex);
+    std::vector<Ring *> rings(m_rings);
+    LeaveCriticalSection(&m_mutex);
+
+    std::vector<Record> batch;
+    LONG dropped = 0;
+    for (auto ring : rings) {
+      unsigned long head = ring->head;
+      MemoryBarrier(); // Read the records after the head that covers them.
+      for (unsigned long i = ring->tail; i != head; ++i)
+        batch.push_back(ring->records[i & (RingRecords - 1)]);
+      MemoryBarrier(); // And before handing their slots back.
+      ring->tail = head;
+      dropped += InterlockedExchange(&ring->dropped, 0);
+    }
+    std::stable_sort(batch.begin(), batch.end(),
+                     [](const Record &a, const Record &b) {
+      return a.stamp < b.stamp;
+    });
+
+    std::string text;
+    for (auto &r : batch) {
+      if (r.level == LevelWarn)
+        text.append("Warning: ");
+      Format(r, text);
+    }
+    if (dropped)
+      text.append("(" + std::to_string(dropped) + " log lines dropped)\n");
+    if (!text.empty()) {
+      fwrite(text.data(), 1, text.length(), stdout);
+      fflush(stdout);
+    }
+    LeaveCriticalSection(&m_drain);
+  }
+};
+
+// One logger for the process.
+Logger logger;
+
+} // namespace binlog
+
+#endif // _BINLOG_HPP
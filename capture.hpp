@@ -0,0 +1,169 @@
+#ifndef _CAPTURE_HPP
+#define _CAPTURE_HPP
+#pragma once
+
+#include <WinSock2.h>
+#include <Windows.h>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+namespace capture {
+
+// A capture starts with Magic and is then nothing but records, each a
+// RecordHeader followed by |bytes| of data. Open records carry the peer's
+// address, In and Out records the frames exactly as they crossed the wire.
+const char Magic[8] = {'C', 'H', 'A', 'T', 'C', 'A', 'P', '1'};
+
+enum Kind { KindOpen, KindIn, KindOut, KindClose };
+
+#pragma pack(push, 1)
+struct RecordHeader {
+  unsigned long long micros; // Since the capture started.
+  unsigned int connection;   // The server's socket, reused after a close.
+  unsigned char kind;
+  unsigned int bytes;
+};
+#pragma pack(pop)
+
+// Stop writing once a capture is this big, it is meant to be left running
+// on a live server.
+const unsigned long long MaxCaptureBytes = 512ull * 1024 * 1024;
+
+// How long a record may sit in the stdio buffer.
+const unsigned long long FlushMicros = 1000000;
+
+// Appends records from any thread, each record is written whole under the
+// writer's own lock.
+class Writer {
+  FILE *m_file;
+  CRITICAL_SECTION m_mutex;
+  LARGE_INTEGER m_frequency;
+  LARGE_INTEGER m_start;
+  unsigned long long m_written;
+  unsigned long long m_flushed; // Micros at the last flush.
+
+  void Write(Kind kind, SOCKET s, const WSABUF *buffers, DWORD count) {
+    RecordHeader header;
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    header.micros = static_cast<unsigned long long>(
+        (now.QuadPart - m_start.QuadPart) * 1000000.0 / m_frequency.QuadPart);
+    header.connection = static_cast<unsigned int>(s);
+    header.kind = static_cast<unsigned char>(kind);
+    header.bytes = 0;
+    for (DWORD i = 0; i < count; ++i)
+      header.bytes += buffers[i].len;
+
+    EnterCriticalSection(&m_mutex);
+    if (m_file) {
+      fwrite(&header, sizeof(header), 1, m_file);
+      for (DWORD i = 0; i < count; ++i)
+        fwrite(buffers[i].buf, 1, buffers[i].len, m_file);
+      m_written += sizeof(header) + header.bytes;
+
+      if (m_written >= MaxCaptureBytes) {
+        std::cout << "Capture is full, stopped writing." << std::endl;
+        fclose(m_file);
+        m_file = nullptr;
+      } else if (header.micros - m_flushed >= FlushMicros) {
+        fflush(m_file);
+        m_flushed = header.micros;
+      }
+    }
+    LeaveCriticalSection(&m_mutex);
+  }
+
+public:
+  Writer() : m_file(nullptr), m_written(0), m_flushed(0) {
+    InitializeCriticalSection(&m_mutex);
+    QueryPerformanceFrequency(&m_frequency);
+  }
+
+  ~Writer() {
+    Close();
+    DeleteCriticalSection(&m_mutex);
+  }
+
+  bool Open(const std::string &path) {
+    Close();
+    EnterCriticalSection(&m_mutex);
+    m_file = fopen(path.c_str(), "wb");
+    if (m_file) {
+      setvbuf(m_file, nullptr, _IOFBF, 1 << 16);
+      fwrite(Magic, sizeof(Magic), 1, m_file);
+      QueryPerformanceCounter(&m_start);
+      m_written = sizeof(Magic);
+      m_flushed = 0;
+    }
+    LeaveCriticalSection(&m_mutex);
+    return m_file != nullptr;
+  }
+
+  void Close() {
+    EnterCriticalSection(&m_mutex);
+    if (m_file)
+      fclose(m_file);
+    m_file = nullptr;
+    LeaveCriticalSection(&m_mutex);
+  }
+
+  bool IsOpen() const { return m_file != nullptr; }
+
+  void Record(Kind kind, SOCKET s, const char *data = nullptr,
+              unsigned int bytes = 0) {
+    if (!m_file)
+      return;
+    WSABUF buffer;
+    buffer.buf = const_cast<char *>(data);
+    buffer.len = bytes;
+    Write(kind, s, &buffer, 1);
+  }
+
+  // A record of the |count| buffers back to back, as one WSASend sends.
+  void Record(Kind kind, SOCKET s, const WSABUF *buffers, DWORD count) {
+    if (m_file)
+      Write(kind, s, buffers, count);
+  }
+};
+
+class Reader {
+  FILE *m_file;
+
+public:
+  Reader() : m_file(nullptr) {}
+  ~Reader() {
+    if (m_file)
+      fclose(m_file);
+  }
+
+  // False if |path| can't be read or isn't a capture.
+  bool Open(const std::string &path) {
+    m_file = fopen(path.c_str(), "rb");
+    if (!m_file)
+      return false;
+    char magic[sizeof(Magic)];
+    if (fread(magic, sizeof(magic), 1, m_file) != 1 ||
+        memcmp(magic, Magic, sizeof(Magic)) != 0) {
+      fclose(m_file);
+      m_file = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  // The next record, false at the end. A record cut short by a crash
+  // counts as the end.
+  bool Next(RecordHeader &header, std::string &data) {
+    if (!m_file || fread(&header, sizeof(header), 1, m_file) != 1)
+      return false;
+    data.resize(header.bytes);
+    return header.bytes == 0 ||
+           fread(&data[0], 1, header.bytes, m_file) == header.bytes;
+  }
+};
+
+} // namespace capture
+
+#endif // _CAPTURE_HPP
@@ -4,15 +4,38 @@
 
 #include <ws2tcpip.h>
 #include <WinSock2.h>
+#include <wincrypt.h>
+#include <algorithm>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "capture.hpp"
+#include "completion_reader.hpp"
+#include "discovery.hpp"
+#include "lockprof.hpp"
+#include "message_log.hpp"
+#include "metrics.hpp"
+#include "mpsc_queue.hpp"
 #include "print_structs.hpp"
+#include "ring_queue.hpp"
+#include "slab.hpp"
+#include "slot_map.hpp"
+#include "trace.hpp"
 
 //#define DEBUG_MODE 1
 //#define USE_FLATE 1
 
+// Debug mode logs every packet.
+#ifdef DEBUG_MODE
+#define BINLOG_LEVEL 0
+#endif
+#include "binlog.hpp"
+
 #ifdef USE_FLATE
 #include "zlib.h"
 #pragma comment(lib, "../zlibstatic.lib")
@@ -33,6 +56,7 @@ There should also be a global queue for clients.
 
 #pragma comment(lib, "Ws2_32.lib")
 #pragma comment(lib, "Mswsock.lib")
+#pragma comment(lib, "Advapi32.lib")
 
 namespace comms {
 
@@ -76,6 +100,33 @@ namespace comms {
 #define PKT_MSG_LEAVE 0x00018
 #define PKT_MSG_LEAVE_ACK 0x00019
 
+// The client resumes a dropped session with the token from PKT_ALIAS_ACK.
+#define PKT_RESUME 0x00020
+#define PKT_RESUME_ACK 0x00021
+
+// The client joins or leaves a named channel. Chat and files go to the
+// channel joined last, acks carry the channel id in the header id.
+#define PKT_CHAN_JOIN 0x00022
+#define PKT_CHAN_JOIN_ACK 0x00023
+#define PKT_CHAN_LEAVE 0x00024
+#define PKT_CHAN_LEAVE_ACK 0x00025
+
+// Servers link up as peers with PKT_PEER_HELLO, the header id holds the node
+// id, the data the shared peer secret and flags is 1 on the reply. Peers then
+// swap PKT_RELAY batches.
+#define PKT_PEER_HELLO 0x00026
+#define PKT_RELAY 0x00027
+
+// A restarted server takes the sockets of the old one, the flags say which
+// step of the handoff a packet is.
+#define PKT_HANDOFF 0x00028
+
+// Acknowledges client packets in bulk, for clients which set AckCumulative
+// in the flags of PKT_ALIAS or PKT_RESUME. They get no PKT_MSG_ACK,
+// PKT_QRY_ACK, nor a PKT_PVT_ACK or PKT_FILE_OUT_ACK unless the message
+// or file went nowhere. The flags say which lanes it carries, see AckLaneChat.
+#define PKT_ACK 0x00029
+
 std::string CharToMessageType(unsigned short msgtype) {
   switch (msgtype) {
   case PKT_ALIAS:
@@ -114,6 +165,26 @@ std::string CharToMessageType(unsigned short msgtype) {
     return "msg_leave";
   case PKT_MSG_LEAVE_ACK:
     return "msg_leave_ack";
+  case PKT_RESUME:
+    return "resume";
+  case PKT_RESUME_ACK:
+    return "resume_ack";
+  case PKT_CHAN_JOIN:
+    return "chan_join";
+  case PKT_CHAN_JOIN_ACK:
+    return "chan_join_ack";
+  case PKT_CHAN_LEAVE:
+    return "chan_leave";
+  case PKT_CHAN_LEAVE_ACK:
+    return "chan_leave_ack";
+  case PKT_PEER_HELLO:
+    return "peer_hello";
+  case PKT_RELAY:
+    return "relay";
+  case PKT_HANDOFF:
+    return "handoff";
+  case PKT_ACK:
+    return "ack";
   }
   return "unk";
 }
@@ -155,6 +226,26 @@ unsigned short MessageTypeToChar(const std::string &type) {
     return PKT_MSG_LEAVE;
   if (type == "msg_leave_ack")
     return PKT_MSG_LEAVE_ACK;
+  if (type == "resume")
+    return PKT_RESUME;
+  if (type == "resume_ack")
+    return PKT_RESUME_ACK;
+  if (type == "chan_join")
+    return PKT_CHAN_JOIN;
+  if (type == "chan_join_ack")
+    return PKT_CHAN_JOIN_ACK;
+  if (type == "chan_leave")
+    return PKT_CHAN_LEAVE;
+  if (type == "chan_leave_ack")
+    return PKT_CHAN_LEAVE_ACK;
+  if (type == "peer_hello")
+    return PKT_PEER_HELLO;
+  if (type == "relay")
+    return PKT_RELAY;
+  if (type == "handoff")
+    return PKT_HANDOFF;
+  if (type == "ack")
+    return PKT_ACK;
   return 0;
 }
 
@@ -171,13 +262,93 @@ struct Header {
 
 const int HeaderSize = sizeof(Header);
 
+// A client sends one chat or control packet and one file chunk at a time,
+// and they take their sequences from one counter. So acks come in two
+// lanes, each naming the newest sequence it saw and a bitmap of the 32
+// before it, bit 0 being the one just below.
+//
+// PKT_ACK sets a flag for each lane it carries. The chat lane goes in the
+// sequence and parts, the file lane in the id and current.
+const unsigned int AckLaneChat = 0;
+const unsigned int AckLaneFile = 1;
+const unsigned int AckLanes = 2;
+
+// Set in the flags of PKT_ALIAS or PKT_RESUME by clients which take PKT_ACK.
+const unsigned int AckCumulative = 0x100;
+
+// Set in the flags of PKT_FILE_OUT_ACK when the user a file was for is gone,
+// the id names the file so the sender can stop sending it.
+const unsigned int FileTargetGone = 1;
+
+// Any packet the server sends such a client may carry one lane of ack in
+// the flags above the low byte, which is all any packet uses of them.
+// Client sequences are 16 bits, and 6 bits of the bitmap fit beside one.
+const unsigned int AckPiggyback = 0x80000000;
+const unsigned int AckPiggybackFile = 0x40000000;
+const unsigned int AckPiggybackBits = 0x3F;
+const unsigned int AckFlagsMask = 0xFFFFFF00;
+
+// Let |header| carry an ack for |lane|.
+void PiggybackAck(Header &header, unsigned int lane, unsigned int newest,
+                  unsigned int bits) {
+  header.flags = (header.flags & ~AckFlagsMask) | AckPiggyback |
+                 (lane == AckLaneFile ? AckPiggybackFile : 0) |
+                 (newest & 0xFFFF) << 8 | (bits & AckPiggybackBits) << 24;
+}
+
+// Take the ack |header| carries out of its flags, false when it has none.
+bool TakePiggybackedAck(Header &header, unsigned int &lane,
+                        unsigned int &newest, unsigned int &bits) {
+  if (!(header.flags & AckPiggyback))
+    return false;
+  lane = header.flags & AckPiggybackFile ? AckLaneFile : AckLaneChat;
+  newest = (header.flags >> 8) & 0xFFFF;
+  bits = (header.flags >> 24) & AckPiggybackBits;
+  header.flags &= ~AckFlagsMask;
+  return true;
+}
+
+// Whether an ack naming |newest| and the |bits| before it covers
+// |sequence|. Client sequences wrap at 16 bits.
+bool AckCovers(unsigned int newest, unsigned int bits, unsigned int sequence) {
+  unsigned int behind = (newest - sequence) & 0xFFFF;
+  return behind == 0 || (behind <= 32 && ((bits >> (behind - 1)) & 1) != 0);
+}
+
 // Larger values make file transfers more stable.
 const int TransferSize = 18366;
 
+typedef std::basic_string<char, std::char_traits<char>, slab::Allocator<char>>
+    PooledString;
+
+// A packet's payload, drawn from the slab pool so routing a message does
+// not go to the heap once the pool is warm. It converts to and from
+// std::string for the code which builds and reads packets, those copies
+// stay off the routing paths.
+class Payload : public PooledString {
+public:
+  Payload() {}
+  Payload(const char *text) : PooledString(text) {}
+  Payload(const char *text, size_type length) : PooledString(text, length) {}
+  Payload(const std::string &text)
+      : PooledString(text.data(), text.length()) {}
+  Payload(const PooledString &text) : PooledString(text) {}
+
+  operator std::string() const { return std::string(data(), length()); }
+
+  Payload substr(size_type pos = 0, size_type count = npos) const {
+    return Payload(PooledString::substr(pos, count));
+  }
+};
+
+// A packet as it goes on the wire, one int per header field and per
+// character. Built for each send, so it comes from the pool too.
+typedef std::vector<unsigned int, slab::Allocator<unsigned int>> Frame;
+
 #pragma pack(1)
 struct Packet {
   Header hdr;
-  std::string data;
+  Payload data;
 };
 
 struct OpenFileData {
@@ -191,13 +362,26 @@ struct PacketInfo {
   Packet packet;
   bool sent;
   int skips;
+  LONGLONG stamp; // Performance counter when the server read it, or 0.
+  unsigned long long traceKey; // Set on chat lines while tracing, or 0.
+  LONGLONG queued; // When a traced line was queued for sending.
 };
 
 typedef std::vector<PacketInfo> packetQueue;
 
+// Copy |from| into |to| but swap the payload over, leaving |from| empty.
+void SwapInto(PacketInfo &to, PacketInfo &from) {
+  Payload data;
+  data.swap(from.packet.data);
+  to = from;
+  to.packet.data.swap(data);
+}
+
 // Try to assign the data to the packet message.
 // This is due to network ordering operatons (Endianness)
-void AssignMessage(char *stack, Header &header, std::string &data) {
+// Decodes straight into |data|, which is sized once up front.
+template <typename String>
+void AssignMessage(char *stack, Header &header, String &data) {
   if (header.len == 0)
     return; // sanity.
 
@@ -205,15 +389,12 @@ void AssignMessage(char *stack, Header &header, std::string &data) {
   start += HeaderSize;
   unsigned int *buf = reinterpret_cast<unsigned int *>(start);
 
-  std::vector<char> temp;
-
+  data.resize(header.len);
   for (unsigned int i = 0; i < header.len; ++i) {
     unsigned int info = ntohl(buf[i]);
     unsigned int infoShift = (info - SALT);
-    unsigned char ch = static_cast<unsigned char>(infoShift);
-    temp.push_back(ch);
+    data[i] = static_cast<char>(static_cast<unsigned char>(infoShift));
   }
-  data.assign(reinterpret_cast<char *>(&temp[0]), header.len);
 }
 
 void AssignHeader(Header &header, char *data) {
@@ -224,16 +405,185 @@ void AssignHeader(Header &header, char *data) {
   }
 }
 
-bool ReadSocketFully(SOCKET s, char *stack, std::vector<char> &data) {
+// The reverse of AssignHeader, appends the header in network order to |out|.
+template <typename Frame> void EncodeHeader(const Header &header, Frame &out) {
+  const unsigned int *in = reinterpret_cast<const unsigned int *>(&header);
+  for (int i = 0; i < sizeof(header) / sizeof(int); ++i) {
+    out.push_back(htonl(in[i]));
+  }
+}
+
+// The reverse of AssignMessage, appends |len| salted characters to |out|.
+template <typename String, typename Frame>
+void EncodePayload(const String &data, unsigned int len, Frame &out) {
+  for (unsigned int i = 0; i < len; ++i)
+    out.push_back(htonl(static_cast<unsigned int>(data[i]) + SALT));
+}
+
+// What a relay entry carries between federated servers.
+enum RelayKind {
+  RelayBroadcast, // A channel message, the scope is the channel name.
+  RelayRouted,    // A private message or file, the scope is the user.
+  RelayJoined,    // A user list entry, the data is the alias.
+  RelayLeft
+};
+
+// One message inside a PKT_RELAY batch. Each message that enters the
+// federation is tagged with the node it came in at and an id which only
+// grows per node, so a node can tell when it has seen one already. User list
+// changes take their id from the same counter, which orders them per user.
+struct RelayEntry {
+  unsigned int kind;
+  unsigned int origin;
+  unsigned int relayId;
+  Header hdr;
+  std::string scope;
+  std::string data;
+};
+
+// Server to server state is written as text fields, numbers as "number|"
+// and strings as "len|bytes".
+void AppendField(std::string &out, unsigned int value) {
+  out.append(std::to_string(value));
+  out.append("|");
+}
+
+void AppendBytes(std::string &out, const std::string &value) {
+  AppendField(out, value.length());
+  out.append(value);
+}
+
+// Read a "number|" at |pos| and move past it.
+bool ReadField(const std::string &in, std::string::size_type &pos,
+               unsigned int &value) {
+  std::string::size_type end = in.find('|', pos);
+  if (end == std::string::npos || end == pos || end - pos > 10 ||
+      in.find_first_not_of("0123456789", pos) != end)
+    return false;
+  value = static_cast<unsigned int>(std::stoull(in.substr(pos, end - pos)));
+  pos = end + 1;
+  return true;
+}
+
+// Read a "len|bytes" at |pos| and move past it.
+template <typename String>
+bool ReadBytes(const std::string &in, std::string::size_type &pos,
+               String &value) {
+  unsigned int len;
+  if (!ReadField(in, pos, len) || pos + len > in.length())
+    return false;
+  value.assign(in.data() + pos, len);
+  pos += len;
+  return true;
+}
+
+// A packet is its header fields but len, then its data.
+void AppendPacket(std::string &out, const Packet &packet) {
+  unsigned int fields[] = {packet.hdr.type,    packet.hdr.flags,
+                           packet.hdr.parts,   packet.hdr.current,
+                           packet.hdr.sequence, packet.hdr.id};
+  for (auto f : fields)
+    AppendField(out, f);
+  AppendBytes(out, packet.data);
+}
+
+bool ReadPacket(const std::string &in, std::string::size_type &pos,
+                Packet &packet) {
+  unsigned int *fields[] = {&packet.hdr.type,     &packet.hdr.flags,
+                            &packet.hdr.parts,    &packet.hdr.current,
+                            &packet.hdr.sequence, &packet.hdr.id};
+  for (auto f : fields) {
+    if (!ReadField(in, pos, *f))
+      return false;
+  }
+  if (!ReadBytes(in, pos, packet.data))
+    return false;
+  packet.hdr.len = packet.data.length();
+  return true;
+}
+
+// Lists are written as their count, then each value.
+void AppendList(std::string &out, const std::vector<unsigned int> &values) {
+  AppendField(out, values.size());
+  for (auto v : values)
+    AppendField(out, v);
+}
+
+bool ReadList(const std::string &in, std::string::size_type &pos,
+              std::vector<unsigned int> &values) {
+  unsigned int count;
+  if (!ReadField(in, pos, count))
+    return false;
+  values.resize(count);
+  for (auto &v : values) {
+    if (!ReadField(in, pos, v))
+      return false;
+  }
+  return true;
+}
+
+void AppendPackets(std::string &out, const packetQueue &packets) {
+  AppendField(out, packets.size());
+  for (auto &p : packets)
+    AppendPacket(out, p.packet);
+}
+
+bool ReadPackets(const std::string &in, std::string::size_type &pos,
+                 packetQueue &packets) {
+  unsigned int count;
+  if (!ReadField(in, pos, count))
+    return false;
+  for (unsigned int i = 0; i < count; ++i) {
+    PacketInfo info{{}, false, 0};
+    if (!ReadPacket(in, pos, info.packet))
+      return false;
+    packets.push_back(info);
+  }
+  return true;
+}
+
+// Entries are written as "kind|origin|id|" followed by the packet.
+void AppendRelayEntry(const RelayEntry &entry, std::string &batch) {
+  AppendField(batch, entry.kind);
+  AppendField(batch, entry.origin);
+  AppendField(batch, entry.relayId);
+  AppendBytes(batch, entry.scope);
+  AppendPacket(batch, Packet{entry.hdr, entry.data});
+}
+
+// Read the entry at |pos| and move past it, false when the batch is done or
+// does not parse.
+bool ReadRelayEntry(const std::string &batch, std::string::size_type &pos,
+                    RelayEntry &entry) {
+  Packet packet;
+  if (!ReadField(batch, pos, entry.kind) ||
+      !ReadField(batch, pos, entry.origin) ||
+      !ReadField(batch, pos, entry.relayId) ||
+      !ReadBytes(batch, pos, entry.scope) || !ReadPacket(batch, pos, packet))
+    return false;
+  entry.hdr = packet.hdr;
+  entry.data = packet.data;
+  return true;
+}
+
+// Returns false only when the peer has gone away, running out of data on the
+// non-blocking socket is not an error.
+// |calls| counts the recv calls made, when given.
+bool ReadSocketFully(SOCKET s, char *stack, std::vector<char> &data,
+                     unsigned long long *calls = nullptr) {
   // Read fully from the client.
   int bytesRead{0};
   do {
     bytesRead = recv(s, stack, TransferSize, 0);
+    if (calls)
+      ++*calls;
     if (bytesRead > 0) {
       const char *start = stack;
       const char *end = stack + bytesRead;
       data.insert(data.end(), start, end);
-    } else if (bytesRead == SOCKET_ERROR) {
+    } else if (bytesRead == 0) {
+      return false; // Orderly shutdown from the other side.
+    } else if (WSAGetLastError() != WSAEWOULDBLOCK) {
       return false;
     }
   } while (bytesRead > 0);
@@ -243,37 +593,48 @@ bool ReadSocketFully(SOCKET s, char *stack, std::vector<char> &data) {
 void QueueCompletePackets(std::vector<char> &data, packetQueue &out) {
   // Now we have an entire list of packets.
   int packetDataSize = data.size();
-  while (packetDataSize >= HeaderSize) {
+  int offset = 0;
+  while (packetDataSize - offset >= HeaderSize) {
     Header hdr;
-    AssignHeader(hdr, &data[0]);
-#ifdef DEBUG_MODE
-    std::cout << "Got packet - type[" << hdr.type << "] len[" << hdr.len
-              << "] seq[" << hdr.sequence << "]" << std::endl;
-#endif
-    if (packetDataSize >=
+    AssignHeader(hdr, &data[offset]);
+    LOG_DEBUG("Got packet - type[%u] len[%u] seq[%u]", hdr.type, hdr.len,
+              hdr.sequence);
+    if (packetDataSize - offset >=
         static_cast<int>(HeaderSize + (hdr.len * sizeof(int)))) {
-      // We have a valid packet/s.
+      // We have a valid packet/s. It is decoded where it will live, not
+      // copied in.
       PacketInfo info{{hdr, ""}, false, 0};
-      AssignMessage(reinterpret_cast<char *>(&data[0]), hdr, info.packet.data);
-
       out.push_back(info);
+      AssignMessage(&data[offset], hdr, out.back().packet.data);
 
-      // Now that we have read a packet from the stream, we remove the
-      // chunk we just read.
-      int dataProcessed = (HeaderSize + hdr.len * sizeof(int));
-      data.erase(data.begin(), data.begin() + dataProcessed);
-      packetDataSize = data.size();
-#ifdef DEBUG_MODE
-      std::cout << "Processed data [" << packetDataSize << "]" << std::endl;
-#endif
+      offset += HeaderSize + hdr.len * sizeof(int);
+      LOG_DEBUG("Processed data [%d]", packetDataSize - offset);
     } else {
-// Need to keep this, it's a partial packet.
-#ifdef DEBUG_MODE
-      std::cout << "Had partial packet" << std::endl;
-#endif
+      // Need to keep this, it's a partial packet.
+      LOG_DEBUG("Had partial packet");
       break; // Could not process this.
     }
   }
+
+  // Remove everything read in one go, what is left is a partial packet.
+  data.erase(data.begin(), data.begin() + offset);
+}
+
+// Block until the next packet arrives on |s|, for short control links only.
+// |data| and |queue| hold what was read past it.
+bool NextPacket(SOCKET s, std::vector<char> &data, packetQueue &queue,
+                PacketInfo &out) {
+  char stack[TransferSize];
+  while (queue.empty()) {
+    int bytesRead = recv(s, stack, TransferSize, 0);
+    if (bytesRead <= 0)
+      return false;
+    data.insert(data.end(), stack, stack + bytesRead);
+    QueueCompletePackets(data, queue);
+  }
+  out = queue.front();
+  queue.erase(queue.begin());
+  return true;
 }
 
 }; // namespace comms
@@ -340,297 +701,2611 @@ namespace net {
 
 // Server thread functions.
 DWORD WINAPI ServerAcceptConnections(LPVOID param);
-DWORD WINAPI ServerPingCovalent(LPVOID param);
 DWORD WINAPI ServerCommsConnections(LPVOID param);
+DWORD WINAPI ServerReaderStage(LPVOID param);
+DWORD WINAPI ServerWriterStage(LPVOID param);
 
 // Client thread functions.
 DWORD WINAPI ClientCommsConnection(LPVOID param);
 
+// Holds |mutex| for its lifetime. |site| names the caller to the lock
+// profiler, which costs a test of one flag while it is off.
 struct AutoLocker {
 protected:
   CRITICAL_SECTION &m_mutex;
+  lockprof::Site *m_site; // Set while profiling the outermost acquisition.
+  LONGLONG m_acquired;
+
+  void Profile(const char *site) {
+    lockprof::Site &s = lockprof::profiler.Find(&m_mutex, site);
+    LARGE_INTEGER start, now;
+    QueryPerformanceCounter(&start);
+    bool contended = !TryEnterCriticalSection(&m_mutex);
+    if (contended)
+      EnterCriticalSection(&m_mutex);
+    QueryPerformanceCounter(&now);
+
+    // Taking it again on the same thread costs nothing, and the outermost
+    // holder already counts the time.
+    bool reentered = m_mutex.RecursionCount > 1;
+    lockprof::profiler.Acquired(s, now.QuadPart - start.QuadPart, contended,
+                                reentered);
+    if (!reentered) {
+      m_site = &s;
+      m_acquired = now.QuadPart;
+    }
+  }
 
 public:
-  AutoLocker(CRITICAL_SECTION &mutex) : m_mutex(mutex) {
-    EnterCriticalSection(&m_mutex);
+  AutoLocker(CRITICAL_SECTION &mutex, const char *site = nullptr)
+      : m_mutex(mutex), m_site(nullptr) {
+    if (lockprof::profiler.On())
+      Profile(site);
+    else
+      EnterCriticalSection(&m_mutex);
+  }
+  ~AutoLocker() {
+    if (m_site) {
+      LARGE_INTEGER now;
+      QueryPerformanceCounter(&now);
+      lockprof::profiler.Released(*m_site, now.QuadPart - m_acquired);
+    }
+    LeaveCriticalSection(&m_mutex);
   }
-  ~AutoLocker() { LeaveCriticalSection(&m_mutex); }
 };
 
-struct SocketData {
-  SOCKET socket;
-  std::string ip;
-  std::string alias;
+// How long a dropped session waits for its client to come back before the
+// room is told that it left.
+const DWORD SessionGraceMillis = 15000;
 
-  // Messages we got from the client.
-  comms::packetQueue inboundMessages;
+// How many processed sequences we remember per client for resumption.
+const unsigned int RecentSequenceWindow = 64;
 
-  // Messages we are sending to the client.
-  comms::packetQueue outboundMessages;
+// Broadcasts held for a dropped session, anything beyond this is lost.
+const unsigned int MaxParkedMessages = 256;
 
-  // Data coming in on the socket.
-  std::vector<char> packetData;
-};
+// Client reconnect backoff bounds.
+const DWORD MinReconnectMillis = 250;
+const DWORD MaxReconnectMillis = 8000;
 
-class NetCommon {
-  std::string m_ipAddress;
-  std::vector<SOCKET> m_closedSockets;
-  std::string m_attachmentsDir;
+// How long the client waits on one address when connecting to the server.
+const DWORD ConnectTimeoutMillis = 2000;
 
-public:
-  // Get the path to the attachments folder.
-  const std::string &GetAttachmentsDirectory() const {
-    return m_attachmentsDir;
-  }
+// Random bytes in a session token.
+const unsigned int SessionTokenBytes = 16;
 
-  void OpenAttachmentsFile(const std::string &name, unsigned int parse,
-                           comms::OpenFileData &data) {
-    std::string fullpath(GetAttachmentsDirectory());
-    if (parse) {
-      // Get the username out of the string.
-      std::string::size_type pos = name.find_last_of('|');
-      if (pos != std::string::npos) {
-        fullpath.append(name.substr(0, pos));
-        data.displayName = name.substr(0, pos);
-      }
-    } else {
-      fullpath.append(name);
-      data.displayName = name;
-    }
+// Bytes of encoded packets a client may have waiting before the server's
+// slow consumer policy kicks in.
+const unsigned int OutboundHighWater = 4 * 1024 * 1024;
 
-    data.file = fopen(fullpath.c_str(), "wb");
-    data.path = fullpath;
+// Packets a client queue holds no matter how small they are.
+const unsigned int MaxOutboundPackets = 8192;
+
+// Bytes of file chunks a paused client may have waiting behind its chat.
+// Past that a sender's next chunk waits, unacked, until the client drains.
+const unsigned int PausedFileBytes = 4 * OutboundHighWater;
+
+// The message log keeps this many segments of this size on disk, and a
+// client joining without a last sequence is sent this many messages.
+const unsigned int LogSegmentBytes = 16 * 1024 * 1024;
+const unsigned int LogMaxSegments = 8;
+const unsigned int BacklogMessages = 50;
+
+// Relay entries are batched per peer up to this many characters per packet,
+// and a peer which cannot be reached is tried again after PeerRetryMillis.
+const unsigned int MaxRelayBatch = 16 * 1024;
+const DWORD PeerRetryMillis = 3000;
+
+// What the server does to a client whose queue passes OutboundHighWater.
+enum SlowConsumerPolicy {
+  SlowDropOldestChat, // Drop the oldest chat to make room.
+  SlowPauseFiles,     // Hold file chunks back behind the client's chat.
+  SlowDisconnect      // Drop the client, it can resume its session later.
+};
+
+// Inbound packets are rate limited per client in these classes.
+enum PacketClass { ClassChat, ClassFile, ClassControl, PacketClasses };
+
+PacketClass ClassOf(unsigned int type) {
+  switch (type) {
+  case PKT_MSG:
+  case PKT_PVT:
+    return ClassChat;
+  case PKT_FILE_OUT:
+    return ClassFile;
+  default:
+    return ClassControl;
   }
+}
 
-  // The NetCommon constructor initializes WinSock and fetches our IP address.
-  NetCommon() {
+// Packets a second and the burst allowed on top, per class.
+struct RateLimit {
+  unsigned int rate;
+  unsigned int burst;
+};
 
-    // Get the attachments path irrespective of whether the startup succeeds.
-    {
-      char folder[MAX_PATH];
-      DWORD nChars = GetModuleFileName(NULL, folder, MAX_PATH);
+const RateLimit DefaultRateLimits[PacketClasses] = {
+    {20, 40},   // Chat.
+    {200, 400}, // File chunks.
+    {10, 20}    // Control, queries, lists and channel changes.
+};
 
-      std::string path(folder, nChars);
-      std::string::size_type pos = path.find_last_of('\\');
-      std::string path_prefix = path.substr(0, pos + 1);
-      path_prefix.append("attachments\\");
-      m_attachmentsDir = path_prefix;
-    }
+// Over-limit packets wait in the inbound queue for tokens until this many
+// are waiting, any that arrive after that are dropped unacked and the client
+// resends them.
+const unsigned int MaxThrottledPackets = 64;
 
-    WSADATA w;
+// One packet costs a token, tokens come back at the class rate. Kept in
+// thousandths so milliseconds times packets a second needs no scaling.
+class TokenBucket {
+  unsigned int m_milliTokens;
+  DWORD m_last;
 
-    if (WSAStartup(0x0202, &w)) { // there was an error
-      std::cout << "Could not initialize Winsock." << std::endl;
-      throw "Could not initialize WinSock";
-      return;
-    }
+public:
+  TokenBucket() : m_milliTokens(0), m_last(0) {}
 
-    if (w.wVersion != 0x0202) { // wrong WinSock version!
-      WSACleanup();             // unload ws2_32.dll
-      std::cout << "Wrong Winsock version." << std::endl;
-      throw "Incorrect WinSock version.";
-      return;
+  bool Take(const RateLimit &limit, DWORD now) {
+    unsigned int cap = limit.burst * 1000;
+    if (m_last == 0) {
+      m_milliTokens = cap; // Everyone starts with a full bucket.
+    } else {
+      unsigned long long refill =
+          static_cast<unsigned long long>(now - m_last) * limit.rate;
+      m_milliTokens = refill >= cap - m_milliTokens
+                          ? cap
+                          : m_milliTokens + static_cast<unsigned int>(refill);
     }
+    m_last = now;
 
-    std::cout << "WSAStartup" << std::endl
-              << "Version: " << w.wVersion << std::endl
-              << "Description: " << w.szDescription << std::endl
-              << "Status: " << w.szSystemStatus << std::endl
-              << "Attachments: " << m_attachmentsDir.c_str() << std::endl;
+    if (m_milliTokens < 1000)
+      return false;
+    m_milliTokens -= 1000;
+    return true;
+  }
 
-    // Get local IP's - useful for phones.
-    char ac[80];
-    if (gethostname(ac, sizeof(ac)) == SOCKET_ERROR) {
-      std::cout << "Error " << WSAGetLastError()
-                << " when getting local host name." << std::endl;
-      throw "Could not get local host name.";
-      return;
-    } else {
-      struct hostent *phe = gethostbyname(ac);
-      if (phe == 0) {
-        std::cout << "Bad host lookup." << std::endl;
-        throw "Bad host lookup.";
-        return;
-      } else {
-        // Print only the first address.
-        for (int i = 0; phe->h_addr_list[i] != 0; ++i) {
-          struct in_addr addr;
-          memcpy(&addr, phe->h_addr_list[i], sizeof(struct in_addr));
-          std::cout << "IP Address " << i << ": " << inet_ntoa(addr)
-                    << std::endl;
+  // What a handoff carries over. The tick count is the machine's, so the
+  // new process can go on from it.
+  unsigned int MilliTokens() const { return m_milliTokens; }
+  DWORD Last() const { return m_last; }
+  void Restore(unsigned int milliTokens, DWORD last) {
+    m_milliTokens = milliTokens;
+    m_last = last;
+  }
+};
 
-          m_ipAddress = inet_ntoa(addr);
-          break;
-        }
-      }
-    }
+// Messages waiting to go out to one client. Chat and file chunks queue
+// separately so chat never sits behind a file, and the byte count shows
+// when the client is not keeping up.
+class OutboundQueue {
+  ring::RingQueue<comms::PacketInfo> m_chat;
+  ring::RingQueue<comms::PacketInfo> m_files;
+  unsigned int m_bytes;
+  unsigned int m_fileBytes;
+
+  ring::RingQueue<comms::PacketInfo> &QueueFor(const comms::PacketInfo &info) {
+    return IsFile(info) ? m_files : m_chat;
   }
 
-  ~NetCommon() {}
+  void Added(const comms::PacketInfo &info) {
+    m_bytes += WireSize(info);
+    if (IsFile(info))
+      m_fileBytes += WireSize(info);
+  }
 
-  void SendPacket(SOCKET s, const comms::Packet &packet) {
-// Push the entire packet header + data to the vector.
-#ifdef DEBUG_MODE
-    std::cout << "Sending packet [" << packet.hdr.type << "]["
-              << packet.data.length() << "][" << packet.data << "]"
-              << std::endl;
-#endif
-    std::vector<unsigned int> upscaledData;
-    upscaledData.push_back(htonl(packet.hdr.type));
-    upscaledData.push_back(htonl(packet.hdr.flags));
-    upscaledData.push_back(htonl(packet.hdr.parts));
-    upscaledData.push_back(htonl(packet.hdr.current));
-    upscaledData.push_back(htonl(packet.hdr.len));
-    upscaledData.push_back(htonl(packet.hdr.sequence));
-    upscaledData.push_back(htonl(packet.hdr.id));
-
-    for (unsigned int i = 0; i < packet.hdr.len; ++i)
-      upscaledData.push_back(
-          htonl(static_cast<unsigned int>(packet.data[i]) + SALT));
+public:
+  // Messages lost to the slow consumer policy or the packet limit.
+  unsigned int dropped;
 
-    int bytes = send(s, reinterpret_cast<char *>(&upscaledData[0]),
-                     upscaledData.size() * sizeof(unsigned int), 0);
+  OutboundQueue()
+      : m_chat(MaxOutboundPackets), m_files(MaxOutboundPackets), m_bytes(0),
+        m_fileBytes(0), dropped(0) {}
 
-// Next step is to print out the upscaled data as a sequency of bytes.
-#ifdef DEBUG_MODE
-    std::cout << "Sent packet response [";
-    unsigned char *packetData =
-        reinterpret_cast<unsigned char *>(&upscaledData[0]);
-    for (int i = 0; i < (upscaledData.size() * sizeof(unsigned int)); ++i)
-      std::cout << (int)packetData[i];
-    std::cout << "]" << std::endl;
-#endif
+  static bool IsFile(const comms::PacketInfo &info) {
+    return info.packet.hdr.type == PKT_FILE_IN;
+  }
 
-    if (bytes <= 0) {
-      // Error occurred, we need to mark this socket as closed.
-      m_closedSockets.push_back(s);
-      return;
+  static unsigned int WireSize(const comms::PacketInfo &info) {
+    return comms::HeaderSize + info.packet.hdr.len * sizeof(int);
+  }
+
+  bool push_back(const comms::PacketInfo &info) {
+    if (!QueueFor(info).push_back(info)) {
+      ++dropped;
+      return false;
     }
+    Added(info);
+    return true;
   }
 
-  // Partially Lock Free
-  void HandleClosedSockets(std::vector<SocketData> &clients) {
-    std::vector<comms::PacketInfo> out;
-    for (auto i : m_closedSockets) {
-      for (unsigned int j = 0; j < clients.size(); ++j) {
-        if (clients[j].socket == i) {
-          std::string alias = clients[j].alias;
-          alias.append("|_+_| - has taken the blue pill.");
+  bool push_front(const comms::PacketInfo &info) {
+    if (!QueueFor(info).push_front(info)) {
+      ++dropped;
+      return false;
+    }
+    Added(info);
+    return true;
+  }
 
-          comms::PacketInfo bye{
-              {{PKT_MSG_LEAVE, 0, 0, 0, alias.length(), 0, 0}, alias},
-              false,
-              0};
+  // Chat goes first, it is small and someone is waiting to read it.
+  comms::PacketInfo &front() {
+    return m_chat.empty() ? m_files.front() : m_chat.front();
+  }
 
-          out.push_back(bye);
-          break;
-        }
-      }
-    }
+  void pop_front() {
+    ring::RingQueue<comms::PacketInfo> &queue =
+        m_chat.empty() ? m_files : m_chat;
+    m_bytes -= WireSize(queue.front());
+    if (&queue == &m_files)
+      m_fileBytes -= WireSize(queue.front());
+    queue.pop_front();
+  }
 
-    for (auto a = clients.begin(); a != clients.end(); ++a) {
-      for (auto c = m_closedSockets.begin(); c != m_closedSockets.end(); ++c) {
-        if (a->socket == *c) {
-          a = clients.erase(a);
-        }
-      }
+  bool DropOldestChat() {
+    if (m_chat.empty())
+      return false;
+    m_bytes -= WireSize(m_chat.front());
+    m_chat.pop_front();
+    ++dropped;
+    return true;
+  }
+
+  // Move everything into |out|, chat first.
+  void DrainTo(comms::packetQueue &out) {
+    while (!empty()) {
+      out.push_back(front());
+      pop_front();
     }
+  }
 
-    m_closedSockets.clear();
+  void clear() {
+    m_chat.clear();
+    m_files.clear();
+    m_bytes = 0;
+    m_fileBytes = 0;
+  }
 
-    if (out.size()) {
-      for (auto o : out) {
-        for (auto &i : clients) {
-          i.outboundMessages.push_back(o);
-        }
-      }
-    }
+  void swap(OutboundQueue &other) {
+    m_chat.swap(other.m_chat);
+    m_files.swap(other.m_files);
+    std::swap(m_bytes, other.m_bytes);
+    std::swap(m_fileBytes, other.m_fileBytes);
+    std::swap(dropped, other.dropped);
   }
 
-}; // NetCommon
+  bool empty() const { return m_chat.empty() && m_files.empty(); }
+  size_t size() const { return m_chat.size() + m_files.size(); }
+  unsigned int Bytes() const { return m_bytes; }
+  unsigned int FileBytes() const { return m_fileBytes; }
+  bool OverHighWater() const { return m_bytes > OutboundHighWater; }
 
-// The server is special, it uses a listen thread and a comms thread.
-class NetServer : public NetCommon {
-private:
-  HANDLE acceptThread;
-  HANDLE commsThread;
-  HANDLE covalentThread;
-  SOCKET m_acceptSocket;
+  // Whether |packets| more file chunks of |bytes| in all fit while paused.
+  bool FileRoom(unsigned int bytes, unsigned int packets) const {
+    return m_fileBytes + bytes <= PausedFileBytes &&
+           m_files.size() + packets <= MaxOutboundPackets;
+  }
+};
 
-  CRITICAL_SECTION m_mutex;
-  std::vector<SocketData> m_clients;
+// File chunks routed to a client in one ProcessMessages round, which its
+// queue does not show yet.
+struct RoutedFiles {
+  unsigned int bytes;
+  unsigned int packets;
+};
 
-public:
-  // Lock Free:
+// Everyone who sets an alias starts out in the lobby.
+const unsigned int LobbyChannel = 0;
+const unsigned int NoChannel = 0xFFFFFFFF;
 
-  // Get the socket on which we are accepting connections.
-  SOCKET GetAcceptSocket() const { return m_acceptSocket; }
+// A named channel and the handles of the clients subscribed to it.
+struct Channel {
+  std::string name;
+  std::vector<slots::Handle> subscribers;
+};
 
-  // Get a reference to the server mutex.
-  CRITICAL_SECTION &GetMutex() { return m_mutex; }
+// A snapshot of one client's outbound queue, for metrics.
+struct QueueDepth {
+  std::string alias;
+  unsigned int packets;
+  unsigned int bytes;
+  unsigned int dropped;
 
-  // Get a reference to the server client list.
-  std::vector<SocketData> &GetClients() { return m_clients; }
+  // Inbound packets held back or dropped by the rate limiter, by class.
+  unsigned int throttled[PacketClasses];
+  unsigned int rejected[PacketClasses];
+};
 
-  // Auto Locking:
+// How the server reads its sockets.
+enum IoBackend {
+  IoPoll,       // recv on every socket every tick.
+  IoCompletion, // One overlapped receive per socket, reaped in batches.
+  IoPipeline    // Reader and writer threads of their own, see Pipeline.
+};
 
-  // Push a new connection to our list of clients.
-  void PushConnection(SOCKET client, const std::string &ip) {
-    AutoLocker locker(m_mutex);
-    m_clients.push_back(SocketData{client, ip, ""});
-  }
+// Counters for comparing the I/O backends. Latency runs from a packet being
+// read to the server sending what it caused, over recent packets.
+struct IoStats {
+  IoBackend backend;
+  unsigned long long recvCalls; // recv calls, or completion port dequeues.
+  unsigned long long sendCalls;
+  unsigned long long packetsIn;
+  unsigned long long packetsOut;
+  unsigned int p50Micros;
+  unsigned int p99Micros;
+};
 
-  void DropConnection(SOCKET client) {
-    AutoLocker locker(m_mutex);
+// Completions taken from the port at once, and how many times a round goes
+// back for more.
+const unsigned long ReadBatch = 64;
+const unsigned int MaxReadPasses = 4;
 
-    auto it = m_clients.begin();
-    auto eit = m_clients.end();
-    for (; it != eit; ++it) {
-      if (it->socket == client) {
-        std::cout << "Dropping connection from: " << it->ip.c_str();
-#ifdef DEBUG_MODE
-        std::cout << "Goodbye: " << it->alias.c_str();
-#endif
-        m_clients.erase(it);
+// Latency samples kept for IoStats.
+const unsigned int LatencySamples = 4096;
+
+// Frames for one socket are written together, once a round or when this
+// many bytes are waiting, whichever comes first.
+const unsigned int FlushBytes = comms::TransferSize;
+
+// How long a switch to or from the pipeline waits for sockets to take what
+// is batched for them, clients which still have not are dropped.
+const DWORD DrainBatchMillis = 1000;
+
+// Packet types counted for metrics, anything above is counted as type 0.
+const unsigned int MetricPacketTypes = 0x40;
+
+// Client packets processed in one lane of acks, see comms::AckLaneChat.
+struct AckLane {
+  bool seen;
+  bool pending; // Processed something not acknowledged yet.
+  unsigned int newest;
+  unsigned int bits;
+};
+
+// What a client which takes PKT_ACK is owed.
+struct AckState {
+  bool cumulative;
+  DWORD since; // When the oldest unacknowledged packet was processed.
+  AckLane lanes[comms::AckLanes];
+
+  bool Owed() const {
+    return lanes[comms::AckLaneChat].pending ||
+           lanes[comms::AckLaneFile].pending;
+  }
+};
+
+struct SocketData {
+  SOCKET socket;
+  std::string ip;
+  std::string alias;
+
+  // Where this client lives in the server's client map.
+  slots::Handle handle;
+
+  // Messages we got from the client.
+  comms::packetQueue inboundMessages;
+
+  // Messages we are sending to the client.
+  OutboundQueue outboundMessages;
+
+  // Data coming in on the socket.
+  std::vector<char> packetData;
+
+  // Session token issued with PKT_ALIAS_ACK.
+  std::string session;
+
+  // Sequences we recently processed for this client, oldest first.
+  std::vector<unsigned int> recentSequences;
+
+  // Alias each targeted file transfer goes to, by file id.
+  std::map<unsigned int, std::string> fileTargets;
+
+  // Channels we deliver to this client, and the one it talks in.
+  std::vector<unsigned int> channels;
+  unsigned int activeChannel;
+
+  // Node id when this is a link to another server, 0 for clients.
+  unsigned int peerNode;
+
+  // Relay entries waiting to go out to a peer as one PKT_RELAY.
+  std::string relayBatch;
+
+  // Acks we owe the client, when it takes them in bulk.
+  AckState acks;
+
+  // Frames waiting to go out in one write, see FlushWrites. A short write
+  // leaves the bytes from |outBatchSent| on for next time.
+  comms::Frame outBatch;
+  unsigned int outBatchSent;
+  DWORD outBatchSince; // When the oldest frame was added.
+
+  // When pipelined, the writer could not send everything it was handed.
+  // Nothing more goes to it until it says it has caught up.
+  bool writerTail;
+
+  // Inbound rate limiting, with what it held back and what it dropped.
+  TokenBucket buckets[PacketClasses];
+  unsigned int throttled[PacketClasses];
+  unsigned int rejected[PacketClasses];
+};
+
+// The client map swaps a departing client with the last one, this keeps
+// that from copying their queues and buffers. Keep it in step with
+// SocketData.
+void swap(SocketData &a, SocketData &b) {
+  std::swap(a.socket, b.socket);
+  a.ip.swap(b.ip);
+  a.alias.swap(b.alias);
+  std::swap(a.handle, b.handle);
+  a.inboundMessages.swap(b.inboundMessages);
+  a.outboundMessages.swap(b.outboundMessages);
+  a.packetData.swap(b.packetData);
+  a.session.swap(b.session);
+  a.recentSequences.swap(b.recentSequences);
+  a.fileTargets.swap(b.fileTargets);
+  a.channels.swap(b.channels);
+  std::swap(a.activeChannel, b.activeChannel);
+  std::swap(a.peerNode, b.peerNode);
+  a.relayBatch.swap(b.relayBatch);
+  std::swap(a.acks, b.acks);
+  a.outBatch.swap(b.outBatch);
+  std::swap(a.outBatchSent, b.outBatchSent);
+  std::swap(a.outBatchSince, b.outBatchSince);
+  std::swap(a.writerTail, b.writerTail);
+  for (int c = 0; c < PacketClasses; ++c) {
+    std::swap(a.buckets[c], b.buckets[c]);
+    std::swap(a.throttled[c], b.throttled[c]);
+    std::swap(a.rejected[c], b.rejected[c]);
+  }
+}
+
+// A server we link to on startup, and keep linking to when it drops.
+struct PeerAddress {
+  SOCKADDR_IN addr;
+  std::string name;
+  SOCKET pending; // Connect in progress.
+  slots::Handle link;
+  DWORD nextAttempt;
+};
+
+// Steps of a hot restart, in the flags of PKT_HANDOFF. The new process
+// asks, the old one sends its own state and then each client, and keeps
+// running unless the new one says it has taken over.
+enum HandoffStep {
+  HandoffRequest, // Header id holds the new process id, data the secret.
+  HandoffServer,
+  HandoffClient,
+  HandoffDone,
+  HandoffTaken
+};
+
+// How long either side of a handoff waits on the other.
+const DWORD HandoffTimeoutMillis = 10000;
+
+// Leads the handed off state, bumped whenever what is written changes. A new
+// process which reads another version leaves the old one running.
+const unsigned int HandoffVersion = 2;
+
+// What a new process got from the old one.
+struct Handoff {
+  SOCKET link;
+  SOCKET listener;
+  std::string server;
+  std::vector<std::string> clients;
+};
+
+// A user on another node, by the node it joined at.
+struct RemoteUser {
+  std::string entry;
+  unsigned int node;
+};
+
+// How far behind the newest relay id from an origin an entry may arrive and
+// still be taken.
+const unsigned int RelayWindowSize = 64;
+
+// The relay ids taken from one origin. Entries can overtake each other on
+// different paths through the federation, so besides the newest we keep a
+// bit for each of the ids just before it.
+struct RelayWindow {
+  unsigned int newest;
+  unsigned long long bits; // Bit n is newest - n.
+
+  // True the first time |id| is seen, false for repeats and for ids which
+  // fell out of the window.
+  bool Take(unsigned int id) {
+    if (id > newest) {
+      unsigned int shift = id - newest;
+      bits = shift < RelayWindowSize ? bits << shift : 0;
+      bits |= 1;
+      newest = id;
+      return true;
+    }
+    unsigned int behind = newest - id;
+    if (behind >= RelayWindowSize || (bits >> behind) & 1)
+      return false;
+    bits |= 1ull << behind;
+    return true;
+  }
+};
+
+typedef slots::SlotMap<SocketData> ClientMap;
+
+// How many user list changes we keep for PKT_LST deltas.
+const unsigned int MaxListChanges = 256;
+
+// One join or leave in the user list, as seen by PKT_LST.
+struct ListChange {
+  unsigned int version;
+  bool joined;
+  std::string entry;
+};
+
+// What the server keeps for a client so that it can resume after a drop.
+struct SessionData {
+  std::string alias;
+  std::vector<unsigned int> recentSequences;
+  std::vector<unsigned int> channels;
+  unsigned int activeChannel;
+
+  // Broadcasts that arrived while the client was away.
+  comms::packetQueue pending;
+
+  bool parked;
+  DWORD droppedAt;
+};
+
+// The server can run as a pipeline. Reader threads own the sockets' input
+// and cut it into packets, the comms thread routes them, and writer threads
+// own the sends. Each socket belongs to one reader and one writer, picked
+// from its handle, so its bytes stay in order. The stages only meet in
+// bounded lock-free queues.
+const unsigned int MaxPipelineStages = 16;
+
+// Items a stage's queue holds before whoever feeds it has to wait.
+const LONG StageQueueItems = 4096;
+
+// How long the router waits on a full stage queue. A send it could not hand
+// over closes the client, a watch or forget is held and tried again.
+const DWORD StagePushMillis = 50;
+
+// Batches a reader keeps for the router before it stops reading.
+const size_t ReaderBacklog = 256;
+
+// What goes between the stages, and which way.
+enum StageKind {
+  StagePackets,  // Reader to router, packets cut from one socket's input.
+  StageClosed,   // Reader or writer to router, the socket failed.
+  StagePartial,  // Reader to router when stopping, the start of a packet.
+  StageReleased, // Reader to router, no stage uses the socket any more.
+  StageWatch,    // To a reader, start reading the socket.
+  StageForget,   // Router to writer and on to the reader, let it go.
+  StageSend,     // Router to writer.
+  StageTail,     // Writer to router, the socket would not take it all.
+  StageCaughtUp  // Writer to router, what it was handed has all gone.
+};
+
+struct StageItem {
+  SOCKET socket;
+  unsigned int kind;
+  comms::packetQueue packets; // StagePackets.
+  LONGLONG read;              // When reading StagePackets began, if traced.
+  comms::PacketInfo info;     // StageSend, unless |frame| is already set.
+  comms::Frame frame;         // StageSend of frames encoded ahead of time.
+  std::vector<char> bytes;    // StagePartial and StageWatch.
+
+  explicit StageItem(SOCKET s = INVALID_SOCKET,
+                     unsigned int k = StagePackets)
+      : socket(s), kind(k), read(0), info() {}
+};
+
+// The stage queues swap items in and out, this keeps that from copying.
+void swap(StageItem &a, StageItem &b) {
+  std::swap(a.socket, b.socket);
+  std::swap(a.kind, b.kind);
+  a.packets.swap(b.packets);
+  std::swap(a.read, b.read);
+  comms::PacketInfo info;
+  comms::SwapInto(info, a.info);
+  comms::SwapInto(a.info, b.info);
+  comms::SwapInto(b.info, info);
+  a.frame.swap(b.frame);
+  a.bytes.swap(b.bytes);
+}
+
+// What a writer has gathered for one socket and not written yet.
+struct StageBatch {
+  comms::Frame frame;
+  size_t sent; // Bytes of |frame| already on the wire.
+  DWORD since; // When the oldest frame was added.
+  std::vector<std::pair<unsigned long long, LONGLONG>> traces; // Key, queued.
+  bool tail;   // What the router was last told, StageTail or StageCaughtUp.
+
+  StageBatch() : sent(0), since(0), tail(false) {}
+
+  void clear() {
+    frame.clear();
+    sent = 0;
+    traces.clear();
+  }
+};
+
+class NetServer;
+
+// A reader or writer thread and the queue it takes its work from.
+struct Stage {
+  NetServer *server;
+  HANDLE thread;
+  mpsc::BoundedQueue<StageItem> queue;
+  unsigned long long calls; // recv or send calls, only the stage adds.
+
+  explicit Stage(NetServer *owner)
+      : server(owner), thread(NULL), queue(StageQueueItems), calls(0) {}
+};
+
+class Pipeline {
+  std::vector<std::unique_ptr<Stage>> m_readers;
+  std::vector<std::unique_ptr<Stage>> m_writers;
+  std::unique_ptr<mpsc::BoundedQueue<StageItem>> m_routed; // To the router.
+  std::deque<StageItem> m_held; // Watches and forgets a full queue refused.
+  volatile LONG m_stopping;
+  volatile LONG m_writersRunning;
+  volatile LONG m_running;
+
+  // Socket handles are multiples of four.
+  static Stage &Pick(std::vector<std::unique_ptr<Stage>> &stages, SOCKET s) {
+    return *stages[(static_cast<size_t>(s) / 4) % stages.size()];
+  }
+
+  // Readers and writers never wait on the router, so it can wait on them,
+  // but only for StagePushMillis as it holds the server lock.
+  static bool PushWaiting(mpsc::BoundedQueue<StageItem> &queue,
+                          StageItem &item) {
+    DWORD start = GetTickCount();
+    while (!queue.Push(item)) {
+      if (GetTickCount() - start >= StagePushMillis)
+        return false;
+      Sleep(0);
+    }
+    return true;
+  }
+
+  // Watches and forgets can't be lost, a socket would never be read or
+  // never be closed. They keep their order behind any already held.
+  void PushControl(mpsc::BoundedQueue<StageItem> &queue, StageItem &item) {
+    if (!m_held.empty() || !PushWaiting(queue, item)) {
+      m_held.push_back(StageItem());
+      swap(m_held.back(), item);
+    }
+  }
+
+public:
+  Pipeline() : m_stopping(0), m_writersRunning(0), m_running(0) {}
+
+  bool IsOpen() const { return !m_readers.empty(); }
+
+  // Start |readers| and |writers| threads for |server|.
+  bool Open(NetServer *server, unsigned int readers, unsigned int writers) {
+    if (readers == 0 || writers == 0 || readers > MaxPipelineStages ||
+        writers > MaxPipelineStages)
+      return false;
+    m_routed.reset(new mpsc::BoundedQueue<StageItem>(StageQueueItems));
+    m_stopping = 0;
+    m_writersRunning = writers;
+    m_running = readers + writers;
+    for (unsigned int i = 0; i < readers; ++i)
+      m_readers.emplace_back(new Stage(server));
+    for (unsigned int i = 0; i < writers; ++i)
+      m_writers.emplace_back(new Stage(server));
+    for (auto &r : m_readers)
+      r->thread = CreateThread(NULL, 0, ServerReaderStage, r.get(), 0, NULL);
+    for (auto &w : m_writers)
+      w->thread = CreateThread(NULL, 0, ServerWriterStage, w.get(), 0, NULL);
+    return true;
+  }
+
+  unsigned int Readers() const {
+    return static_cast<unsigned int>(m_readers.size());
+  }
+  unsigned int Writers() const {
+    return static_cast<unsigned int>(m_writers.size());
+  }
+
+  Stage &ReaderFor(SOCKET s) { return Pick(m_readers, s); }
+  Stage &WriterFor(SOCKET s) { return Pick(m_writers, s); }
+
+  // Start reading |s|, after the bytes in |pending| which are taken.
+  void Watch(SOCKET s, std::vector<char> &pending) {
+    StageItem item(s, StageWatch);
+    item.bytes.swap(pending);
+    PushControl(ReaderFor(s).queue, item);
+  }
+
+  // Let |s| go. Its writer sends what it has first, and once the reader has
+  // let go too the router is told it can close the socket.
+  void Forget(SOCKET s) {
+    StageItem item(s, StageForget);
+    PushControl(WriterFor(s).queue, item);
+  }
+
+  // Hand what Watch and Forget could not on to the stages, in order.
+  void Retry() {
+    while (!m_held.empty()) {
+      StageItem &next = m_held.front();
+      Stage &stage = next.kind == StageWatch ? ReaderFor(next.socket)
+                                             : WriterFor(next.socket);
+      if (!stage.queue.Push(next))
+        return;
+      m_held.pop_front();
+    }
+  }
+
+  bool Holding() const { return !m_held.empty(); }
+
+  // Hand a StageSend to the socket's writer, false when its queue stayed
+  // full and the client should be closed.
+  bool Send(StageItem &item) {
+    return PushWaiting(WriterFor(item.socket).queue, item);
+  }
+
+  // From a reader or writer, false when the router is behind.
+  bool Route(StageItem &item) { return m_routed->Push(item); }
+
+  // For the router.
+  bool Take(StageItem &item) { return m_routed->Pop(item); }
+
+  // Writers finish what they were given and readers hand back what they
+  // hold, all through Take, after which Stopped is true.
+  void Stop() { InterlockedExchange(&m_stopping, 1); }
+  bool Stopping() const { return m_stopping != 0; }
+  bool WritersDone() const { return m_writersRunning == 0; }
+  bool Stopped() const { return m_running == 0; }
+
+  // Called by each stage as its thread ends.
+  void Exited(bool writer) {
+    if (writer)
+      InterlockedDecrement(&m_writersRunning);
+    InterlockedDecrement(&m_running);
+  }
+
+  // Once Stopped, let the threads go.
+  void Close() {
+    for (auto &r : m_readers)
+      CloseHandle(r->thread);
+    for (auto &w : m_writers)
+      CloseHandle(w->thread);
+    m_readers.clear();
+    m_writers.clear();
+  }
+
+  unsigned long long RecvCalls() const {
+    unsigned long long calls = 0;
+    for (auto &r : m_readers)
+      calls += r->calls;
+    return calls;
+  }
+
+  unsigned long long SendCalls() const {
+    unsigned long long calls = 0;
+    for (auto &w : m_writers)
+      calls += w->calls;
+    return calls;
+  }
+};
+
+class NetCommon {
+  std::string m_ipAddress;
+  std::vector<SOCKET> m_closedSockets;
+  std::string m_moduleDir;
+  std::string m_attachmentsDir;
+
+protected:
+  unsigned long long m_sendCalls;
+  LARGE_INTEGER m_frequency;
+
+  // Lock-free counters by packet type, the rest of the metrics are added
+  // by the server or client. Scrapes of m_scrape render m_metrics.
+  metrics::Counter m_packetsIn[MetricPacketTypes];
+  metrics::Counter m_bytesIn[MetricPacketTypes];
+  metrics::Counter m_packetsOut[MetricPacketTypes];
+  metrics::Counter m_bytesOut[MetricPacketTypes];
+  metrics::Registry m_metrics;
+  metrics::Endpoint m_scrape;
+  capture::Writer m_capture; // Closed unless the traffic is being captured.
+
+  // Lock-free
+  void CountOut(unsigned int type, unsigned int bytes) {
+    type = type < MetricPacketTypes ? type : 0;
+    m_packetsOut[type].Increment();
+    m_bytesOut[type].Add(bytes);
+  }
+
+  // Lock-free
+  // Count |bytes| of encoded frames as sent, by the type in each header.
+  void CountFrames(const char *data, unsigned int bytes) {
+    unsigned int at = 0;
+    while (at < bytes && bytes - at >= comms::HeaderSize) {
+      comms::Header hdr;
+      comms::AssignHeader(hdr, const_cast<char *>(data + at));
+      unsigned int size = comms::HeaderSize + hdr.len * sizeof(unsigned int);
+      CountOut(hdr.type, size < bytes - at ? size : bytes - at);
+      at += size;
+    }
+  }
+
+  // Lock-free
+  // Count the packets in |queue| from |from| on as read off the wire.
+  void CountInbound(const comms::packetQueue &queue, size_t from) {
+    for (size_t i = from; i < queue.size(); ++i) {
+      unsigned int type = queue[i].packet.hdr.type;
+      type = type < MetricPacketTypes ? type : 0;
+      m_packetsIn[type].Increment();
+      m_bytesIn[type].Add(comms::HeaderSize +
+                          queue[i].packet.hdr.len * sizeof(unsigned int));
+    }
+  }
+
+  // Lock-free
+  unsigned int MicrosSince(LONGLONG stamp) const {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return static_cast<unsigned int>((now.QuadPart - stamp) * 1000000 /
+                                     m_frequency.QuadPart);
+  }
+
+public:
+  // Get the folder the executable lives in.
+  const std::string &GetModuleDirectory() const { return m_moduleDir; }
+
+  // Get the path to the attachments folder.
+  const std::string &GetAttachmentsDirectory() const {
+    return m_attachmentsDir;
+  }
+
+  void OpenAttachmentsFile(const std::string &name, unsigned int parse,
+                           comms::OpenFileData &data) {
+    std::string fullpath(GetAttachmentsDirectory());
+    if (parse) {
+      // Get the username out of the string.
+      std::string::size_type pos = name.find_last_of('|');
+      if (pos != std::string::npos) {
+        fullpath.append(name.substr(0, pos));
+        data.displayName = name.substr(0, pos);
+      }
+    } else {
+      fullpath.append(name);
+      data.displayName = name;
+    }
+
+    data.file = fopen(fullpath.c_str(), "wb");
+    data.path = fullpath;
+  }
+
+  // The NetCommon constructor initializes WinSock and fetches our IP address.
+  NetCommon() : m_sendCalls(0) {
+    QueryPerformanceFrequency(&m_frequency);
+
+    // One series per known packet type.
+    struct Family {
+      const char *name;
+      const char *help;
+      metrics::Counter *counters;
+    } families[] = {
+        {"chatmium_packets_in_total", "Packets read, by type.", m_packetsIn},
+        {"chatmium_bytes_in_total", "Bytes read, by packet type.", m_bytesIn},
+        {"chatmium_packets_out_total", "Packets sent, by type.", m_packetsOut},
+        {"chatmium_bytes_out_total", "Bytes sent, by packet type.",
+         m_bytesOut}};
+    for (auto &f : families) {
+      for (unsigned int t = 0; t < MetricPacketTypes; ++t) {
+        std::string type(comms::CharToMessageType(t));
+        if (t == 0 || type != "unk")
+          m_metrics.Add(f.name, f.help, f.counters[t],
+                        "type=\"" + type + "\"");
+      }
+    }
+
+    // Get the attachments path irrespective of whether the startup succeeds.
+    {
+      char folder[MAX_PATH];
+      DWORD nChars = GetModuleFileName(NULL, folder, MAX_PATH);
+
+      std::string path(folder, nChars);
+      std::string::size_type pos = path.find_last_of('\\');
+      m_moduleDir = path.substr(0, pos + 1);
+      m_attachmentsDir = m_moduleDir + "attachments\\";
+    }
+
+    WSADATA w;
+
+    if (WSAStartup(0x0202, &w)) { // there was an error
+      std::cout << "Could not initialize Winsock." << std::endl;
+      throw "Could not initialize WinSock";
+      return;
+    }
+
+    if (w.wVersion != 0x0202) { // wrong WinSock version!
+      WSACleanup();             // unload ws2_32.dll
+      std::cout << "Wrong Winsock version." << std::endl;
+      throw "Incorrect WinSock version.";
+      return;
+    }
+
+    std::cout << "WSAStartup" << std::endl
+              << "Version: " << w.wVersion << std::endl
+              << "Description: " << w.szDescription << std::endl
+              << "Status: " << w.szSystemStatus << std::endl
+              << "Attachments: " << m_attachmentsDir.c_str() << std::endl;
+
+    // Get local IP's - useful for phones.
+    char ac[80];
+    if (gethostname(ac, sizeof(ac)) == SOCKET_ERROR) {
+      std::cout << "Error " << WSAGetLastError()
+                << " when getting local host name." << std::endl;
+      throw "Could not get local host name.";
+      return;
+    } else {
+      struct hostent *phe = gethostbyname(ac);
+      if (phe == 0) {
+        std::cout << "Bad host lookup." << std::endl;
+        throw "Bad host lookup.";
+        return;
+      } else {
+        // Print only the first address.
+        for (int i = 0; phe->h_addr_list[i] != 0; ++i) {
+          struct in_addr addr;
+          memcpy(&addr, phe->h_addr_list[i], sizeof(struct in_addr));
+          std::cout << "IP Address " << i << ": " << inet_ntoa(addr)
+                    << std::endl;
+
+          m_ipAddress = inet_ntoa(addr);
+          break;
+        }
+      }
+    }
+  }
+
+  ~NetCommon() {}
+
+  // Mark |s| as dead, it is cleaned up on the next HandleClosedSockets.
+  void MarkSocketClosed(SOCKET s) {
+    for (auto c : m_closedSockets) {
+      if (c == s)
+        return;
+    }
+    m_closedSockets.push_back(s);
+  }
+
+  bool HasClosedSockets() const { return !m_closedSockets.empty(); }
+  void ClearClosedSockets() { m_closedSockets.clear(); }
+
+  // Hand the sockets marked closed so far to the caller.
+  void TakeClosedSockets(std::vector<SOCKET> &closed) {
+    closed.swap(m_closedSockets);
+    m_closedSockets.clear();
+  }
+
+  void SendPacket(SOCKET s, const comms::Packet &packet) {
+    // Push the entire packet header + data to the vector.
+    LOG_DEBUG("Sending packet [%u][%u][%s]", packet.hdr.type,
+              packet.data.length(), packet.data.c_str());
+    comms::Frame upscaledData;
+    upscaledData.reserve(comms::HeaderSize / sizeof(int) + packet.hdr.len);
+    comms::EncodeHeader(packet.hdr, upscaledData);
+    comms::EncodePayload(packet.data, packet.hdr.len, upscaledData);
+
+    int bytes = send(s, reinterpret_cast<char *>(&upscaledData[0]),
+                     upscaledData.size() * sizeof(unsigned int), 0);
+    ++m_sendCalls;
+
+    LOG_DEBUG("Sent packet response [%d bytes]", bytes);
+
+    if (bytes <= 0) {
+      // Error occurred, we need to mark this socket as closed.
+      MarkSocketClosed(s);
+      return;
+    }
+    CountOut(packet.hdr.type, bytes);
+    m_capture.Record(capture::KindOut, s,
+                     reinterpret_cast<char *>(&upscaledData[0]), bytes);
+  }
+
+  // Send |header| followed by a payload which was encoded ahead of time, so
+  // the same buffer can go out to many sockets.
+  void SendEncodedPacket(SOCKET s, const comms::Header &header,
+                         const std::vector<unsigned int> &payload) {
+    comms::Frame encodedHeader;
+    comms::EncodeHeader(header, encodedHeader);
+
+    WSABUF buffers[2];
+    buffers[0].buf = reinterpret_cast<char *>(&encodedHeader[0]);
+    buffers[0].len = encodedHeader.size() * sizeof(unsigned int);
+    buffers[1].buf = reinterpret_cast<char *>(
+        const_cast<unsigned int *>(payload.empty() ? nullptr : &payload[0]));
+    buffers[1].len = payload.size() * sizeof(unsigned int);
+
+    DWORD bytes = 0;
+    ++m_sendCalls;
+    if (WSASend(s, buffers, payload.empty() ? 1 : 2, &bytes, 0, NULL, NULL) ==
+            SOCKET_ERROR ||
+        bytes == 0) {
+      // Error occurred, we need to mark this socket as closed.
+      MarkSocketClosed(s);
+      return;
+    }
+    CountOut(header.type, bytes);
+    m_capture.Record(capture::KindOut, s, buffers, payload.empty() ? 1 : 2);
+  }
+
+}; // NetCommon
+
+// The server is special, it uses a listen thread and a comms thread.
+class NetServer : public NetCommon {
+private:
+  HANDLE acceptThread;
+  HANDLE commsThread;
+  SOCKET m_acceptSocket;
+  SOCKET m_busSocket; // Loopback listener for other workers, if we are one.
+
+  CRITICAL_SECTION m_mutex;
+  ClientMap m_clients;
+
+  // Create a non-blocking socket listening on |port| at |address|.
+  static SOCKET Listen(unsigned short port, unsigned long address) {
+    SOCKADDR_IN addr; // the address structure for a TCP socket
+
+    addr.sin_family = AF_INET;               // Address family Internet
+    addr.sin_port = htons(port);             // Assign port to this socket
+    addr.sin_addr.s_addr = htonl(address);   // No destination
+
+    SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP); // Create socket
+
+    if (s == INVALID_SOCKET) {
+      std::cout << "Could not create socket." << std::endl;
+      throw "Could not create socket";
+    }
+
+    // Not too stressed if we can't reuse the socket.
+    const char reuse = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int));
+
+    if (bind(s, (LPSOCKADDR)&addr, sizeof(addr)) == SOCKET_ERROR) // Try binding
+    {                                                             // error
+      std::cout << "Could not bind to IP." << std::endl;
+      throw "Could not bind to IP";
+    }
+
+    listen(s, 10); // Start listening
+    unsigned long mode = 1;
+    ioctlsocket(s, FIONBIO, &mode); //  Non-blocking.
+    return s;
+  }
+
+  // Client handles by socket, and by alias for routing private traffic.
+  std::unordered_map<SOCKET, slots::Handle> m_socketIndex;
+  std::unordered_map<std::string, slots::Handle> m_aliasIndex;
+
+  // Sessions by token, both live and parked.
+  std::map<std::string, SessionData> m_sessions;
+  unsigned int m_sessionCounter;
+
+  // The user list is encoded once per membership change and the same buffer
+  // is sent to everyone asking for it. Recent changes are kept so clients
+  // can ask for only what changed since the version they have.
+  unsigned int m_listVersion;
+  unsigned int m_snapshotVersion;
+  unsigned int m_snapshotLen;
+  std::vector<unsigned int> m_listSnapshot;
+  std::vector<ListChange> m_listChanges;
+
+  SlowConsumerPolicy m_slowPolicy;
+  RateLimit m_rateLimits[PacketClasses];
+
+  // Channels by id, and ids by name. Fan-out only walks the subscribers of
+  // the channel a message was sent to.
+  std::unordered_map<unsigned int, Channel> m_channels;
+  std::unordered_map<std::string, unsigned int> m_channelIds;
+  unsigned int m_nextChannel;
+
+  // Chat as it went out, so late joiners can be sent what they missed.
+  msglog::MessageLog m_log;
+
+  // Federation. Messages are relayed once per peer server rather than once
+  // per remote client, and each node forwards what it has not seen before
+  // to its other peers.
+  unsigned int m_nodeId;
+  unsigned int m_relayCounter;
+  std::string m_peerSecret; // Hellos without it are refused.
+  std::vector<PeerAddress> m_peerAddresses;
+  std::unordered_map<unsigned int, RelayWindow> m_relaySeen; // By origin.
+  std::unordered_map<unsigned int, slots::Handle> m_peerRoutes; // By node.
+  std::map<std::string, RemoteUser> m_remoteUsers;            // By alias.
+  // The newest user list change for a user, by origin and alias. Leaves are
+  // kept, so a join which took the long way round can't undo one.
+  std::map<std::pair<unsigned int, std::string>, unsigned int> m_memberVersions;
+
+  // Hot restart, a new process asks for our sockets on m_handoffSocket.
+  // The accept thread waits for the request on m_handoffLink.
+  SOCKET m_handoffSocket;
+  SOCKET m_handoffLink;
+  std::vector<char> m_handoffData;
+  DWORD m_handoffDeadline;
+  bool m_handingOff; // Waiting on the new process, leave the sockets be.
+  bool m_handedOff;
+  std::string m_logDir;
+
+  // Lock Free
+  // Write a duplicate of |s| that process |pid| can open.
+  static bool DuplicateFor(SOCKET s, DWORD pid, std::string &out) {
+    WSAPROTOCOL_INFO info;
+    if (WSADuplicateSocket(s, pid, &info) == SOCKET_ERROR)
+      return false;
+    comms::AppendBytes(
+        out, std::string(reinterpret_cast<char *>(&info), sizeof(info)));
+    return true;
+  }
+
+  // Lock Free
+  // Open a socket written by DuplicateFor in the old process.
+  static SOCKET Reopen(const std::string &in, std::string::size_type &pos) {
+    std::string raw;
+    if (!comms::ReadBytes(in, pos, raw) || raw.length() != sizeof(WSAPROTOCOL_INFO))
+      return INVALID_SOCKET;
+
+    WSAPROTOCOL_INFO info;
+    memcpy(&info, raw.data(), sizeof(info));
+    SOCKET s = WSASocket(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO,
+                         FROM_PROTOCOL_INFO, &info, 0, WSA_FLAG_OVERLAPPED);
+    if (s != INVALID_SOCKET) {
+      unsigned long mode = 1;
+      ioctlsocket(s, FIONBIO, &mode); //  Non-blocking.
+    }
+    return s;
+  }
+
+  // Lock Free
+  // Everything but the clients: list version, channels and sessions.
+  void WriteServerState(std::string &out) {
+    comms::AppendField(out, HandoffVersion);
+    comms::AppendField(out, m_listVersion);
+    comms::AppendField(out, m_sessionCounter);
+    comms::AppendField(out, m_nextChannel);
+
+    comms::AppendField(out, m_channels.size());
+    for (auto &c : m_channels) {
+      comms::AppendField(out, c.first);
+      comms::AppendBytes(out, c.second.name);
+    }
+
+    comms::AppendField(out, m_sessions.size());
+    for (auto &se : m_sessions) {
+      const SessionData &session = se.second;
+      comms::AppendBytes(out, se.first);
+      comms::AppendBytes(out, session.alias);
+      comms::AppendList(out, session.recentSequences);
+      comms::AppendList(out, session.channels);
+      comms::AppendField(out, session.activeChannel);
+      comms::AppendPackets(out, session.pending);
+      comms::AppendField(out, session.parked ? 1 : 0);
+      comms::AppendField(out, session.droppedAt);
+    }
+  }
+
+  // Lock Free
+  bool ReadServerState(const std::string &in) {
+    std::string::size_type pos = 0;
+    unsigned int version, count;
+    if (!comms::ReadField(in, pos, version) || version != HandoffVersion ||
+        !comms::ReadField(in, pos, m_listVersion) ||
+        !comms::ReadField(in, pos, m_sessionCounter) ||
+        !comms::ReadField(in, pos, m_nextChannel) ||
+        !comms::ReadField(in, pos, count))
+      return false;
+    ++m_listVersion; // Our change history is empty, send full lists.
+
+    for (unsigned int i = 0; i < count; ++i) {
+      unsigned int id;
+      std::string name;
+      if (!comms::ReadField(in, pos, id) || !comms::ReadBytes(in, pos, name))
+        return false;
+      m_channels[id] = Channel{name, {}};
+      m_channelIds[name] = id;
+    }
+
+    if (!comms::ReadField(in, pos, count))
+      return false;
+    for (unsigned int i = 0; i < count; ++i) {
+      std::string token;
+      SessionData session{"", {}, {}, LobbyChannel, {}, false, 0};
+      unsigned int parked, droppedAt;
+      if (!comms::ReadBytes(in, pos, token) ||
+          !comms::ReadBytes(in, pos, session.alias) ||
+          !comms::ReadList(in, pos, session.recentSequences) ||
+          !comms::ReadList(in, pos, session.channels) ||
+          !comms::ReadField(in, pos, session.activeChannel) ||
+          !comms::ReadPackets(in, pos, session.pending) ||
+          !comms::ReadField(in, pos, parked) ||
+          !comms::ReadField(in, pos, droppedAt))
+        return false;
+      session.parked = parked != 0;
+      session.droppedAt = droppedAt;
+      m_sessions[token] = session;
+    }
+    return true;
+  }
+
+  // Lock Free
+  // One client with its socket, partial frames and queued output.
+  bool WriteClientState(const SocketData &so, DWORD pid, std::string &out) {
+    if (!DuplicateFor(so.socket, pid, out))
+      return false;
+    comms::AppendBytes(out, so.ip);
+    comms::AppendBytes(out, so.alias);
+    comms::AppendBytes(out, so.session);
+    comms::AppendList(out, so.recentSequences);
+    comms::AppendList(out, so.channels);
+    comms::AppendField(out, so.activeChannel);
+
+    comms::AppendField(out, so.fileTargets.size());
+    for (auto &t : so.fileTargets) {
+      comms::AppendField(out, t.first);
+      comms::AppendBytes(out, t.second);
+    }
+
+    // What the client is owed in acks, and how much it may still send.
+    comms::AppendField(out, so.acks.cumulative ? 1 : 0);
+    comms::AppendField(out, so.acks.since);
+    for (auto &l : so.acks.lanes) {
+      comms::AppendField(out, (l.seen ? 1 : 0) | (l.pending ? 2 : 0));
+      comms::AppendField(out, l.newest);
+      comms::AppendField(out, l.bits);
+    }
+    for (auto &b : so.buckets) {
+      comms::AppendField(out, b.MilliTokens());
+      comms::AppendField(out, b.Last());
+    }
+
+    comms::AppendBytes(out,
+                       std::string(so.packetData.begin(), so.packetData.end()));
+    comms::AppendPackets(out, so.inboundMessages);
+    OutboundQueue outbound(so.outboundMessages);
+    comms::packetQueue queued;
+    outbound.DrainTo(queued);
+    comms::AppendPackets(out, queued);
+    return true;
+  }
+
+  // Lock Free
+  // Add |client| to the client map, a pipeline is left to the caller.
+  SocketData &InsertClient(SOCKET client, const std::string &ip) {
+    slots::Handle handle = m_clients.Insert(SocketData{client, ip, ""});
+    SocketData &so = *m_clients.Get(handle);
+    so.handle = handle;
+    so.activeChannel = NoChannel;
+    m_socketIndex[client] = handle;
+    // We coalesce writes ourselves, Nagle would only hold them back.
+    BOOL noDelay = TRUE;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY,
+               reinterpret_cast<const char *>(&noDelay), sizeof(noDelay));
+    if (m_reader.IsOpen() && !m_reader.Watch(client))
+      MarkSocketClosed(client);
+    m_capture.Record(capture::KindOpen, client, ip.c_str(), ip.length());
+    return so;
+  }
+
+  // Lock Free
+  bool ReadClientState(const std::string &in) {
+    std::string::size_type pos = 0;
+    SOCKET s = Reopen(in, pos);
+    std::string ip;
+    if (s == INVALID_SOCKET || !comms::ReadBytes(in, pos, ip))
+      return false;
+
+    // A reader only starts on it once it has the bytes read so far.
+    SocketData &so = InsertClient(s, ip);
+    std::string alias, packetData;
+    std::vector<unsigned int> channels;
+    unsigned int activeChannel, targets;
+    comms::packetQueue queued;
+    if (!comms::ReadBytes(in, pos, alias) ||
+        !comms::ReadBytes(in, pos, so.session) ||
+        !comms::ReadList(in, pos, so.recentSequences) ||
+        !comms::ReadList(in, pos, channels) ||
+        !comms::ReadField(in, pos, activeChannel) ||
+        !comms::ReadField(in, pos, targets)) {
+      MarkSocketClosed(s);
+      return false;
+    }
+    for (unsigned int i = 0; i < targets; ++i) {
+      unsigned int id;
+      std::string user;
+      if (!comms::ReadField(in, pos, id) || !comms::ReadBytes(in, pos, user)) {
+        MarkSocketClosed(s);
+        return false;
+      }
+      so.fileTargets[id] = user;
+    }
+    unsigned int cumulative, since;
+    if (!comms::ReadField(in, pos, cumulative) ||
+        !comms::ReadField(in, pos, since)) {
+      MarkSocketClosed(s);
+      return false;
+    }
+    so.acks.cumulative = cumulative != 0;
+    so.acks.since = since;
+    for (auto &l : so.acks.lanes) {
+      unsigned int flags;
+      if (!comms::ReadField(in, pos, flags) ||
+          !comms::ReadField(in, pos, l.newest) ||
+          !comms::ReadField(in, pos, l.bits)) {
+        MarkSocketClosed(s);
+        return false;
+      }
+      l.seen = (flags & 1) != 0;
+      l.pending = (flags & 2) != 0;
+    }
+    for (auto &b : so.buckets) {
+      unsigned int milliTokens, last;
+      if (!comms::ReadField(in, pos, milliTokens) ||
+          !comms::ReadField(in, pos, last)) {
+        MarkSocketClosed(s);
+        return false;
+      }
+      b.Restore(milliTokens, last);
+    }
+    if (!comms::ReadBytes(in, pos, packetData) ||
+        !comms::ReadPackets(in, pos, so.inboundMessages) ||
+        !comms::ReadPackets(in, pos, queued)) {
+      MarkSocketClosed(s);
+      return false;
+    }
+
+    IndexAlias(so, alias);
+    for (auto c : channels)
+      Subscribe(so, c);
+    so.activeChannel = activeChannel;
+    so.packetData.assign(packetData.begin(), packetData.end());
+    for (auto &q : queued)
+      so.outboundMessages.push_back(q);
+    if (m_pipeline.IsOpen())
+      m_pipeline.Watch(s, so.packetData);
+    return true;
+  }
+
+  // Whoever needs telling where we are, ticked by the comms thread.
+  std::vector<std::unique_ptr<discovery::Announcer>> m_announcers;
+
+  // Reading through a completion port when asked to, and the numbers to
+  // compare it with polling.
+  iocp::CompletionReader m_reader;
+  Pipeline m_pipeline; // Or in stages, closed unless asked for.
+  DWORD m_flushDeadline; // How long a small batch may wait, in milliseconds.
+  IoStats m_ioStats;
+  std::vector<unsigned int> m_latencies;
+  size_t m_latencyNext;
+
+  // Server metrics, the gauges are filled in when scraped.
+  metrics::Histogram m_ingestToSend;
+  metrics::Counter m_throttledTotal[PacketClasses];
+  metrics::Counter m_rejectedTotal[PacketClasses];
+  metrics::Counter m_retransmitsTotal;
+  metrics::Counter m_pausedDropsTotal;
+  metrics::Gauge m_clientsGauge;
+  metrics::Gauge m_peersGauge;
+  metrics::Gauge m_parkedGauge;
+  metrics::Gauge m_channelsGauge;
+  metrics::Gauge m_inboundGauge;
+  metrics::Gauge m_outboundGauge;
+  metrics::Gauge m_outboundBytesGauge;
+
+  // Lock Free
+  // Stamp |packets| from |from| on as read now, for latency.
+  static void StampPackets(comms::packetQueue &packets, size_t from) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    for (size_t i = from; i < packets.size(); ++i)
+      packets[i].stamp = now.QuadPart;
+  }
+
+  // Lock Free
+  // Queue the packets completed by new data on |so|, stamped for latency.
+  void QueueInbound(SocketData &so) {
+    size_t before = so.inboundMessages.size();
+    LONGLONG read = trace::tracer.On() ? trace::Tracer::Now() : 0;
+    comms::QueueCompletePackets(so.packetData, so.inboundMessages);
+    if (so.inboundMessages.size() == before)
+      return;
+
+    StampPackets(so.inboundMessages, before);
+    NoteInbound(so, before, read);
+  }
+
+  // Lock Free
+  // Count the stamped packets on |so| from |from| on, and trace the chat
+  // among them from |read|, when reading them began.
+  void NoteInbound(SocketData &so, size_t from, LONGLONG read) {
+    for (size_t i = from; i < so.inboundMessages.size(); ++i) {
+      comms::PacketInfo &info = so.inboundMessages[i];
+      if (read && !so.peerNode && info.packet.hdr.type == PKT_MSG) {
+        info.traceKey = trace::SenderKey(so.alias, info.packet.hdr.sequence);
+        trace::tracer.Record("server.recv", info.traceKey, read, info.stamp,
+                             trace::FlowStep);
+      }
+    }
+    m_ioStats.packetsIn += so.inboundMessages.size() - from;
+    CountInbound(so.inboundMessages, from);
+  }
+
+  // Lock Free
+  void RecordLatency(LONGLONG stamp) {
+    unsigned int micros = MicrosSince(stamp);
+    m_ingestToSend.Record(micros);
+    if (m_latencies.size() < LatencySamples)
+      m_latencies.push_back(micros);
+    else
+      m_latencies[m_latencyNext++ % LatencySamples] = micros;
+  }
+
+  // Lock Free
+  // Give |info| the next log sequence and append it to the log as encoded.
+  void LogMessage(unsigned int channel, comms::PacketInfo &info) {
+    if (!m_log.IsOpen())
+      return;
+
+    info.packet.hdr.sequence = m_log.NextSequence();
+    comms::Frame frame;
+    frame.reserve(comms::HeaderSize / sizeof(int) + info.packet.hdr.len);
+    comms::EncodeHeader(info.packet.hdr, frame);
+    comms::EncodePayload(info.packet.data, info.packet.hdr.len, frame);
+    m_log.Append(channel, reinterpret_cast<const char *>(&frame[0]),
+                 frame.size() * sizeof(unsigned int));
+  }
+
+  // Lock Free
+  // Count the frames |so| was given from |from| on, and start its batch's
+  // clock if they are the first.
+  void Batched(SocketData &so, size_t from) {
+    if (from == 0)
+      so.outBatchSince = GetTickCount();
+    CountFrames(reinterpret_cast<const char *>(&so.outBatch[from]),
+                (so.outBatch.size() - from) * sizeof(unsigned int));
+  }
+
+  // Lock Free
+  // Send |packet| to client |s|. It joins the socket's batch, or when
+  // pipelined goes through its writer, behind whatever was handed over
+  // before.
+  void Deliver(SOCKET s, const comms::Packet &packet) {
+    SocketData *so = FindSocket(s);
+    if (m_pipeline.IsOpen()) {
+      StageItem item(s, StageSend);
+      item.info.packet = packet;
+      if (so)
+        Piggyback(*so, item.info.packet.hdr);
+      if (!m_pipeline.Send(item))
+        MarkSocketClosed(s);
+      return;
+    }
+    if (!so) {
+      SendPacket(s, packet);
+      return;
+    }
+    comms::Header hdr(packet.hdr);
+    Piggyback(*so, hdr);
+    size_t from = so->outBatch.size();
+    comms::EncodeHeader(hdr, so->outBatch);
+    comms::EncodePayload(packet.data, packet.hdr.len, so->outBatch);
+    Batched(*so, from);
+  }
+
+  // Lock Free
+  // As Deliver, for a header and a payload which was encoded ahead of time.
+  void DeliverEncoded(SOCKET s, const comms::Header &header,
+                      const std::vector<unsigned int> &payload) {
+    comms::Frame *frame;
+    StageItem item(s, StageSend);
+    SocketData *so = FindSocket(s);
+    if (m_pipeline.IsOpen()) {
+      frame = &item.frame;
+    } else if (so) {
+      frame = &so->outBatch;
+    } else {
+      SendEncodedPacket(s, header, payload);
+      return;
+    }
+
+    comms::Header hdr(header);
+    if (so)
+      Piggyback(*so, hdr);
+    size_t from = frame->size();
+    frame->reserve(from + comms::HeaderSize / sizeof(int) + payload.size());
+    comms::EncodeHeader(hdr, *frame);
+    frame->insert(frame->end(), payload.begin(), payload.end());
+    if (!m_pipeline.IsOpen())
+      Batched(*so, from);
+    else if (!m_pipeline.Send(item))
+      MarkSocketClosed(s);
+  }
+
+  // Lock Free
+  // Send |so| the logged messages after |since| in the channels it is in,
+  // or the last |count| when it has never seen any. The frames are taken
+  // from the mapped log as they are, nothing is encoded again.
+  void SendBacklog(SocketData &so, unsigned int since, unsigned int count) {
+    std::vector<msglog::Record> records;
+    m_log.ReadSince(since, count, so.channels, records);
+
+    if (records.empty())
+      return;
+
+    // The frames are copied as logged, behind whatever is batched for the
+    // socket, and go out with the batch, a writer's when pipelined. Either
+    // way a short write keeps the rest for later.
+    StageItem item(so.socket, StageSend);
+    comms::Frame &frame = m_pipeline.IsOpen() ? item.frame : so.outBatch;
+    size_t from = frame.size();
+    size_t words = 0;
+    for (auto &r : records)
+      words += r.bytes / sizeof(unsigned int);
+    frame.reserve(from + words);
+    for (auto &r : records) {
+      const unsigned int *frameWords =
+          reinterpret_cast<const unsigned int *>(r.frame);
+      frame.insert(frame.end(), frameWords,
+                   frameWords + r.bytes / sizeof(unsigned int));
+    }
+    if (!m_pipeline.IsOpen())
+      Batched(so, from);
+    else if (!m_pipeline.Send(item))
+      MarkSocketClosed(so.socket);
+  }
+
+  // Lock Free
+  // Deliver |info| to the subscribers of |channel|, logging chat for replay.
+  void FanOut(unsigned int channel, comms::PacketInfo &info) {
+    auto it = m_channels.find(channel);
+    if (it == m_channels.end())
+      return;
+
+    // Chat is logged for replay, file chunks are not.
+    if (info.packet.hdr.type != PKT_FILE_IN)
+      LogMessage(channel, info);
+    // Receivers only see the log sequence, trace by that from here on.
+    if (info.traceKey)
+      info.traceKey = trace::LogKey(info.packet.hdr.sequence);
+
+    for (auto &h : it->second.subscribers) {
+      SocketData *so = m_clients.Get(h);
+      if (so)
+        Enqueue(*so, info);
+    }
+    // Hold on to some for clients which are busy reconnecting.
+    for (auto &se : m_sessions) {
+      SessionData &session = se.second;
+      if (session.parked && session.pending.size() < MaxParkedMessages &&
+          std::find(session.channels.begin(), session.channels.end(),
+                    channel) != session.channels.end())
+        session.pending.push_back(info);
+    }
+  }
+
+  // Lock Free
+  unsigned int ChannelId(const std::string &name) {
+    auto it = m_channelIds.find(name);
+    if (it != m_channelIds.end())
+      return it->second;
+
+    unsigned int id = m_nextChannel++;
+    m_channelIds[name] = id;
+    m_channels[id] = Channel{name, {}};
+    return id;
+  }
+
+  // Lock Free
+  // Subscribe |so| to channel |id| and make it the one it talks in.
+  void Subscribe(SocketData &so, unsigned int id) {
+    so.activeChannel = id;
+    for (auto c : so.channels) {
+      if (c == id)
+        return;
+    }
+    so.channels.push_back(id);
+    m_channels[id].subscribers.push_back(so.handle);
+  }
+
+  // Lock Free
+  void Unsubscribe(SocketData &so, unsigned int id) {
+    bool found = false;
+    for (auto c = so.channels.begin(); c != so.channels.end(); ++c) {
+      if (*c == id) {
+        so.channels.erase(c);
+        found = true;
+        break;
+      }
+    }
+    if (!found)
+      return;
+
+    if (so.activeChannel == id)
+      so.activeChannel = so.channels.empty() ? NoChannel : so.channels.back();
+
+    auto it = m_channels.find(id);
+    if (it == m_channels.end())
+      return;
+
+    std::vector<slots::Handle> &subscribers = it->second.subscribers;
+    for (size_t i = 0; i < subscribers.size(); ++i) {
+      if (subscribers[i] == so.handle) {
+        subscribers[i] = subscribers.back();
+        subscribers.pop_back();
+        break;
+      }
+    }
+
+    CloseIfIdle(id);
+  }
+
+  // Lock Free
+  // Close channel |id| once nobody is in it and no parked session will come
+  // back to it.
+  void CloseIfIdle(unsigned int id) {
+    auto it = m_channels.find(id);
+    if (it == m_channels.end() || id == LobbyChannel ||
+        !it->second.subscribers.empty())
+      return;
+
+    for (auto &se : m_sessions) {
+      const SessionData &session = se.second;
+      if (session.parked &&
+          std::find(session.channels.begin(), session.channels.end(), id) !=
+              session.channels.end())
+        return;
+    }
+    m_channelIds.erase(it->second.name);
+    m_channels.erase(it);
+  }
+
+  // Lock Free
+  // Whether everyone the file chunk |packet| from |so| goes to can queue it
+  // now, counting what this round already routed to them in |routed|. Under
+  // SlowPauseFiles a chunk which does not fit stays in its sender's inbound
+  // queue unacked, so the sender waits rather than losing it.
+  bool RoomForFile(
+      SocketData &so, const comms::Packet &packet,
+      std::unordered_map<const SocketData *, RoutedFiles> &routed) {
+    if (m_slowPolicy != SlowPauseFiles)
+      return true;
+
+    std::string alias;
+    if (packet.hdr.current == 0 && packet.hdr.flags == 1) {
+      std::string::size_type pos = packet.data.find_last_of('|');
+      if (pos != std::string::npos)
+        alias = std::string(packet.data.substr(pos + 1));
+    } else {
+      auto target = so.fileTargets.find(packet.hdr.id);
+      if (target != so.fileTargets.end())
+        alias = target->second;
+    }
+
+    std::vector<SocketData *> recipients;
+    if (!alias.empty()) {
+      SocketData *recipient = FindAlias(alias);
+      if (recipient)
+        recipients.push_back(recipient);
+    } else {
+      auto it = m_channels.find(so.activeChannel);
+      if (it != m_channels.end()) {
+        for (auto &h : it->second.subscribers) {
+          SocketData *subscriber = m_clients.Get(h);
+          if (subscriber)
+            recipients.push_back(subscriber);
+        }
+      }
+    }
+
+    unsigned int size = comms::HeaderSize + packet.hdr.len * sizeof(int);
+    for (auto r : recipients) {
+      RoutedFiles &sent = routed[r];
+      if (!r->outboundMessages.FileRoom(sent.bytes + size, sent.packets + 1))
+        return false;
+    }
+    for (auto r : recipients) {
+      RoutedFiles &sent = routed[r];
+      sent.bytes += size;
+      ++sent.packets;
+    }
+    return true;
+  }
+
+  // Lock Free
+  // Queue |info| for |so|, applying the slow consumer policy if the client
+  // already has too much waiting.
+  void Enqueue(SocketData &so, const comms::PacketInfo &info) {
+    OutboundQueue &queue = so.outboundMessages;
+    unsigned int size = OutboundQueue::WireSize(info);
+    if (so.peerNode) {
+      // The policy is for clients. A relay batch carries a whole room, so
+      // a peer which cannot take one is unlinked and synced again instead.
+      if (!queue.push_back(info)) {
+        LOG_WARN("Unlinking backed up peer node [%u]", so.peerNode);
+        MarkSocketClosed(so.socket);
+      }
+      return;
+    }
+    if (queue.Bytes() + size > OutboundHighWater) {
+      switch (m_slowPolicy) {
+      case SlowDropOldestChat:
+        while (queue.Bytes() + size > OutboundHighWater &&
+               queue.DropOldestChat()) {
+        }
+        if (queue.Bytes() + size > OutboundHighWater) {
+          ++queue.dropped;
+          return;
+        }
         break;
+      case SlowPauseFiles:
+        // Chunks wait behind the client's chat, which goes out first, and
+        // nobody else waits for it. Chat is bounded by the packet limit.
+        // Local senders are held back by RoomForFile, so only chunks a
+        // peer relayed can still be turned away here.
+        if (OutboundQueue::IsFile(info) &&
+            queue.FileBytes() + size > PausedFileBytes) {
+          ++queue.dropped;
+          m_pausedDropsTotal.Increment();
+          return;
+        }
+        break;
+      case SlowDisconnect:
+        LOG_WARN("Disconnecting slow client: %s", so.alias);
+        MarkSocketClosed(so.socket);
+        return;
+      }
+    }
+    bool queued;
+    if (info.traceKey && trace::tracer.On()) {
+      // Each receiver's copy is stamped for its own wait in the queue.
+      comms::PacketInfo traced(info);
+      traced.queued = trace::Tracer::Now();
+      queued = queue.push_back(traced);
+    } else {
+      queued = queue.push_back(info);
+    }
+    if (!queued && m_slowPolicy == SlowPauseFiles)
+      m_pausedDropsTotal.Increment();
+  }
+
+  // Lock Free
+  // Add |entry| to the batch for |peer|, sending the batch once it is full.
+  void QueueRelay(SocketData &peer, const comms::RelayEntry &entry) {
+    comms::AppendRelayEntry(entry, peer.relayBatch);
+    if (peer.relayBatch.length() >= MaxRelayBatch)
+      FlushRelay(peer);
+  }
+
+  // Lock Free
+  void FlushRelay(SocketData &peer) {
+    if (peer.relayBatch.empty())
+      return;
+    comms::PacketInfo info{{{PKT_RELAY, 0, 0, 0, peer.relayBatch.length(), 0,
+                             m_nodeId},
+                            peer.relayBatch},
+                           false,
+                           0};
+    Enqueue(peer, info);
+    peer.relayBatch.clear();
+  }
+
+  // Lock Free
+  // Queue |entry| for every peer but the one it came in on.
+  void RelayToPeers(const comms::RelayEntry &entry, slots::Handle except) {
+    for (auto &c : m_clients) {
+      if (c.peerNode && c.handle != except)
+        QueueRelay(c, entry);
+    }
+  }
+
+  // Lock Free
+  comms::RelayEntry NewRelayEntry(unsigned int kind,
+                                  const comms::PacketInfo &info,
+                                  const std::string &scope) {
+    comms::RelayEntry entry{kind, m_nodeId, ++m_relayCounter,
+                            info.packet.hdr, scope, info.packet.data};
+    return entry;
+  }
+
+  // Lock Free
+  // Hand a message sent to a local channel on to the other nodes.
+  void RelayBroadcast(unsigned int channel, const comms::PacketInfo &info) {
+    auto it = m_channels.find(channel);
+    if (it != m_channels.end())
+      RelayToPeers(NewRelayEntry(comms::RelayBroadcast, info, it->second.name),
+                   slots::InvalidHandle);
+  }
+
+  // Lock Free
+  // Send a message for |alias| towards the node the user is on, false when
+  // nobody by that name is known elsewhere.
+  bool RelayPrivate(const std::string &alias, const comms::PacketInfo &info) {
+    auto user = m_remoteUsers.find(alias);
+    if (user == m_remoteUsers.end())
+      return false;
+    auto route = m_peerRoutes.find(user->second.node);
+    SocketData *peer =
+        route == m_peerRoutes.end() ? nullptr : m_clients.Get(route->second);
+    if (!peer)
+      return false;
+    QueueRelay(*peer, NewRelayEntry(comms::RelayRouted, info, alias));
+    return true;
+  }
+
+  // Lock Free
+  // Tell the other nodes about a user list change, |origin| is the node the
+  // user is on and |version| orders the changes it made.
+  void RelayMembership(const std::string &alias, const std::string &entry,
+                       bool joined, unsigned int origin, unsigned int version,
+                       slots::Handle except) {
+    comms::RelayEntry relay{joined ? comms::RelayJoined : comms::RelayLeft,
+                            origin, version, {}, entry, alias};
+    RelayToPeers(relay, except);
+  }
+
+  // Lock Free
+  unsigned int MemberVersion(unsigned int origin, const std::string &alias) {
+    auto it = m_memberVersions.find(std::make_pair(origin, alias));
+    return it == m_memberVersions.end() ? 0 : it->second;
+  }
+
+  // Lock Free
+  // Bring a freshly linked peer up to date with every user we know about.
+  void SyncPeer(SocketData &peer) {
+    for (auto &c : m_clients) {
+      if (c.alias.empty())
+        continue;
+      comms::RelayEntry relay{comms::RelayJoined,
+                              m_nodeId,
+                              MemberVersion(m_nodeId, c.alias),
+                              {},
+                              c.ip + " : " + c.alias,
+                              c.alias};
+      QueueRelay(peer, relay);
+    }
+    for (auto &u : m_remoteUsers) {
+      comms::RelayEntry relay{comms::RelayJoined,
+                              u.second.node,
+                              MemberVersion(u.second.node, u.first),
+                              {},
+                              u.second.entry,
+                              u.first};
+      QueueRelay(peer, relay);
+    }
+  }
+
+  // Lock Free
+  void SendPeerHello(SocketData &so, unsigned int reply) {
+    comms::Packet hello{{PKT_PEER_HELLO, reply, 0, 0, 0, 0, m_nodeId},
+                        m_peerSecret};
+    hello.hdr.len = hello.data.length();
+    Deliver(so.socket, hello);
+  }
+
+  // Lock Free
+  // True if |so| is a link we dialled to one of our own peers.
+  bool DialledPeer(const SocketData &so) const {
+    for (auto &p : m_peerAddresses) {
+      if (p.link == so.handle)
+        return true;
+    }
+    return false;
+  }
+
+  // Lock Free
+  // A peer says hello with its node id, the side that connected first gets
+  // a hello back. Peers skip rate limits and may speak for anyone, so a hello
+  // on a connection which came to us needs the secret, and a client which
+  // has joined never becomes one.
+  void HandlePeerHello(SocketData &so, const comms::Packet &packet) {
+    std::string secret(packet.data);
+    bool dialled = DialledPeer(so);
+    if (so.peerNode || !so.alias.empty() || secret != m_peerSecret ||
+        (!dialled && m_peerSecret.empty())) {
+      LOG_WARN("Refused peer hello from: %s", so.ip);
+      MarkSocketClosed(so.socket);
+      return;
+    }
+    if (packet.hdr.id == m_nodeId || packet.hdr.id == 0) {
+      MarkSocketClosed(so.socket); // We linked to ourselves.
+      return;
+    }
+
+    std::cout << "Peer node [" << packet.hdr.id << "] linked from "
+              << so.ip.c_str() << std::endl;
+    so.peerNode = packet.hdr.id;
+    m_peerRoutes[so.peerNode] = so.handle;
+    if (packet.hdr.flags == 0)
+      SendPeerHello(so, 1);
+    SyncPeer(so);
+  }
+
+  // Lock Free
+  // Apply a user list change from another node, passing it on only when it
+  // tells us something new. That is what keeps membership from looping.
+  void HandleRemoteMembership(SocketData &link, const comms::RelayEntry &e) {
+    if (e.origin == m_nodeId)
+      return;
+
+    // Changes from an origin only move forward. A leave wins a tie, it may
+    // be one we made up for the join when the origin went away.
+    bool joined = e.kind == comms::RelayJoined;
+    unsigned int &newest = m_memberVersions[std::make_pair(e.origin, e.data)];
+    if (joined ? e.relayId <= newest : e.relayId < newest)
+      return;
+    newest = e.relayId;
+
+    auto user = m_remoteUsers.find(e.data);
+    if (joined) {
+      if (user != m_remoteUsers.end() && user->second.node == e.origin &&
+          user->second.entry == e.scope)
+        return;
+      if (user != m_remoteUsers.end())
+        NoteEntry(user->second.entry, false, ++m_listVersion);
+      m_remoteUsers[e.data] = RemoteUser{e.scope, e.origin};
+      if (m_peerRoutes.find(e.origin) == m_peerRoutes.end())
+        m_peerRoutes[e.origin] = link.handle;
+      NoteEntry(e.scope, true, ++m_listVersion);
+    } else {
+      if (user == m_remoteUsers.end() || user->second.node != e.origin)
+        return;
+      NoteEntry(user->second.entry, false, ++m_listVersion);
+      m_remoteUsers.erase(user);
+    }
+    RelayMembership(e.data, e.scope, joined, e.origin, e.relayId, link.handle);
+  }
+
+  // Lock Free
+  // Deliver a relay batch from |link| locally and pass it on to the other
+  // peers. Messages from an origin are only taken once, whatever order they
+  // arrive in.
+  void HandleRelay(SocketData &link, const comms::Packet &packet) {
+    std::string::size_type pos = 0;
+    comms::RelayEntry e;
+    while (pos < packet.data.length() &&
+           comms::ReadRelayEntry(packet.data, pos, e)) {
+      if (e.kind == comms::RelayJoined || e.kind == comms::RelayLeft) {
+        HandleRemoteMembership(link, e);
+        continue;
+      }
+
+      if (e.origin == m_nodeId || !m_relaySeen[e.origin].Take(e.relayId))
+        continue;
+      m_peerRoutes[e.origin] = link.handle;
+
+      comms::PacketInfo info{{e.hdr, e.data}, false, 0};
+      if (e.kind == comms::RelayBroadcast) {
+        auto channel = m_channelIds.find(e.scope);
+        if (channel != m_channelIds.end()) {
+          if (info.packet.hdr.type == PKT_MSG)
+            info.packet.hdr.id = channel->second;
+          FanOut(channel->second, info);
+        }
+        RelayToPeers(e, link.handle);
+      } else if (e.kind == comms::RelayRouted) {
+        SocketData *target = FindAlias(e.scope);
+        if (target) {
+          Enqueue(*target, info);
+          continue;
+        }
+
+        // Not ours, pass it along towards the user's node.
+        auto user = m_remoteUsers.find(e.scope);
+        auto route = user == m_remoteUsers.end()
+                         ? m_peerRoutes.end()
+                         : m_peerRoutes.find(user->second.node);
+        SocketData *next = route == m_peerRoutes.end()
+                               ? nullptr
+                               : m_clients.Get(route->second);
+        if (next && next != &link)
+          QueueRelay(*next, e);
+      }
+    }
+  }
+
+  // Lock Free
+  // Forget the nodes we reached through a peer link which went away, along
+  // with their users.
+  void DropPeerRoutes(slots::Handle link) {
+    for (auto it = m_peerRoutes.begin(); it != m_peerRoutes.end();) {
+      if (it->second == link)
+        it = m_peerRoutes.erase(it);
+      else
+        ++it;
+    }
+
+    for (auto it = m_remoteUsers.begin(); it != m_remoteUsers.end();) {
+      if (m_peerRoutes.find(it->second.node) != m_peerRoutes.end()) {
+        ++it;
+        continue;
+      }
+      NoteEntry(it->second.entry, false, m_listVersion);
+      RelayMembership(it->first, it->second.entry, false, it->second.node,
+                      MemberVersion(it->second.node, it->first), link);
+      it = m_remoteUsers.erase(it);
+    }
+
+    // Nothing more comes from nodes we can no longer reach, and a node which
+    // links again sends its whole membership.
+    for (auto it = m_memberVersions.begin(); it != m_memberVersions.end();) {
+      if (it->first.first != m_nodeId &&
+          m_peerRoutes.find(it->first.first) == m_peerRoutes.end())
+        it = m_memberVersions.erase(it);
+      else
+        ++it;
+    }
+  }
+
+  // Lock Free
+  // Record a join or leave under |version|, several changes may share one.
+  void NoteEntry(const std::string &entry, bool joined, unsigned int version) {
+    m_listChanges.push_back(ListChange{version, joined, entry});
+    if (m_listChanges.size() > MaxListChanges)
+      m_listChanges.erase(m_listChanges.begin());
+  }
+
+  // Lock Free
+  // Record a local client joining or leaving, and tell the other nodes.
+  void NoteMembership(const SocketData &so, bool joined, unsigned int version) {
+    std::string entry(so.ip);
+    entry.append(" : ");
+    entry.append(so.alias);
+    NoteEntry(entry, joined, version);
+
+    unsigned int change = ++m_relayCounter;
+    if (joined)
+      m_memberVersions[std::make_pair(m_nodeId, so.alias)] = change;
+    else
+      m_memberVersions.erase(std::make_pair(m_nodeId, so.alias));
+    RelayMembership(so.alias, entry, joined, m_nodeId, change,
+                    slots::InvalidHandle);
+  }
+
+  // Lock Free
+  void RebuildUserList() {
+    std::string user_list("Users on this server:|");
+    for (auto &c : m_clients) {
+      if (c.alias.empty())
+        continue;
+      user_list.append(c.ip);
+      user_list.append(" : ");
+      user_list.append(c.alias);
+      user_list.append("|_+_|");
+    }
+    for (auto &u : m_remoteUsers) {
+      user_list.append(u.second.entry);
+      user_list.append("|_+_|");
+    }
+    m_listSnapshot.clear();
+    comms::EncodePayload(user_list, user_list.length(), m_listSnapshot);
+    m_snapshotLen = user_list.length();
+    m_snapshotVersion = m_listVersion;
+  }
+
+  // Lock Free
+  // The request id holds the list version the client already has, 0 if
+  // none. The ack id holds the version we answered with.
+  void SendUserList(SocketData &so, const comms::Packet &request) {
+    unsigned int known = request.hdr.id;
+    comms::Header hdr{PKT_LST_ACK,          0, 0, 0, 0,
+                      request.hdr.sequence, m_listVersion};
+
+    if (known == m_listVersion) {
+      hdr.flags = 2; // Nothing changed.
+      DeliverEncoded(so.socket, hdr, std::vector<unsigned int>());
+      return;
+    }
+
+    if (known != 0 && known < m_listVersion && !m_listChanges.empty() &&
+        m_listChanges.front().version <= known) {
+      std::string delta;
+      for (auto &c : m_listChanges) {
+        if (c.version <= known)
+          continue;
+        delta.append(c.joined ? "+" : "-");
+        delta.append(c.entry);
+        delta.append("|_+_|");
+      }
+      hdr.flags = 1;
+      hdr.len = delta.length();
+      Deliver(so.socket, comms::Packet{hdr, delta});
+      return;
+    }
+
+    if (m_snapshotVersion != m_listVersion)
+      RebuildUserList();
+    hdr.len = m_snapshotLen;
+    DeliverEncoded(so.socket, hdr, m_listSnapshot);
+  }
+
+  // Lock Free
+  // A session token is all a client needs to take a session over, so it is
+  // 128 random bits from the system provider, written out as hex.
+  std::string NewSessionToken() {
+    ++m_sessionCounter;
+    BYTE random[SessionTokenBytes];
+    HCRYPTPROV provider;
+    if (!CryptAcquireContext(&provider, NULL, NULL, PROV_RSA_FULL,
+                             CRYPT_VERIFYCONTEXT | CRYPT_SILENT))
+      return std::string();
+    BOOL filled = CryptGenRandom(provider, sizeof(random), random);
+    CryptReleaseContext(provider, 0);
+    if (!filled)
+      return std::string();
+
+    static const char digits[] = "0123456789abcdef";
+    std::string token;
+    token.reserve(2 * sizeof(random));
+    for (auto b : random) {
+      token.push_back(digits[b >> 4]);
+      token.push_back(digits[b & 0xf]);
+    }
+    return token;
+  }
+
+  // Lock Free
+  // Point the alias index at |so|, forgetting the alias it had before.
+  void IndexAlias(SocketData &so, const std::string &alias) {
+    auto it = m_aliasIndex.find(so.alias);
+    if (it != m_aliasIndex.end() && it->second == so.handle)
+      m_aliasIndex.erase(it);
+
+    bool changed = so.alias != alias;
+    if (changed && !so.alias.empty())
+      NoteMembership(so, false, ++m_listVersion);
+
+    so.alias = alias;
+    if (!alias.empty())
+      m_aliasIndex[alias] = so.handle;
+
+    if (changed && !alias.empty())
+      NoteMembership(so, true, ++m_listVersion);
+  }
+
+  // Lock Free
+  SocketData *FindAlias(const std::string &alias) {
+    auto it = m_aliasIndex.find(alias);
+    if (it == m_aliasIndex.end())
+      return nullptr;
+    return m_clients.Get(it->second);
+  }
+
+  // Lock Free
+  SocketData *FindSocket(SOCKET s) {
+    auto it = m_socketIndex.find(s);
+    if (it == m_socketIndex.end())
+      return nullptr;
+    return m_clients.Get(it->second);
+  }
+
+  // Lock Free
+  // Take |so| out of the client map and both indexes.
+  void EraseClient(SocketData &so) {
+    if (m_reader.IsOpen())
+      m_reader.Forget(so.socket);
+    if (m_pipeline.IsOpen())
+      m_pipeline.Forget(so.socket);
+    while (!so.channels.empty())
+      Unsubscribe(so, so.channels.back());
+
+    auto alias = m_aliasIndex.find(so.alias);
+    if (alias != m_aliasIndex.end() && alias->second == so.handle)
+      m_aliasIndex.erase(alias);
+    m_socketIndex.erase(so.socket);
+    m_capture.Record(capture::KindClose, so.socket);
+    m_clients.Erase(so.handle);
+  }
+
+  // Lock Free
+  // Acknowledge |sequence| in |lane| with the next PKT_ACK or packet to
+  // go out to |so|.
+  void NoteAck(SocketData &so, unsigned int lane, unsigned int sequence) {
+    AckLane &l = so.acks.lanes[lane];
+    int ahead = static_cast<short>(static_cast<unsigned short>(sequence -
+                                                                l.newest));
+    if (l.seen && ahead < 0) {
+      // Older than the newest, the client went back after a reconnect.
+      // Acknowledge what we have before starting the lane over from it.
+      SendAcks(so);
+      l.seen = false;
+    }
+    if (!so.acks.Owed())
+      so.acks.since = GetTickCount();
+
+    if (!l.seen) {
+      l.seen = true;
+      l.newest = sequence;
+      l.bits = 0;
+    } else if (ahead > 0) {
+      l.bits = ahead < 32 ? (l.bits << ahead) | (1u << (ahead - 1))
+                          : ahead == 32 ? 1u << 31 : 0;
+      l.newest = sequence;
+    }
+    l.pending = true;
+  }
+
+  // Lock Free
+  // Acknowledge the packet |ack| answers, in bulk when |so| takes PKT_ACK.
+  void Acknowledge(SocketData &so, unsigned int lane,
+                   const comms::Packet &ack) {
+    if (so.acks.cumulative)
+      NoteAck(so, lane, ack.hdr.sequence);
+    else
+      Deliver(so.socket, ack);
+  }
+
+  // Lock Free
+  // One PKT_ACK for whatever |so| is owed.
+  void SendAcks(SocketData &so) {
+    if (!so.acks.Owed())
+      return;
+    AckLane &chat = so.acks.lanes[comms::AckLaneChat];
+    AckLane &file = so.acks.lanes[comms::AckLaneFile];
+    comms::Packet ack{{PKT_ACK,
+                       (chat.pending ? 1u << comms::AckLaneChat : 0) |
+                           (file.pending ? 1u << comms::AckLaneFile : 0),
+                       chat.bits, file.bits, 0, chat.newest, file.newest},
+                      ""};
+    chat.pending = false;
+    file.pending = false;
+    Deliver(so.socket, ack);
+  }
+
+  // Lock Free
+  // Let |header|, on its way to |so|, carry an ack it is owed. The client
+  // only has the newest packet of a lane in flight, so the few bits of the
+  // bitmap which fit are enough.
+  void Piggyback(SocketData &so, comms::Header &header) {
+    if (!so.acks.cumulative)
+      return;
+    header.flags &= ~comms::AckFlagsMask; // Only we put anything up there.
+    for (unsigned int lane = 0; lane < comms::AckLanes; ++lane) {
+      AckLane &l = so.acks.lanes[lane];
+      if (l.pending) {
+        comms::PiggybackAck(header, lane, l.newest, l.bits);
+        l.pending = false;
+        return;
+      }
+    }
+  }
+
+  // Lock Free
+  // Whether |hdr| is a chat line, private message or file chunk |so| sent
+  // us before, within the last RecentSequenceWindow packets. Peers keep
+  // their own count, see RelayEntry.
+  bool IsRetransmit(const SocketData &so, const comms::Header &hdr) const {
+    if (so.peerNode || (hdr.type != PKT_MSG && hdr.type != PKT_PVT &&
+                        hdr.type != PKT_FILE_OUT))
+      return false;
+    return std::find(so.recentSequences.begin(), so.recentSequences.end(),
+                     hdr.sequence) != so.recentSequences.end();
+  }
+
+  // Lock Free
+  // Ack a packet IsRetransmit caught as the first one was. A private
+  // message only gets here when it was routed, and a miss was already
+  // reported.
+  void AckRetransmit(SocketData &so, const comms::Header &hdr) {
+    unsigned int type = hdr.type == PKT_MSG   ? PKT_MSG_ACK
+                        : hdr.type == PKT_PVT ? PKT_PVT_ACK
+                                              : PKT_FILE_OUT_ACK;
+    comms::Packet ack{{type, hdr.type == PKT_PVT ? 1u : 0u, 0, 0, 0,
+                       hdr.sequence, 0},
+                      ""};
+    Acknowledge(so, hdr.type == PKT_FILE_OUT ? comms::AckLaneFile
+                                             : comms::AckLaneChat,
+                ack);
+    m_retransmitsTotal.Increment();
+  }
+
+  // Lock Free
+  void RememberSequence(SocketData &so, unsigned int sequence) {
+    so.recentSequences.push_back(sequence);
+    if (so.recentSequences.size() > RecentSequenceWindow)
+      so.recentSequences.erase(so.recentSequences.begin());
+  }
+
+  // Lock Free
+  // Attach the session named by |token| to |so|. The processed sequences are
+  // written to |sequences| so the client only replays what we never saw.
+  bool ResumeSession(SocketData &so, const std::string &token,
+                     std::string &sequences) {
+    auto it = m_sessions.find(token);
+    if (it == m_sessions.end())
+      return false;
+
+    SessionData &session = it->second;
+    if (!session.parked) {
+      // We have not noticed the old socket dying yet, take over from it
+      // quietly so nobody sees a leave message.
+      for (auto &old : m_clients) {
+        if (&old != &so && old.session == token) {
+          session.recentSequences = old.recentSequences;
+          session.channels = old.channels;
+          session.activeChannel = old.activeChannel;
+          session.pending.clear();
+          old.outboundMessages.DrainTo(session.pending);
+          IndexAlias(old, "");
+          old.session.clear();
+          MarkSocketClosed(old.socket);
+          break;
+        }
       }
     }
+
+    IndexAlias(so, session.alias);
+    so.session = token;
+    so.recentSequences = session.recentSequences;
+    for (auto c : session.channels) {
+      if (m_channels.find(c) != m_channels.end() || c == LobbyChannel)
+        Subscribe(so, c);
+    }
+    if (std::find(so.channels.begin(), so.channels.end(),
+                  session.activeChannel) != so.channels.end())
+      so.activeChannel = session.activeChannel;
+    for (auto p = session.pending.rbegin(); p != session.pending.rend(); ++p)
+      so.outboundMessages.push_front(*p);
+    session.pending.clear();
+    session.parked = false;
+
+    for (auto seq : so.recentSequences) {
+      sequences.append(std::to_string(seq));
+      sequences.append("|");
+    }
+    return true;
+  }
+
+public:
+  // Lock Free:
+
+  // Get the socket on which we are accepting connections.
+  SOCKET GetAcceptSocket() const { return m_acceptSocket; }
+
+  // Get the socket other workers link to us on, INVALID_SOCKET if none.
+  SOCKET GetBusSocket() const { return m_busSocket; }
+
+  // Get a reference to the server mutex.
+  CRITICAL_SECTION &GetMutex() { return m_mutex; }
+
+  // Get a reference to the server client map.
+  ClientMap &GetClients() { return m_clients; }
+
+  // Auto Locking:
+
+  // Push a new connection to our list of clients.
+  void PushConnection(SOCKET client, const std::string &ip) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    InsertClient(client, ip);
+    if (m_pipeline.IsOpen()) {
+      std::vector<char> none;
+      m_pipeline.Watch(client, none);
+    }
+  }
+
+  void DropConnection(SOCKET client) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+
+    SocketData *so = FindSocket(client);
+    if (!so)
+      return;
+
+    LOG_INFO("Dropping connection from: %s", so->ip);
+    LOG_DEBUG("Goodbye: %s", so->alias);
+    if (!so->alias.empty())
+      NoteMembership(*so, false, ++m_listVersion);
+    EraseClient(*so);
   }
 
   void GetConnections(std::vector<SocketData> &clients) {
-    AutoLocker locker(m_mutex);
-    clients = m_clients;
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    clients.assign(m_clients.begin(), m_clients.end());
   }
 
   void SetAlias(SOCKET s, std::string &alias) {
-    AutoLocker locker(m_mutex);
+    AutoLocker locker(m_mutex, __FUNCTION__);
 
-    for (auto &i : m_clients) {
-      if (s == i.socket) {
-        i.alias = alias;
-        break;
+    SocketData *so = FindSocket(s);
+    if (so)
+      IndexAlias(*so, alias);
+  }
+
+  // Lock Free
+  // Remove every client whose socket was marked closed since the last call.
+  // The whole batch shares one user list version.
+  void HandleClosedSockets() {
+    if (m_handingOff)
+      return;
+    std::vector<SOCKET> closed;
+    TakeClosedSockets(closed);
+
+    std::vector<SocketData> dropped;
+    for (auto c : closed) {
+      SocketData *so = FindSocket(c);
+      if (!so)
+        continue;
+
+      // Parked first, so its channels stay open while it is away.
+      ParkSession(*so);
+      dropped.push_back(*so);
+      EraseClient(*so);
+      // A pipeline closes it once the stages have let it go.
+      if (!m_pipeline.IsOpen())
+        ::closesocket(c);
+    }
+
+    if (dropped.empty())
+      return;
+
+    ++m_listVersion;
+    for (auto &d : dropped) {
+      if (!d.alias.empty())
+        NoteMembership(d, false, m_listVersion);
+      if (d.peerNode) {
+        std::cout << "Lost peer node [" << d.peerNode << "]" << std::endl;
+        DropPeerRoutes(d.handle);
+      }
+    }
+  }
+
+  // Lock Free
+  // Keep the session of a dropped client around for a while in case it
+  // comes back. Clients which never joined just disappear.
+  void ParkSession(SocketData &so) {
+    auto it = m_sessions.find(so.session);
+    if (so.session.empty() || it == m_sessions.end())
+      return;
+
+    LOG_INFO("Parking session for: %s", so.alias);
+    it->second.parked = true;
+    it->second.droppedAt = GetTickCount();
+    it->second.recentSequences = so.recentSequences;
+    it->second.channels = so.channels;
+    it->second.activeChannel = so.activeChannel;
+    it->second.pending.clear();
+    so.outboundMessages.DrainTo(it->second.pending);
+  }
+
+  // Tell the room about parked sessions whose grace period ran out.
+  void ExpireSessions() {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    DWORD now = GetTickCount();
+    std::string aliases;
+    std::vector<unsigned int> channels;
+    unsigned int leaving = 0;
+    for (auto it = m_sessions.begin(); it != m_sessions.end();) {
+      if (it->second.parked && now - it->second.droppedAt > SessionGraceMillis) {
+        if (leaving++)
+          aliases.append(", ");
+        aliases.append(it->second.alias);
+        channels.insert(channels.end(), it->second.channels.begin(),
+                        it->second.channels.end());
+        it = m_sessions.erase(it);
+      } else {
+        ++it;
       }
     }
+    // Channels only the expired sessions were holding open go too.
+    for (auto c : channels)
+      CloseIfIdle(c);
+
+    if (!leaving)
+      return;
+
+    // Everyone who left this round goes out in one message, so a burst of
+    // drops costs one packet per client rather than one per drop.
+    aliases.append(leaving == 1 ? "|_+_| - has taken the blue pill."
+                                : "|_+_| - have taken the blue pill.");
+    comms::PacketInfo bye{
+        {{PKT_MSG_LEAVE, 0, 0, 0, aliases.length(), 0, 0}, aliases}, false, 0};
+    LogMessage(LobbyChannel, bye);
+    for (auto &i : m_clients) {
+      if (!i.peerNode)
+        Enqueue(i, bye);
+    }
+    RelayBroadcast(LobbyChannel, bye);
+  }
+
+  // Append |info| to |out| under |key|, leaving |info| with an empty payload.
+  template <typename Key>
+  static void PushSwapped(std::vector<std::pair<Key, comms::PacketInfo>> &out,
+                          Key key, comms::PacketInfo &info) {
+    out.push_back(std::make_pair(key, comms::PacketInfo()));
+    comms::SwapInto(out.back().second, info);
   }
 
   void ProcessMessages() {
-    // These get pushed to the main queue of each socket.
-    comms::packetQueue globalMessages;
-    comms::packetQueue privateMessages;
-    AutoLocker locker(m_mutex);
+    // These get pushed to the main queue of each subscriber, by channel.
+    std::vector<std::pair<unsigned int, comms::PacketInfo>> channelMessages;
+    std::vector<std::pair<SocketData *, comms::PacketInfo>> privateMessages;
+    std::unordered_map<const SocketData *, RoutedFiles> routedFiles;
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    if (m_handingOff)
+      return;
+    DWORD now = GetTickCount();
 
     for (auto &so : m_clients) {
       // Deal with each message and push the appropriate response to the client.
       // We deal with all messages by pushing them to the correct outbound
       // queues.
-      for (auto msg : so.inboundMessages) {
+      // Packets of a class which has to wait keep their order at the front,
+      // the rest of the client's packets go on without them.
+      bool held[PacketClasses] = {};
+      size_t kept = 0;
+      size_t processed = 0;
+      for (; processed < so.inboundMessages.size(); ++processed) {
+        // Handled in place, payloads the packet passes on are swapped out
+        // of it rather than copied.
+        comms::PacketInfo &msg = so.inboundMessages[processed];
+        LONGLONG started = msg.traceKey ? trace::Tracer::Now() : 0;
+        if (IsRetransmit(so, msg.packet.hdr)) {
+          // Our ack was slow, not the routing. Ack it again and route
+          // nothing, or the room would get it twice. It costs no tokens.
+          AckRetransmit(so, msg.packet.hdr);
+          continue;
+        }
+        // Control packets change what the packets around them mean, so they
+        // wait behind anything held and hold everything behind them. Chat
+        // and file chunks only wait behind their own class.
+        PacketClass cls = ClassOf(msg.packet.hdr.type);
+        bool wait = held[cls] || held[ClassControl] ||
+                    (cls == ClassControl && kept > 0);
+        // A file chunk waits while someone it goes to is too far behind.
+        if (!wait && msg.packet.hdr.type == PKT_FILE_OUT)
+          wait = !RoomForFile(so, msg.packet, routedFiles);
+        // Rate limit before doing any work for the packet, peers are
+        // trusted to have limited their own clients.
+        if (!wait && !so.peerNode &&
+            !so.buckets[cls].Take(m_rateLimits[cls], now)) {
+          // Count a held packet once, however many ticks it waits.
+          if (msg.skips++ == 0) {
+            ++so.throttled[cls];
+            m_throttledTotal[cls].Increment();
+          }
+          wait = true;
+        }
+        if (wait) {
+          held[cls] = true;
+          // The oldest keep their place, the newest arrivals past the limit
+          // are dropped without an ack or a sequence.
+          if (kept >= MaxThrottledPackets) {
+            ++so.rejected[cls];
+            m_rejectedTotal[cls].Increment();
+            continue;
+          }
+          if (kept != processed)
+            comms::SwapInto(so.inboundMessages[kept], msg);
+          ++kept;
+          continue;
+        }
+
         switch (msg.packet.hdr.type) {
         case PKT_ALIAS: {
-          so.alias = msg.packet.data;
+          so.acks.cumulative =
+              (msg.packet.hdr.flags & comms::AckCumulative) != 0;
+          IndexAlias(so, msg.packet.data);
+          if (so.channels.empty())
+            Subscribe(so, LobbyChannel);
+          if (so.session.empty()) {
+            // Without a token the client still chats, it just cannot resume.
+            so.session = NewSessionToken();
+            SessionData session{so.alias, {}, {}, LobbyChannel, {}, false, 0};
+            if (!so.session.empty())
+              m_sessions[so.session] = session;
+
+            // The client tells us the last log sequence it saw in hdr.id,
+            // and optionally how many messages it wants in hdr.parts.
+            SendBacklog(so, msg.packet.hdr.id,
+                        msg.packet.hdr.parts ? msg.packet.hdr.parts
+                                             : BacklogMessages);
+          } else {
+            m_sessions[so.session].alias = so.alias;
+          }
           std::string data = msg.packet.data;
-#ifdef DEBUG_MODE
-          std::cout << "NB. " << data << std::endl;
-#endif
+          LOG_DEBUG("NB. %s", data);
 #ifdef USE_FLATE
           // Compress the response.
           flate::FlateResult compressed(data.c_str(), data.length(),
@@ -647,136 +3322,1302 @@ public:
           comms::PacketInfo info{
               {{PKT_MSG_JOIN, 0, 0, 0, data.length(), 1, 0}, data}, false, 0};
 #endif
-          // Store the messages for global delivery.
-          globalMessages.push_back(info);
-
-          // Immediately ack.
-          comms::Packet ack{
-              {PKT_ALIAS_ACK, 0, 0, 0, 0, msg.packet.hdr.sequence, 0}, ""};
-          SendPacket(so.socket, ack);
+          // Store the messages for delivery to the lobby.
+          PushSwapped(channelMessages, LobbyChannel, info);
+
+          // Immediately ack, handing out the session token.
+          comms::Packet ack{{PKT_ALIAS_ACK, 0, 0, 0, so.session.length(),
+                             msg.packet.hdr.sequence, 0},
+                            so.session};
+          Deliver(so.socket, ack);
+        } break;
+        case PKT_RESUME: {
+          so.acks.cumulative =
+              (msg.packet.hdr.flags & comms::AckCumulative) != 0;
+          // No join broadcast, as far as the room knows they never left.
+          std::string sequences;
+          unsigned int resumed =
+              ResumeSession(so, msg.packet.data, sequences) ? 1 : 0;
+          comms::Packet ack{{PKT_RESUME_ACK, resumed, 0, 0, sequences.length(),
+                             msg.packet.hdr.sequence, 0},
+                            sequences};
+          Deliver(so.socket, ack);
         } break;
         case PKT_QRY: {
           // Immediately ack.
           comms::Packet ack{
               {PKT_QRY_ACK, 0, 0, 0, 0, msg.packet.hdr.sequence, 0}, ""};
-          SendPacket(so.socket, ack);
+          Acknowledge(so, comms::AckLaneChat, ack);
         } break;
         case PKT_MSG: {
-          // Store the message for global delivery.
-          globalMessages.push_back(msg);
+          // Store the message for delivery to the sender's channel, tagged
+          // so receivers can tell channels apart.
+          comms::PacketInfo info{{msg.packet.hdr, ""}, false, 0, msg.stamp,
+                                 msg.traceKey};
+          info.packet.data.swap(msg.packet.data);
+          info.packet.hdr.id = so.activeChannel;
+          if (so.activeChannel != NoChannel)
+            PushSwapped(channelMessages, so.activeChannel, info);
           // Immediately ack.
           comms::Packet ack{
               {PKT_MSG_ACK, 0, 0, 0, 0, msg.packet.hdr.sequence, 0}, ""};
-          SendPacket(so.socket, ack);
-
+          Acknowledge(so, comms::AckLaneChat, ack);
+
+          if (started) {
+            // Waiting for the tick, then handling the line.
+            trace::tracer.Record("server.wait", msg.traceKey, msg.stamp,
+                                 started, trace::FlowStep);
+            trace::tracer.Record("server.parse", msg.traceKey, started,
+                                 trace::Tracer::Now(), trace::FlowStep);
+          }
         } break;
         case PKT_PVT: {
-          // Immediately ack.
-          comms::Packet ack{
-              {PKT_PVT_ACK, 0, 0, 0, 0, msg.packet.hdr.sequence, 0}, ""};
-          SendPacket(so.socket, ack);
-
-          // Store the message for private delivery.
-          privateMessages.push_back(msg);
+          // The client sends "user|text", the recipient sees it from us.
+          std::string::size_type pos = msg.packet.data.find('|');
+          std::string alias = pos == std::string::npos
+                                  ? std::string()
+                                  : std::string(msg.packet.data.substr(0, pos));
+          SocketData *target = alias.empty() ? nullptr : FindAlias(alias);
+
+          // Store the message for private delivery, or send it on to the
+          // node the user is on.
+          std::string data(so.alias);
+          data.append("|_+_|");
+          if (pos != std::string::npos)
+            data.append(msg.packet.data.substr(pos + 1));
+          comms::PacketInfo info{
+              {{PKT_PVT, 0, 0, 0, data.length(), 0, 0}, data}, false, 0,
+              msg.stamp};
+          bool delivered = true;
+          if (target)
+            PushSwapped(privateMessages, target, info);
+          else
+            delivered = !alias.empty() && RelayPrivate(alias, info);
+
+          // Immediately ack, flags tell the sender if anyone got it. Only
+          // a miss needs saying to a client which takes PKT_ACK.
+          comms::Packet ack{{PKT_PVT_ACK, delivered ? 1 : 0, 0, 0, 0,
+                             msg.packet.hdr.sequence, 0},
+                            ""};
+          if (delivered)
+            Acknowledge(so, comms::AckLaneChat, ack);
+          else
+            Deliver(so.socket, ack);
+        } break;
+        case PKT_CHAN_JOIN: {
+          unsigned int id = ChannelId(msg.packet.data);
+          Subscribe(so, id);
+          comms::Packet ack{{PKT_CHAN_JOIN_ACK, 0, 0, 0,
+                             msg.packet.data.length(), msg.packet.hdr.sequence,
+                             id},
+                            msg.packet.data};
+          Deliver(so.socket, ack);
+        } break;
+        case PKT_CHAN_LEAVE: {
+          auto it = m_channelIds.find(msg.packet.data);
+          unsigned int id = it == m_channelIds.end() ? NoChannel : it->second;
+          Unsubscribe(so, id);
+          // Someone who left their last channel talks in the lobby again,
+          // or their chat and files would be acked and go nowhere.
+          if (so.channels.empty() && !so.alias.empty())
+            Subscribe(so, LobbyChannel);
+          comms::Packet ack{{PKT_CHAN_LEAVE_ACK, 0, 0, 0,
+                             msg.packet.data.length(), msg.packet.hdr.sequence,
+                             id},
+                            msg.packet.data};
+          Deliver(so.socket, ack);
         } break;
         case PKT_LST: {
-          std::string user_list("Users on this server:|");
-          {
-            auto lst_it = m_clients.begin();
-            auto lst_eit = m_clients.end();
-            for (; lst_it != lst_eit; ++lst_it) {
-              user_list.append(lst_it->ip);
-              user_list.append(" : ");
-              user_list.append(lst_it->alias);
-              user_list.append("|_+_|");
-            }
-            comms::Packet ack{{PKT_LST_ACK, 0, 0, 0, user_list.length(),
-                               msg.packet.hdr.sequence, 0},
-                              user_list};
-            // Immediately ack.
-            SendPacket(so.socket, ack);
-          }
+          // Immediately ack.
+          SendUserList(so, msg.packet);
+        } break;
+        case PKT_PEER_HELLO: {
+          HandlePeerHello(so, msg.packet);
+        } break;
+        case PKT_RELAY: {
+          if (so.peerNode)
+            HandleRelay(so, msg.packet);
         } break;
         case PKT_FILE_OUT: {
           comms::Packet ack{
               {PKT_FILE_OUT_ACK, 0, 0, 0, 0, msg.packet.hdr.sequence, 0}, ""};
-          SendPacket(so.socket, ack);
-          std::cout << "Sending back file in ack[" << msg.packet.hdr.sequence
-                    << "]" << std::endl;
+          LOG_INFO("Sending back file in ack[%u]", msg.packet.hdr.sequence);
+
+          // This is one of the only messages which are mutated before being
+          // sent back.
+          comms::PacketInfo info{{msg.packet.hdr, ""}, false, 0, msg.stamp};
+          info.packet.hdr.type = PKT_FILE_IN;
+
+          // Targeted files name their user in the first part as
+          // "name|user", the chunks after it only carry the file id.
+          auto target = so.fileTargets.find(msg.packet.hdr.id);
+          if (msg.packet.hdr.current == 0 && msg.packet.hdr.flags == 1) {
+            std::string::size_type pos = msg.packet.data.find_last_of('|');
+            if (pos != std::string::npos)
+              target = so.fileTargets.insert(
+                  so.fileTargets.end(),
+                  std::make_pair(msg.packet.hdr.id,
+                                 msg.packet.data.substr(pos + 1)));
+          }
+          info.packet.data.swap(msg.packet.data);
+
+          if (target == so.fileTargets.end()) {
+            Acknowledge(so, comms::AckLaneFile, ack);
+            if (so.activeChannel != NoChannel)
+              PushSwapped(channelMessages, so.activeChannel, info);
+            break;
+          }
+
+          // Like PKT_PVT_ACK, a chunk nobody can take is acked with the
+          // file's id so the sender stops sending the rest of it.
+          SocketData *recipient = FindAlias(target->second);
+          bool delivered = true;
+          if (recipient)
+            PushSwapped(privateMessages, recipient, info);
+          else
+            delivered = RelayPrivate(target->second, info);
+          if (delivered) {
+            Acknowledge(so, comms::AckLaneFile, ack);
+          } else {
+            ack.hdr.flags = comms::FileTargetGone;
+            ack.hdr.id = msg.packet.hdr.id;
+            Deliver(so.socket, ack);
+          }
+          if (msg.packet.hdr.current == msg.packet.hdr.parts || !delivered)
+            so.fileTargets.erase(target);
+        } break;
+        }
+        RememberSequence(so, msg.packet.hdr.sequence);
+      }
+      so.inboundMessages.erase(so.inboundMessages.begin() + kept,
+                               so.inboundMessages.begin() + processed);
+    }
+
+    // Push all the channel/private messages to the correct clients, and
+    // the channel messages on to the other nodes.
+    for (auto &msg : channelMessages) {
+      unsigned long long sender = msg.second.traceKey;
+      LONGLONG routed = sender ? trace::Tracer::Now() : 0;
+      RelayBroadcast(msg.first, msg.second);
+      FanOut(msg.first, msg.second);
+      if (sender) {
+        // The sender's flow ends here and the log sequence's begins.
+        LONGLONG now = trace::Tracer::Now();
+        trace::tracer.Record("server.route", sender, routed, now,
+                             trace::FlowEnd);
+        trace::tracer.Record("server.route", msg.second.traceKey, routed, now,
+                             trace::FlowStart);
+      }
+    }
+
+    for (auto &msg : privateMessages) {
+      Enqueue(*msg.first, msg.second);
+    }
+
+    for (auto &c : m_clients) {
+      if (c.peerNode)
+        FlushRelay(c);
+    }
+  }
+
+  void SendMessages() {
+    // For each client we send only 1 message at a time, we don't wait for an
+    // ack, but we do wait for the client to be able to process the message
+    // before we send the next one.
+    // Slowly but surely the queue will empty out.
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    if (m_handingOff)
+      return;
+    for (auto &client : m_clients) {
+      if (m_pipeline.IsOpen()) {
+        // Its writer sends it, the latency runs to the hand over. While the
+        // writer has a tail the queue backs up here instead, where the slow
+        // consumer policy sees it.
+        if (client.outboundMessages.empty() || client.writerTail)
+          continue;
+        StageItem item(client.socket, StageSend);
+        comms::SwapInto(item.info, client.outboundMessages.front());
+        Piggyback(client, item.info.packet.hdr);
+        ++m_ioStats.packetsOut;
+        if (item.info.stamp)
+          RecordLatency(item.info.stamp);
+        client.outboundMessages.pop_front();
+        if (!m_pipeline.Send(item))
+          MarkSocketClosed(client.socket);
+      } else if (!client.outboundMessages.empty() &&
+                 (client.outBatch.size() * sizeof(unsigned int) -
+                  client.outBatchSent) < FlushBytes) {
+        // Batch the message for the client and erase it from the queue. A
+        // client whose socket is not taking its batch waits, and its queue
+        // backs up for the slow consumer policy to see.
+        const comms::PacketInfo &info = client.outboundMessages.front();
+        LONGLONG start =
+            info.queued && trace::tracer.On() ? trace::Tracer::Now() : 0;
+        comms::Header hdr(info.packet.hdr);
+        Piggyback(client, hdr);
+        size_t from = client.outBatch.size();
+        comms::EncodeHeader(hdr, client.outBatch);
+        comms::EncodePayload(info.packet.data, hdr.len, client.outBatch);
+        Batched(client, from);
+        ++m_ioStats.packetsOut;
+        if (info.stamp)
+          RecordLatency(info.stamp);
+        if (start)
+          trace::tracer.Record("server.queue", info.traceKey, info.queued,
+                               start, trace::FlowStep);
+        client.outboundMessages.pop_front();
+      }
+    }
+  }
+
+  // Auto Locking
+  // End a round by writing out the batches and acks which are due. When
+  // pipelined the writers batch, we only hand them the acks.
+  void FlushWrites() {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    if (m_handingOff)
+      return;
+    if (!m_pipeline.IsOpen()) {
+      FlushBatches(false);
+      return;
+    }
+    DWORD now = GetTickCount();
+    for (auto &so : m_clients) {
+      if (so.acks.Owed() && now - so.acks.since >= m_flushDeadline)
+        SendAcks(so);
+    }
+  }
+
+  // Auto Locking
+  // Peers, workers on the bus included, must say hello with |secret|. With
+  // none only the peers we dial ourselves are linked.
+  void SetPeerSecret(const std::string &secret) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    m_peerSecret = secret;
+  }
+
+  // Auto Locking
+  // Let batches smaller than FlushBytes wait up to |millis| for more to
+  // join them. Rounds are 10 ms apart, 0 writes every round.
+  void SetFlushDeadline(DWORD millis) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    m_flushDeadline = millis;
+  }
+
+  // Lock Free
+  // Write the batches which are big or old enough, or all of them. Acks
+  // owed join the batch as it goes, or go on their own once they are as
+  // old as a batch may be.
+  void FlushBatches(bool all) {
+    DWORD now = GetTickCount();
+    for (auto &so : m_clients) {
+      bool owed = so.acks.Owed();
+      if (so.outBatch.empty() && !owed)
+        continue;
+      if (!all &&
+          so.outBatch.size() * sizeof(unsigned int) - so.outBatchSent <
+              FlushBytes &&
+          (so.outBatch.empty() || now - so.outBatchSince < m_flushDeadline) &&
+          (!owed || now - so.acks.since < m_flushDeadline))
+        continue;
+      SendAcks(so);
+      WriteBatch(so);
+    }
+  }
+
+  // Lock Free
+  // One send for everything batched for |so|. A full socket keeps the rest
+  // for next time, anything else closes it.
+  void WriteBatch(SocketData &so) {
+    const char *data =
+        reinterpret_cast<const char *>(&so.outBatch[0]) + so.outBatchSent;
+    int length = static_cast<int>(so.outBatch.size() * sizeof(unsigned int) -
+                                  so.outBatchSent);
+    int bytes = send(so.socket, data, length, 0);
+    ++m_sendCalls;
+    if (bytes == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+      return;
+    if (bytes <= 0) {
+      MarkSocketClosed(so.socket);
+      bytes = length;
+    } else {
+      m_capture.Record(capture::KindOut, so.socket, data, bytes);
+    }
+
+    so.outBatchSent += bytes;
+    if (so.outBatchSent == so.outBatch.size() * sizeof(unsigned int)) {
+      so.outBatch.clear();
+      so.outBatchSent = 0;
+    }
+  }
+
+  // Lock Free
+  // Write out every batch before the pipeline takes over or lets go of the
+  // sockets. Clients which will not take theirs are dropped, anything sent
+  // after would overtake it.
+  void DrainBatches() {
+    DWORD start = GetTickCount();
+    for (;;) {
+      FlushBatches(true);
+      bool waiting = false;
+      for (auto &so : m_clients)
+        waiting = waiting || !so.outBatch.empty();
+      if (!waiting)
+        return;
+      if (GetTickCount() - start >= DrainBatchMillis)
+        break;
+      Sleep(1);
+    }
+    for (auto &so : m_clients) {
+      if (so.outBatch.empty())
+        continue;
+      MarkSocketClosed(so.socket);
+      so.outBatch.clear();
+      so.outBatchSent = 0;
+    }
+  }
+
+  // Lock Free
+  // Take what the pipeline's readers and writers have for us, call with the
+  // lock held.
+  void RouteInbound() {
+    m_pipeline.Retry();
+    for (;;) {
+      // A fresh item each time, what goes back into the queue is empty.
+      StageItem item;
+      if (!m_pipeline.Take(item))
+        break;
+      SocketData *so = FindSocket(item.socket);
+      switch (item.kind) {
+      case StagePackets:
+        if (so) {
+          size_t before = so->inboundMessages.size();
+          if (before == 0)
+            so->inboundMessages.swap(item.packets);
+          else
+            so->inboundMessages.insert(so->inboundMessages.end(),
+                                       item.packets.begin(),
+                                       item.packets.end());
+          NoteInbound(*so, before, item.read);
+        }
+        break;
+      case StageClosed:
+        if (so)
+          MarkSocketClosed(item.socket);
+        break;
+      case StagePartial:
+        if (so)
+          so->packetData.insert(so->packetData.end(), item.bytes.begin(),
+                                item.bytes.end());
+        break;
+      case StageReleased:
+        // Whatever the stages sent us about it came before this.
+        ::closesocket(item.socket);
+        break;
+      case StageTail:
+      case StageCaughtUp:
+        if (so)
+          so->writerTail = item.kind == StageTail;
+        break;
+      }
+    }
+  }
+
+  // Lock Free
+  // Read whatever arrived on the client sockets, call with the lock held.
+  void ReadClients(char *stack) {
+    if (m_handingOff)
+      return; // The new process reads them from here on.
+    if (m_pipeline.IsOpen()) {
+      RouteInbound();
+      return;
+    }
+    if (m_reader.IsOpen()) {
+      // A few passes at most, the rest waits for the next round rather
+      // than holding up routing while clients keep sending.
+      unsigned long taken;
+      unsigned int passes = 0;
+      do {
+        ++m_ioStats.recvCalls;
+        taken = m_reader.Poll(
+            ReadBatch, [this](SOCKET s, const char *data, DWORD bytes) {
+              SocketData *so = FindSocket(s);
+              if (!so)
+                return;
+              if (bytes == 0) {
+                MarkSocketClosed(s);
+              } else {
+                so->packetData.insert(so->packetData.end(), data, data + bytes);
+                m_capture.Record(capture::KindIn, s, data, bytes);
+              }
+            });
+      } while (taken == ReadBatch && ++passes < MaxReadPasses);
+    } else {
+      for (auto &i : m_clients) {
+        size_t before = i.packetData.size();
+        if (!comms::ReadSocketFully(i.socket, stack, i.packetData,
+                                    &m_ioStats.recvCalls))
+          MarkSocketClosed(i.socket);
+        if (i.packetData.size() > before)
+          m_capture.Record(capture::KindIn, i.socket, &i.packetData[before],
+                           i.packetData.size() - before);
+      }
+    }
+
+    for (auto &i : m_clients) {
+      QueueInbound(i);
+    }
+  }
+
+  // Auto Locking
+  // Read through a completion port from now on, staying with polling when
+  // one can not be had. Returns the backend in use.
+  IoBackend UseCompletionPort() {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    if (m_reader.IsOpen())
+      return IoCompletion;
+    if (m_pipeline.IsOpen())
+      return IoPipeline;
+    if (!m_reader.Open()) {
+      std::cout << "No completion port, polling sockets." << std::endl;
+      return IoPoll;
+    }
+
+    for (auto &c : m_clients) {
+      if (!m_reader.Watch(c.socket))
+        MarkSocketClosed(c.socket);
+    }
+    m_ioStats.backend = IoCompletion;
+    return IoCompletion;
+  }
+
+  // Auto Locking
+  // Run as a pipeline of |readers| and |writers| threads from now on, see
+  // Pipeline. It replaces polling, and a completion port replaces it.
+  bool UsePipeline(unsigned int readers, unsigned int writers) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    if (m_pipeline.IsOpen())
+      return true;
+    if (m_reader.IsOpen() || !StartPipeline(readers, writers)) {
+      std::cout << "No pipeline, reading on the comms thread." << std::endl;
+      return false;
+    }
+    std::cout << "Pipeline of " << readers << " readers and " << writers
+              << " writers." << std::endl;
+    return true;
+  }
+
+  // Lock Free
+  // Start the stage threads and hand the readers the clients we have.
+  bool StartPipeline(unsigned int readers, unsigned int writers) {
+    DrainBatches();
+    if (!m_pipeline.Open(this, readers, writers))
+      return false;
+    for (auto &c : m_clients)
+      m_pipeline.Watch(c.socket, c.packetData);
+    m_ioStats.backend = IoPipeline;
+    return true;
+  }
+
+  // Lock Free
+  // Let the writers finish and the readers hand back what they hold, then
+  // carry on polling. Call with the lock held.
+  void StopPipeline() {
+    // The stages are still taking items, so anything held gets through.
+    while (m_pipeline.Holding()) {
+      RouteInbound();
+      Sleep(1);
+    }
+    m_pipeline.Stop();
+    while (!m_pipeline.Stopped()) {
+      RouteInbound();
+      Sleep(1);
+    }
+    RouteInbound();
+    m_pipeline.Close();
+    for (auto &c : m_clients)
+      c.writerTail = false;
+    m_ioStats.backend = IoPoll;
+  }
+
+  // Lock Free
+  // A reader stage, run on its own thread. It cuts the input of its sockets
+  // into packets for the router, and never waits on another stage.
+  void RunReader(Stage &stage) {
+    struct Input {
+      std::vector<char> data;
+      bool closed;
+    };
+    std::unordered_map<SOCKET, Input> sockets;
+    std::deque<StageItem> waiting; // For the router, in order.
+    char stack[comms::TransferSize];
+
+    for (;;) {
+      // Writers pass on what the router let go, so they finish first.
+      bool last = m_pipeline.Stopping() && m_pipeline.WritersDone();
+      bool busy = false;
+      for (;;) {
+        StageItem command;
+        if (!stage.queue.Pop(command))
+          break;
+        busy = true;
+        if (command.kind == StageWatch) {
+          Input &in = sockets[command.socket];
+          in.data.swap(command.bytes);
+          in.closed = false;
+        } else if (command.kind == StageForget) {
+          // The router drops what is still waiting for it, and only then
+          // hears the socket is free.
+          sockets.erase(command.socket);
+          waiting.push_back(StageItem(command.socket, StageReleased));
+        }
+      }
+
+      if (!m_pipeline.Stopping() && waiting.size() < ReaderBacklog) {
+        for (auto &entry : sockets) {
+          Input &in = entry.second;
+          if (in.closed)
+            continue;
+
+          size_t before = in.data.size();
+          LONGLONG read = trace::tracer.On() ? trace::Tracer::Now() : 0;
+          bool open = comms::ReadSocketFully(entry.first, stack, in.data,
+                                             &stage.calls);
+          if (in.data.size() > before) {
+            busy = true;
+            m_capture.Record(capture::KindIn, entry.first, &in.data[before],
+                             in.data.size() - before);
+            StageItem batch(entry.first, StagePackets);
+            comms::QueueCompletePackets(in.data, batch.packets);
+            if (!batch.packets.empty()) {
+              StampPackets(batch.packets, 0);
+              batch.read = read;
+              waiting.push_back(StageItem());
+              swap(waiting.back(), batch);
+            }
+          }
+          if (!open) {
+            in.closed = true;
+            waiting.push_back(StageItem(entry.first, StageClosed));
+          }
+        }
+      }
+
+      if (last) {
+        // Hand back the starts of packets, for a handoff to pass on.
+        for (auto &entry : sockets) {
+          if (entry.second.data.empty())
+            continue;
+          waiting.push_back(StageItem(entry.first, StagePartial));
+          waiting.back().bytes.swap(entry.second.data);
+        }
+        sockets.clear();
+      }
+
+      while (!waiting.empty() && m_pipeline.Route(waiting.front()))
+        waiting.pop_front();
+      if (last && waiting.empty())
+        break;
+      if (!busy)
+        Sleep(1);
+    }
+    m_pipeline.Exited(false);
+  }
+
+  // Lock Free
+  // A writer stage, run on its own thread. It sends what the router hands
+  // it, one write per socket for all it was handed in a pass, and never
+  // waits on another stage.
+  void RunWriter(Stage &stage) {
+    std::vector<SOCKET> failed; // Skipped until the router lets them go.
+    std::deque<StageItem> outbox; // Forget for readers, the rest the router.
+    std::unordered_map<SOCKET, StageBatch> batches;
+    auto write = [&](SOCKET s, StageBatch &batch) {
+      if (!SendBatch(stage, s, batch)) {
+        failed.push_back(s);
+        outbox.push_back(StageItem(s, StageClosed));
+        return;
+      }
+      // The router holds the client's messages while there is a tail.
+      bool tail = !batch.frame.empty();
+      if (tail != batch.tail) {
+        batch.tail = tail;
+        outbox.push_back(StageItem(s, tail ? StageTail : StageCaughtUp));
+      }
+    };
+
+    DWORD stoppedAt = 0;
+    for (;;) {
+      bool last = m_pipeline.Stopping();
+      if (last && !stoppedAt)
+        stoppedAt = GetTickCount();
+      bool busy = false;
+      for (;;) {
+        StageItem item;
+        if (!stage.queue.Pop(item))
+          break;
+        busy = true;
+        if (item.kind == StageForget) {
+          // What the router sent before letting go still goes out.
+          auto it = batches.find(item.socket);
+          if (it != batches.end()) {
+            if (!it->second.frame.empty())
+              SendBatch(stage, item.socket, it->second);
+            batches.erase(it);
+          }
+          failed.erase(std::remove(failed.begin(), failed.end(), item.socket),
+                       failed.end());
+          outbox.push_back(StageItem());
+          swap(outbox.back(), item);
+        } else if (std::find(failed.begin(), failed.end(), item.socket) ==
+                   failed.end()) {
+          StageBatch &batch = batches[item.socket];
+          BatchItem(item, batch);
+          if (batch.frame.size() * sizeof(unsigned int) >= FlushBytes)
+            write(item.socket, batch);
+        }
+      }
+
+      // Small batches may wait for the flush deadline, unless we are done.
+      DWORD now = GetTickCount();
+      for (auto &entry : batches) {
+        StageBatch &batch = entry.second;
+        if (!batch.frame.empty() &&
+            (last || now - batch.since >= m_flushDeadline))
+          write(entry.first, batch);
+      }
+
+      // In order, so the router hears of a failure before the release.
+      while (!outbox.empty()) {
+        StageItem &next = outbox.front();
+        if (next.kind != StageForget ? !m_pipeline.Route(next)
+                                     : !m_pipeline.ReaderFor(next.socket)
+                                            .queue.Push(next))
+          break;
+        outbox.pop_front();
+      }
+      if (last && outbox.empty()) {
+        bool pending = false;
+        for (auto &entry : batches)
+          pending = pending || !entry.second.frame.empty();
+        if (!pending)
+          break;
+        // As DrainBatches, clients which will not take the rest in time are
+        // dropped rather than left half way through a frame.
+        if (GetTickCount() - stoppedAt >= DrainBatchMillis) {
+          for (auto &entry : batches) {
+            if (entry.second.frame.empty())
+              continue;
+            entry.second.clear();
+            failed.push_back(entry.first);
+            outbox.push_back(StageItem(entry.first, StageClosed));
+          }
+        }
+      }
+      if (!busy)
+        Sleep(1);
+    }
+    m_pipeline.Exited(true);
+  }
+
+  // Lock Free
+  // Add a StageSend to what its writer has for the socket.
+  void BatchItem(StageItem &item, StageBatch &batch) {
+    comms::PacketInfo &info = item.info;
+    if (batch.frame.empty())
+      batch.since = GetTickCount();
+    if (info.queued && trace::tracer.On())
+      batch.traces.push_back(std::make_pair(info.traceKey, info.queued));
+    if (!item.frame.empty()) {
+      if (batch.frame.empty())
+        batch.frame.swap(item.frame);
+      else
+        batch.frame.insert(batch.frame.end(), item.frame.begin(),
+                           item.frame.end());
+      return;
+    }
+    batch.frame.reserve(batch.frame.size() + comms::HeaderSize / sizeof(int) +
+                        info.packet.hdr.len);
+    comms::EncodeHeader(info.packet.hdr, batch.frame);
+    comms::EncodePayload(info.packet.data, info.packet.hdr.len, batch.frame);
+  }
+
+  // Lock Free
+  // Send what is left of a writer's batch for |s|, false when the socket
+  // failed. What the socket would not take stays in the batch for the next
+  // pass, unless the client has stopped reading altogether.
+  bool SendBatch(Stage &stage, SOCKET s, StageBatch &batch) {
+    LONGLONG start = batch.traces.empty() ? 0 : trace::Tracer::Now();
+    const char *data =
+        reinterpret_cast<const char *>(&batch.frame[0]) + batch.sent;
+    size_t whole = batch.frame.size() * sizeof(unsigned int);
+    int bytes = send(s, data, static_cast<int>(whole - batch.sent), 0);
+    ++stage.calls;
+    if (bytes == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+      bytes = 0;
+    } else if (bytes <= 0) {
+      batch.clear();
+      return false;
+    }
+    if (bytes)
+      m_capture.Record(capture::KindOut, s, data, bytes);
+
+    batch.sent += bytes;
+    if (batch.sent < whole) {
+      if (whole - batch.sent <= OutboundHighWater)
+        return true;
+      batch.clear();
+      return false;
+    }
+    CountFrames(reinterpret_cast<const char *>(&batch.frame[0]),
+                static_cast<unsigned int>(whole));
+    if (start) {
+      LONGLONG end = trace::Tracer::Now();
+      for (auto &t : batch.traces) {
+        trace::tracer.Record("server.queue", t.first, t.second, start,
+                             trace::FlowStep);
+        trace::tracer.Record("server.send", t.first, start, end,
+                             trace::FlowStep);
+      }
+    }
+    batch.clear();
+    return true;
+  }
+
+  // Auto Locking
+  void GetIoStats(IoStats &stats) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    stats = m_ioStats;
+    stats.recvCalls += m_pipeline.RecvCalls();
+    stats.sendCalls = m_sendCalls + m_pipeline.SendCalls();
+
+    std::vector<unsigned int> sorted(m_latencies);
+    std::sort(sorted.begin(), sorted.end());
+    stats.p50Micros = sorted.empty() ? 0 : sorted[sorted.size() / 2];
+    stats.p99Micros = sorted.empty() ? 0 : sorted[sorted.size() * 99 / 100];
+  }
+
+  // Auto Locking
+  // Link to the server at |host|:|port| and keep the link up.
+  bool AddPeer(const std::string &host, unsigned short port) {
+    SOCKADDR_IN addr;
+    ZeroMemory(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(host.c_str());
+    if (addr.sin_addr.s_addr == INADDR_NONE) {
+      struct hostent *phe = gethostbyname(host.c_str());
+      if (phe == 0) {
+        std::cout << "Could not resolve peer " << host.c_str() << std::endl;
+        return false;
+      }
+      memcpy(&addr.sin_addr, phe->h_addr_list[0], sizeof(struct in_addr));
+    }
+
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    PeerAddress peer{addr, host + ":" + std::to_string(port), INVALID_SOCKET,
+                     slots::InvalidHandle, GetTickCount()};
+    m_peerAddresses.push_back(peer);
+    return true;
+  }
+
+  // Auto Locking
+  // Start or finish linking to peers which are not linked, without blocking.
+  void ConnectPeers() {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    if (m_handingOff)
+      return;
+    DWORD now = GetTickCount();
+    for (auto &p : m_peerAddresses) {
+      if (m_clients.Get(p.link))
+        continue;
+
+      if (p.pending == INVALID_SOCKET) {
+        if (static_cast<int>(now - p.nextAttempt) < 0)
+          continue;
+        p.nextAttempt = now + PeerRetryMillis;
+        p.pending = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        unsigned long mode = 1;
+        ioctlsocket(p.pending, FIONBIO, &mode); //  Non-blocking.
+        if (connect(p.pending, (LPSOCKADDR)&p.addr, sizeof(p.addr)) ==
+                SOCKET_ERROR &&
+            WSAGetLastError() != WSAEWOULDBLOCK) {
+          ::closesocket(p.pending);
+          p.pending = INVALID_SOCKET;
+        }
+        continue;
+      }
+
+      // Poll the connect, giving up when the next attempt is due.
+      fd_set writable, failed;
+      FD_ZERO(&writable);
+      FD_ZERO(&failed);
+      FD_SET(p.pending, &writable);
+      FD_SET(p.pending, &failed);
+      timeval poll = {0, 0};
+      if (select(0, NULL, &writable, &failed, &poll) > 0 &&
+          FD_ISSET(p.pending, &writable)) {
+        std::cout << "Linked to peer " << p.name.c_str() << std::endl;
+        PushConnection(p.pending, p.name);
+        p.link = m_socketIndex[p.pending];
+        p.pending = INVALID_SOCKET;
+        SendPeerHello(*m_clients.Get(p.link), 0);
+      } else if (FD_ISSET(p.pending, &failed) ||
+                 static_cast<int>(now - p.nextAttempt) >= 0) {
+        ::closesocket(p.pending);
+        p.pending = INVALID_SOCKET;
+      }
+    }
+  }
+
+  // Lock Free
+  // Bring the gauges up to date for a scrape, call with the lock held.
+  void UpdateGauges() {
+    LONGLONG clients = 0, peers = 0, inbound = 0, outbound = 0, bytes = 0;
+    for (auto &c : m_clients) {
+      if (c.peerNode)
+        ++peers;
+      else
+        ++clients;
+      inbound += c.inboundMessages.size();
+      outbound += c.outboundMessages.size();
+      bytes += c.outboundMessages.Bytes();
+    }
+    LONGLONG parked = 0;
+    for (auto &session : m_sessions) {
+      if (session.second.parked)
+        ++parked;
+    }
+    m_clientsGauge.Set(clients);
+    m_peersGauge.Set(peers);
+    m_parkedGauge.Set(parked);
+    m_channelsGauge.Set(m_channels.size());
+    m_inboundGauge.Set(inbound);
+    m_outboundGauge.Set(outbound);
+    m_outboundBytesGauge.Set(bytes);
+  }
+
+  // Auto Locking
+  // Answer Prometheus scrapes of /metrics on loopback |port|.
+  bool ServeMetrics(unsigned short port) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    if (!m_scrape.Open(port)) {
+      std::cout << "Could not open metrics port " << port << std::endl;
+      return false;
+    }
+    std::cout << "Metrics port " << port << std::endl;
+    return true;
+  }
+
+  // Auto Locking
+  // Record everything read and sent to |path|, for FileStreamReplay. The
+  // clients already here are captured as if they had just connected.
+  bool StartCapture(const std::string &path) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    if (!m_capture.Open(path)) {
+      std::cout << "Could not capture to " << path.c_str() << std::endl;
+      return false;
+    }
+    for (auto &c : m_clients)
+      m_capture.Record(capture::KindOpen, c.socket, c.ip.c_str(),
+                       c.ip.length());
+    std::cout << "Capturing to " << path.c_str() << std::endl;
+    return true;
+  }
+
+  // Auto Locking
+  void ScrapeMetrics() {
+    if (!m_scrape.IsOpen())
+      return; // Nothing to serve, and no lock to take for it.
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    m_scrape.Tick(GetTickCount(), [this](std::string &body) {
+      UpdateGauges();
+      m_metrics.Render(body);
+    });
+  }
+
+  // Auto Locking
+  // Announce the server through |announcer|, which we now own.
+  void AddAnnouncer(discovery::Announcer *announcer) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    m_announcers.emplace_back(announcer);
+  }
+
+  // Auto Locking
+  // Give every announcer its turn, none of them wait on the network.
+  void Announce() {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    DWORD now = GetTickCount();
+    for (auto &a : m_announcers)
+      a->Tick(now);
+  }
+
+  // Auto Locking
+  // Let a new process take our sockets over on loopback |port|.
+  void ListenForHandoff(unsigned short port) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    m_handoffSocket = Listen(port, INADDR_LOOPBACK);
+    std::cout << "Handoff port " << port << std::endl;
+  }
+
+  bool HandedOff() const { return m_handedOff; }
+
+  // Lock Free
+  // Called by the accept thread, which it must not hold up. Reads what has
+  // come in of a handoff request, true and the new process id in |pid| once
+  // a whole one carrying the peer secret is in. Without a secret nobody may
+  // take over, and a caller gets HandoffTimeoutMillis to finish asking.
+  bool HandoffRequested(DWORD &pid) {
+    if (m_handoffLink == INVALID_SOCKET) {
+      m_handoffLink = accept(m_handoffSocket, NULL, NULL);
+      if (m_handoffLink == INVALID_SOCKET)
+        return false;
+      unsigned long mode = 1;
+      ioctlsocket(m_handoffLink, FIONBIO, &mode); //  Non-blocking.
+      m_handoffData.clear();
+      m_handoffDeadline = GetTickCount() + HandoffTimeoutMillis;
+    }
 
-          // This is one of the only messages which are mutated before being
-          // sent back.
-          comms::PacketInfo info{msg.packet, false, 0};
-          info.packet.hdr.type = PKT_FILE_IN;
-          globalMessages.push_back(info);
-        } break;
+    char stack[comms::TransferSize];
+    int bytesRead;
+    while ((bytesRead = recv(m_handoffLink, stack, sizeof(stack), 0)) > 0 &&
+           m_handoffData.size() < comms::TransferSize)
+      m_handoffData.insert(m_handoffData.end(), stack, stack + bytesRead);
+    bool failed = bytesRead == 0 || (bytesRead == SOCKET_ERROR &&
+                                     WSAGetLastError() != WSAEWOULDBLOCK);
+
+    comms::packetQueue queue;
+    comms::QueueCompletePackets(m_handoffData, queue);
+    if (queue.empty() && !failed &&
+        m_handoffData.size() < comms::TransferSize &&
+        static_cast<int>(GetTickCount() - m_handoffDeadline) < 0)
+      return false;
+
+    bool asked = !queue.empty() &&
+                 queue.front().packet.hdr.type == PKT_HANDOFF &&
+                 queue.front().packet.hdr.flags == HandoffRequest &&
+                 !m_peerSecret.empty() &&
+                 std::string(queue.front().packet.data) == m_peerSecret;
+    if (!asked) {
+      std::cout << "Refused a handoff request." << std::endl;
+      ::closesocket(m_handoffLink);
+      m_handoffLink = INVALID_SOCKET;
+      return false;
+    }
+    pid = queue.front().packet.hdr.id;
+    return true;
+  }
+
+  // Auto Locking
+  // Hand every client to a new process asking on the handoff port. Nothing
+  // is read or sent once the state is written, and if the new process does
+  // not take over we carry on as though nothing happened. Peer links are not
+  // handed over, they link up again by themselves.
+  void ServeHandoff() {
+    DWORD pid;
+    if (m_handoffSocket == INVALID_SOCKET || m_handedOff ||
+        !HandoffRequested(pid))
+      return;
+    SOCKET link = m_handoffLink;
+    m_handoffLink = INVALID_SOCKET;
+
+    unsigned long mode = 0;
+    ioctlsocket(link, FIONBIO, &mode); // Blocking, it is a short exchange.
+    DWORD timeout = HandoffTimeoutMillis;
+    setsockopt(link, SOL_SOCKET, SO_RCVTIMEO,
+               reinterpret_cast<const char *>(&timeout), sizeof(timeout));
+    std::cout << "Handing off to process [" << pid << "]" << std::endl;
+
+    // Locked while the sockets are duplicated and the state is written.
+    std::string state;
+    std::vector<std::string> clients;
+    unsigned int readers, writers;
+    {
+      AutoLocker locker(m_mutex, __FUNCTION__);
+      // Take in whatever the completion port already read, then stop
+      // reading.
+      if (m_reader.IsOpen()) {
+        m_reader.Drain();
+        for (int i = 0; i < 100 && !m_reader.Idle(); ++i) {
+          Sleep(1);
+          ReadClients(nullptr);
         }
       }
-      so.inboundMessages.clear();
+
+      // The listening socket leads, the new process needs it to start up.
+      if (!DuplicateFor(m_acceptSocket, pid, state)) {
+        std::cout << "Could not share the listening socket." << std::endl;
+        ::closesocket(link);
+        return;
+      }
+
+      // A pipeline sends what it was given and hands back what it read.
+      readers = m_pipeline.Readers();
+      writers = m_pipeline.Writers();
+      if (m_pipeline.IsOpen())
+        StopPipeline();
+      // Batched frames go out first, a client which will not take them is
+      // dropped rather than handed over in the middle of a frame.
+      DrainBatches();
+      HandleClosedSockets();
+      WriteServerState(state);
+      for (auto &c : m_clients) {
+        std::string client;
+        if (!c.peerNode && WriteClientState(c, pid, client))
+          clients.push_back(client);
+      }
+
+      // The new process opens the log as soon as it is done.
+      m_log.Close();
+      m_handingOff = true;
     }
 
-    // Push all the global/private messages to the correct clients.
-    for (auto msg : globalMessages) {
-      for (auto &so : m_clients) {
-        so.outboundMessages.push_back(msg);
+    SendPacket(link, comms::Packet{{PKT_HANDOFF, HandoffServer, 0, 0,
+                                    state.length(), 0, 0},
+                                   state});
+    for (auto &client : clients)
+      SendPacket(link, comms::Packet{{PKT_HANDOFF, HandoffClient, 0, 0,
+                                      client.length(), 0, 0},
+                                     client});
+    unsigned int sent = static_cast<unsigned int>(clients.size());
+    SendPacket(link,
+               comms::Packet{{PKT_HANDOFF, HandoffDone, sent, 0, 0, 0, 0}, ""});
+
+    std::vector<char> data;
+    comms::packetQueue queue;
+    comms::PacketInfo taken;
+    bool handedOff = comms::NextPacket(link, data, queue, taken) &&
+                     taken.packet.hdr.type == PKT_HANDOFF &&
+                     taken.packet.hdr.flags == HandoffTaken;
+
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    m_handingOff = false;
+    if (!handedOff) {
+      std::cout << "Handoff failed, carrying on." << std::endl;
+      ::closesocket(link);
+      if (!m_log.Open(m_logDir, LogSegmentBytes, LogMaxSegments))
+        std::cout << "Could not open the message log." << std::endl;
+      for (auto &c : m_clients) {
+        if (m_reader.IsOpen() && !m_reader.Watch(c.socket))
+          MarkSocketClosed(c.socket);
       }
+      if (readers)
+        StartPipeline(readers, writers);
+      return;
     }
+
+    // Our copies of the sockets can go, the new process has its own.
+    std::cout << "Handed off " << sent << " clients." << std::endl;
+    ::closesocket(link);
+    for (auto &c : m_clients)
+      ::closesocket(c.socket);
+    ::closesocket(m_acceptSocket);
+    ::closesocket(m_handoffSocket);
+    m_handoffSocket = INVALID_SOCKET;
+    m_clients = ClientMap();
+    m_socketIndex.clear();
+    m_aliasIndex.clear();
+    m_sessions.clear();
+    m_peerAddresses.clear();
+    m_announcers.clear();
+    m_capture.Close();
+    m_handedOff = true;
   }
 
-  void SendMessages() {
-    // For each client we send only 1 message at a time, we don't wait for an
-    // ack, but we do wait for the client to be able to process the message
-    // before we send the next one.
-    // Slowly but surely the queue will empty out.
-    AutoLocker locker(m_mutex);
-    for (auto &client : m_clients) {
-      auto it = client.outboundMessages.begin();
-      if (it != client.outboundMessages.end()) {
-        // Send the message to the client and erase it from the queue.
-        SendPacket(client.socket, it->packet);
-        client.outboundMessages.erase(it);
+  // Ask the server listening for handoffs on loopback |port| for its
+  // sockets, showing it the peer |secret|. On success |handoff| holds the
+  // listening socket for the new NetServer, and the rest is passed to Adopt.
+  static bool TakeOver(unsigned short port, const std::string &secret,
+                       Handoff &handoff) {
+    WSADATA w;
+    if (WSAStartup(0x0202, &w))
+      return false;
+
+    SOCKADDR_IN addr;
+    ZeroMemory(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    handoff.link = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (handoff.link == INVALID_SOCKET)
+      return false;
+    DWORD timeout = HandoffTimeoutMillis;
+    setsockopt(handoff.link, SOL_SOCKET, SO_RCVTIMEO,
+               reinterpret_cast<const char *>(&timeout), sizeof(timeout));
+    if (connect(handoff.link, (LPSOCKADDR)&addr, sizeof(addr)) ==
+        SOCKET_ERROR) {
+      ::closesocket(handoff.link);
+      return false;
+    }
+
+    std::vector<unsigned int> request;
+    comms::EncodeHeader(comms::Header{PKT_HANDOFF, HandoffRequest, 0, 0,
+                                      secret.length(), 0,
+                                      GetCurrentProcessId()},
+                        request);
+    comms::EncodePayload(secret, secret.length(), request);
+    send(handoff.link, reinterpret_cast<char *>(&request[0]),
+         request.size() * sizeof(unsigned int), 0);
+
+    std::vector<char> data;
+    comms::packetQueue queue;
+    comms::PacketInfo info;
+    while (comms::NextPacket(handoff.link, data, queue, info) &&
+           info.packet.hdr.type == PKT_HANDOFF) {
+      if (info.packet.hdr.flags == HandoffServer) {
+        handoff.server = info.packet.data;
+      } else if (info.packet.hdr.flags == HandoffClient) {
+        handoff.clients.push_back(info.packet.data);
+      } else if (info.packet.hdr.flags == HandoffDone) {
+        std::string::size_type pos = 0;
+        handoff.listener = Reopen(handoff.server, pos);
+        handoff.server.erase(0, pos);
+        if (handoff.listener != INVALID_SOCKET)
+          return true;
+        break;
       }
     }
+    ::closesocket(handoff.link);
+    return false;
   }
 
-  // Create the server - initialize common WinSock things.
-  // Create the accept and comms threads.
-  NetServer() : NetCommon() {
-    // The server immediately starts listening.
+  // Auto Locking
+  // Take on the state and clients from TakeOver, then let the old process
+  // know it can go.
+  bool Adopt(Handoff &handoff) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    if (!ReadServerState(handoff.server)) {
+      std::cout << "Could not read the handed off state." << std::endl;
+      ::closesocket(handoff.link);
+      return false;
+    }
 
-    SOCKADDR_IN addr; // the address structure for a TCP socket
+    unsigned int adopted = 0;
+    for (auto &c : handoff.clients) {
+      if (ReadClientState(c))
+        ++adopted;
+    }
+    std::cout << "Took over " << adopted << " clients." << std::endl;
 
-    addr.sin_family = AF_INET;                // Address family Internet
-    addr.sin_port = htons(CHATMIUM_PORT_NR);  // Assign port to this socket
-    addr.sin_addr.s_addr = htonl(INADDR_ANY); // No destination
+    SendPacket(handoff.link,
+               comms::Packet{{PKT_HANDOFF, HandoffTaken, 0, 0, 0, 0, 0}, ""});
+    ::closesocket(handoff.link);
+    return true;
+  }
 
-    m_acceptSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP); // Create socket
+  // Auto Locking
+  void SetRateLimit(PacketClass cls, unsigned int rate, unsigned int burst) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    m_rateLimits[cls] = RateLimit{rate, burst};
+  }
 
-    if (m_acceptSocket == INVALID_SOCKET) {
-      std::cout << "Could not create socket." << std::endl;
-      throw "Could not create socket";
-      return;
+  // Auto Locking
+  void SetSlowConsumerPolicy(SlowConsumerPolicy policy) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    m_slowPolicy = policy;
+  }
+
+  // Auto Locking
+  void GetQueueDepths(std::vector<QueueDepth> &depths) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    for (auto &client : m_clients) {
+      QueueDepth depth{client.alias,
+                       static_cast<unsigned int>(client.outboundMessages.size()),
+                       client.outboundMessages.Bytes(),
+                       client.outboundMessages.dropped};
+      for (int c = 0; c < PacketClasses; ++c) {
+        depth.throttled[c] = client.throttled[c];
+        depth.rejected[c] = client.rejected[c];
+      }
+      depths.push_back(depth);
     }
+  }
 
-    // Not too stressed if we can't reuse the socket.
-    const char reuse = 1;
-    setsockopt(m_acceptSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int));
+  // Create the server - initialize common WinSock things.
+  // Create the accept and comms threads. Several servers on one machine each
+  // need their own |port|.
+  //
+  // Workers share one listening socket, |shared|, and each accepts from it
+  // so connections spread across them. They link up as peers over loopback
+  // on their own |busPort|, which carries the room between them.
+  NetServer(unsigned short port = CHATMIUM_PORT_NR,
+            unsigned short busPort = 0, SOCKET shared = INVALID_SOCKET)
+      : NetCommon(), m_busSocket(INVALID_SOCKET), m_sessionCounter(0),
+        m_listVersion(1), m_snapshotVersion(0), m_snapshotLen(0),
+        m_slowPolicy(SlowPauseFiles), m_nextChannel(LobbyChannel + 1),
+        m_relayCounter(0), m_handoffSocket(INVALID_SOCKET),
+        m_handoffLink(INVALID_SOCKET), m_handoffDeadline(0),
+        m_handingOff(false), m_handedOff(false),
+        m_flushDeadline(0), m_latencyNext(0) {
+    m_ioStats = IoStats{IoPoll, 0, 0, 0, 0, 0, 0};
+    m_channelIds["lobby"] = LobbyChannel;
+    m_channels[LobbyChannel] = Channel{"lobby", {}};
+    for (int c = 0; c < PacketClasses; ++c)
+      m_rateLimits[c] = DefaultRateLimits[c];
+
+    // Node ids only need to differ between servers that are up together.
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    m_nodeId = (GetCurrentProcessId() << 16) ^
+               static_cast<unsigned int>(counter.QuadPart) ^ GetTickCount();
+    if (m_nodeId == 0)
+      m_nodeId = 1;
+    std::cout << "Node id [" << m_nodeId << "]" << std::endl;
+
+    // Carry on without history rather than refuse to start.
+    m_logDir = GetModuleDirectory() + "log";
+    if (busPort != 0)
+      m_logDir.append("_" + std::to_string(busPort));
+    else if (port != CHATMIUM_PORT_NR)
+      m_logDir.append("_" + std::to_string(port));
+    m_logDir.append("\\");
+    if (!m_log.Open(m_logDir, LogSegmentBytes, LogMaxSegments))
+      std::cout << "Could not open the message log." << std::endl;
 
-    if (bind(m_acceptSocket, (LPSOCKADDR)&addr, sizeof(addr)) ==
-        SOCKET_ERROR) // Try binding
-    {                 // error
-      std::cout << "Could not bind to IP." << std::endl;
-      throw "Could not bind to IP";
-      return;
+    // The server immediately starts listening.
+    m_acceptSocket = shared == INVALID_SOCKET ? Listen(port, INADDR_ANY) : shared;
+    std::cout << "Listening port " << port << std::endl;
+    if (busPort != 0) {
+      m_busSocket = Listen(busPort, INADDR_LOOPBACK);
+      std::cout << "Worker bus port " << busPort << std::endl;
     }
 
-    listen(m_acceptSocket, 10); // Start listening
-    unsigned long mode = 1;
-    ioctlsocket(m_acceptSocket, FIONBIO, &mode); //  Non-blocking.
-
-    std::cout << "Listening port " << CHATMIUM_PORT_ST << std::endl;
+    // Everything is registered before the threads start.
+    static const char *classes[] = {"chat", "file", "control"};
+    for (int c = 0; c < PacketClasses; ++c)
+      m_metrics.Add("chatmium_throttled_total",
+                    "Packets held back by the rate limiter, by class.",
+                    m_throttledTotal[c],
+                    std::string("class=\"") + classes[c] + "\"");
+    for (int c = 0; c < PacketClasses; ++c)
+      m_metrics.Add("chatmium_rejected_total",
+                    "Packets dropped by the rate limiter, by class.",
+                    m_rejectedTotal[c],
+                    std::string("class=\"") + classes[c] + "\"");
+    m_metrics.Add("chatmium_retransmits_total",
+                  "Client retransmits acked again without routing them.",
+                  m_retransmitsTotal);
+    m_metrics.Add("chatmium_paused_dropped_total",
+                  "Packets dropped for paused clients with full queues.",
+                  m_pausedDropsTotal);
+    m_metrics.Add("chatmium_clients", "Connected clients.", m_clientsGauge);
+    m_metrics.Add("chatmium_peers", "Linked peer servers.", m_peersGauge);
+    m_metrics.Add("chatmium_parked_sessions",
+                  "Sessions waiting for their client to resume.",
+                  m_parkedGauge);
+    m_metrics.Add("chatmium_channels", "Open channels.", m_channelsGauge);
+    m_metrics.Add("chatmium_inbound_packets",
+                  "Packets read but not yet processed.", m_inboundGauge);
+    m_metrics.Add("chatmium_outbound_packets", "Packets waiting to be sent.",
+                  m_outboundGauge);
+    m_metrics.Add("chatmium_outbound_bytes", "Bytes waiting to be sent.",
+                  m_outboundBytesGauge);
+    m_metrics.Add("chatmium_ingest_to_send_microseconds",
+                  "Time from reading a packet to sending what it caused.",
+                  m_ingestToSend);
 
     InitializeCriticalSection(&m_mutex);
+    lockprof::profiler.NameLock(&m_mutex, "server");
     // The server starts a separate set of threads. One to accept connections,
     // the other to read/write on those connections.
     DWORD acceptThreadId;
@@ -786,10 +4627,6 @@ public:
     DWORD commsThreadId;
     commsThread =
         CreateThread(NULL, 0, ServerCommsConnections, this, 0, &commsThreadId);
-
-    DWORD covalentThreadId;
-    covalentThread =
-        CreateThread(NULL, 0, ServerPingCovalent, this, 0, &covalentThreadId);
   }
 
   ~NetServer() {
@@ -812,16 +4649,182 @@ class NetClient : public NetCommon {
   comms::packetQueue m_threadOutQueue;
   comms::packetQueue m_threadInQueue;
   print::printQueue m_printQueue;
+  // Traced lines in the print queue and when they were read.
+  std::vector<std::pair<unsigned long long, LONGLONG>> m_printTraces;
 
   std::vector<comms::OpenFileData> openFiles;
   comms::packetQueue m_threadFileOutQueue;
 
+  // Session resumption, the link state is only changed by the comms thread.
+  std::string m_sessionToken;
+  bool m_linkUp;
+  bool m_resuming;
+  DWORD m_backoff;
+  DWORD m_nextReconnect;
+
+  // Names of the channels we are in, by the id the server gave them.
+  std::map<unsigned int, std::string> m_channelNames;
+
+  // Our copy of the server user list, kept current with PKT_LST deltas.
+  std::vector<std::string> m_userList;
+  unsigned int m_listVersion;
+
+  // Log sequence of the last room message we saw, so a rejoin only brings
+  // back what we missed.
+  unsigned int m_lastLogSequence;
+
+  // Client metrics, the gauges are filled in when scraped.
+  metrics::Histogram m_ackRtt;
+  metrics::Gauge m_queuedGauge;
+  metrics::Gauge m_fileQueuedGauge;
+  metrics::Gauge m_linkGauge;
+
+  // Lock-free
+  void HandleUserList(comms::Packet &packet) {
+    std::string data(packet.data);
+    if (packet.hdr.flags == 0) {
+      // A full list, skip the title.
+      m_userList.clear();
+      std::string::size_type title = data.find('|');
+      data = title == std::string::npos ? "" : data.substr(title + 1);
+    }
+
+    if (packet.hdr.flags != 2) {
+      std::string::size_type start = 0;
+      std::string::size_type pos = data.find("|_+_|", start);
+      while (pos != std::string::npos) {
+        std::string entry = data.substr(start, pos - start);
+        if (packet.hdr.flags == 0) {
+          m_userList.push_back(entry);
+        } else if (!entry.empty() && entry[0] == '+') {
+          m_userList.push_back(entry.substr(1));
+        } else if (!entry.empty()) {
+          for (auto it = m_userList.begin(); it != m_userList.end(); ++it) {
+            if (*it == entry.substr(1)) {
+              m_userList.erase(it);
+              break;
+            }
+          }
+        }
+        start = pos + 5;
+        pos = data.find("|_+_|", start);
+      }
+    }
+    m_listVersion = packet.hdr.id;
+
+    std::string user_list("Users on this server:|");
+    for (auto &entry : m_userList) {
+      user_list.append(entry);
+      user_list.append("|_+_|");
+    }
+    m_printQueue.push_back(print::PrintInfo(user_list, "", false));
+  }
+
+  // Lock-Free
+  // Resolve |m_addy| and connect a fresh non-blocking socket to it.
+  bool OpenSocket() {
+    struct addrinfo *result = NULL, *ptr = NULL;
+    struct addrinfo hints;
+
+    // set address info
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP; // TCP connection!!!
+
+    m_socket = INVALID_SOCKET;
+    int iResult =
+        ::getaddrinfo(m_addy.c_str(), CHATMIUM_PORT_ST, &hints, &result);
+    if (iResult != 0)
+      return false;
+
+    // Attempt to connect to an address until one succeeds, giving each one
+    // ConnectTimeoutMillis so a dead server cannot stall the comms thread.
+    for (ptr = result; ptr != NULL; ptr = ptr->ai_next) {
+      // Create a SOCKET for connecting to server
+      m_socket = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+
+      if (m_socket != INVALID_SOCKET) {
+        // If iMode!=0, non-blocking mode is enabled.
+        u_long iMode = 1;
+        ioctlsocket(m_socket, FIONBIO, &iMode);
+
+        // Connect to server.
+        iResult = connect(m_socket, ptr->ai_addr, (int)ptr->ai_addrlen);
+        if (iResult != SOCKET_ERROR)
+          break;
+
+        if (WSAGetLastError() == WSAEWOULDBLOCK) {
+          fd_set writable, failed;
+          FD_ZERO(&writable);
+          FD_ZERO(&failed);
+          FD_SET(m_socket, &writable);
+          FD_SET(m_socket, &failed);
+          timeval wait = {ConnectTimeoutMillis / 1000,
+                          (ConnectTimeoutMillis % 1000) * 1000};
+          if (select(0, NULL, &writable, &failed, &wait) > 0 &&
+              FD_ISSET(m_socket, &writable))
+            break;
+        }
+
+        ::closesocket(m_socket);
+        m_socket = INVALID_SOCKET;
+      }
+    }
+
+    // no longer need address info for server
+    ::freeaddrinfo(result);
+
+    return m_socket != INVALID_SOCKET;
+  }
+
+  // Lock-free
+  // Put a fresh alias packet at the head of the lock-step queue.
+  void PushAliasFront() {
+    RemoveOutboundPacket(m_threadOutQueue, PKT_ALIAS);
+    comms::PacketInfo info{
+        {{PKT_ALIAS, comms::AckCumulative, 0, 0, m_alias.length(), 4,
+          m_lastLogSequence},
+         m_alias},
+        false,
+        0};
+    m_threadOutQueue.insert(m_threadOutQueue.begin(), info);
+  }
+
+  // Lock-free
+  void HandleResumeAck(comms::Packet &packet) {
+    m_resuming = false;
+    RemoveOutboundPacket(m_threadOutQueue, PKT_RESUME, packet.hdr.sequence);
+    if (packet.hdr.flags == 0) {
+      // The server gave up on us, join the room again from scratch.
+      m_sessionToken.clear();
+      PushAliasFront();
+      m_printQueue.push_back(
+          print::PrintInfo("Session expired, rejoining the room.", "", false));
+      return;
+    }
+
+    // Drop whatever the server processed before the link went down, the
+    // lock-step sender replays the rest.
+    std::string::size_type start = 0;
+    std::string::size_type pos = packet.data.find('|', start);
+    while (pos != std::string::npos) {
+      unsigned int seq = std::stoul(packet.data.substr(start, pos - start));
+      RemoveOutboundPacket(m_threadOutQueue, 0, seq);
+      RemoveOutboundPacket(m_threadFileOutQueue, 0, seq);
+      start = pos + 1;
+      pos = packet.data.find('|', start);
+    }
+    m_printQueue.push_back(
+        print::PrintInfo("Reconnected to the server.", "", false));
+  }
+
   // Lock-Free
   void PvtAddPrintQueueHelper(const std::string &data, bool &trigger,
-                              bool compressed) {
+                              bool compressed, const std::string &prefix = "") {
     if (!data.empty()) {
       if (!compressed) {
-        m_printQueue.push_back(print::PrintInfo(data, "", false));
+        m_printQueue.push_back(print::PrintInfo(prefix + data, "", false));
       } else {
 #ifdef USE_FLATE
         // Decompress the data.
@@ -832,22 +4835,38 @@ class NetClient : public NetCommon {
         std::string iData;
         iData.assign(reinterpret_cast<char *>(decompressed.outData),
                      decompressed.outDataSize);
-        m_printQueue.push_back(print::PrintInfo(iData, "", false));
+        m_printQueue.push_back(print::PrintInfo(prefix + iData, "", false));
 #else
-        m_printQueue.push_back(print::PrintInfo(data, "", false));
+        m_printQueue.push_back(print::PrintInfo(prefix + data, "", false));
 #endif
       }
     }
     trigger = true;
   }
 
+  // Lock-free
+  // The user file |id| was for has gone, stop sending what is left of it.
+  void DropOutboundFile(unsigned int id) {
+    auto it = std::remove_if(m_threadFileOutQueue.begin(),
+                             m_threadFileOutQueue.end(),
+                             [id](const comms::PacketInfo &info) {
+                               return info.packet.hdr.id == id;
+                             });
+    if (it == m_threadFileOutQueue.end())
+      return;
+    m_threadFileOutQueue.erase(it, m_threadFileOutQueue.end());
+    m_printQueue.push_back(print::PrintInfo(
+        "That user is no longer on this server, the file was not sent.", "",
+        false));
+  }
+
   // Partially locked
   void transferFileInternal(const std::string &name, const std::string &path,
                             const std::string &user) {
     FILE *file{fopen(path.c_str(), "rb")};
     // We simply block until we can allocate the entire file into our buffer.
     if (!file) {
-      AutoLocker locker(m_mutex);
+      AutoLocker locker(m_mutex, __FUNCTION__);
       m_printQueue.push_back(
           print::PrintInfo("Could not open the file", "", false));
       return;
@@ -898,11 +4917,10 @@ class NetClient : public NetCommon {
       next.packet.data.assign(buf, bytesRead);
       lFilePieces.push_back(next);
 
-      std::cout << "Stacking file chunk for sending [" << i + 1 << "]["
-                << chunks << "]" << std::endl;
+      LOG_INFO("Stacking file chunk for sending [%u][%u]", i + 1, chunks);
     }
 
-    AutoLocker locker(m_mutex);
+    AutoLocker locker(m_mutex, __FUNCTION__);
     m_threadFileOutQueue.insert(m_threadFileOutQueue.end(), lFilePieces.begin(),
                                 lFilePieces.end());
     fclose(file);
@@ -928,7 +4946,7 @@ class NetClient : public NetCommon {
       if (it->id == packet.hdr.id) {
         // Then we can write some data to the file.
         fwrite(packet.data.data(), 1, packet.data.length(), it->file);
-        std::cout << "Writing file data: " << packet.data.length() << std::endl;
+        LOG_INFO("Writing file data: %u", packet.data.length());
         if (packet.hdr.current == packet.hdr.parts) {
           fclose(it->file);
           displayFile = true;
@@ -957,13 +4975,29 @@ class NetClient : public NetCommon {
       // The way we wait for an ack is by specifying that the message was sent.
       // Along with a 'timeout' value, this allows us to essentially remain in
       // lock-step with the server.
+      bool traced = it->traceKey && trace::tracer.On();
       if (it->sent && --it->skips < 0) {
+        LONGLONG start = traced ? trace::Tracer::Now() : 0;
         it->skips = 500;
+        it->stamp = 0;
         SendPacket(m_socket, it->packet);
+        if (traced)
+          trace::tracer.Record("client.resend", it->traceKey, start,
+                               trace::Tracer::Now(), trace::FlowStep);
       } else if (!it->sent) {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
         it->sent = true;
         it->skips = 500;
+        it->stamp = now.QuadPart;
         SendPacket(m_socket, it->packet);
+        if (traced) {
+          // Lock-step, the line waited for everything queued before it.
+          trace::tracer.Record("client.wait", it->traceKey, it->queued,
+                               now.QuadPart, trace::FlowStep);
+          trace::tracer.Record("client.send", it->traceKey, now.QuadPart,
+                               trace::Tracer::Now(), trace::FlowStep);
+        }
       }
       // We don't immediately erase the message since we are waiting
       // for an ack.
@@ -973,19 +5007,69 @@ class NetClient : public NetCommon {
 public:
   // Don't start up any threads.
   NetClient()
-      : NetCommon(), m_connected(false), m_sequence(4),
-        m_thread(INVALID_HANDLE_VALUE) {
+      : NetCommon(), m_socket(INVALID_SOCKET), m_connected(false),
+        m_sequence(4), m_thread(INVALID_HANDLE_VALUE), m_linkUp(false),
+        m_resuming(false), m_backoff(MinReconnectMillis), m_nextReconnect(0),
+        m_listVersion(0), m_lastLogSequence(0) {
+    m_metrics.Add("chatmium_ack_rtt_microseconds",
+                  "Time from sending a packet to its ack.", m_ackRtt);
+    m_metrics.Add("chatmium_queued_packets", "Packets waiting for an ack.",
+                  m_queuedGauge);
+    m_metrics.Add("chatmium_queued_file_packets",
+                  "File chunks waiting for an ack.", m_fileQueuedGauge);
+    m_metrics.Add("chatmium_link_up", "1 while connected to the server.",
+                  m_linkGauge);
     InitializeCriticalSection(&m_mutex);
+    lockprof::profiler.NameLock(&m_mutex, "client");
   }
 
   SOCKET GetSocket() { return m_socket; }
+
+  // Answer Prometheus scrapes of /metrics on loopback |port|, served from
+  // the comms thread once it runs.
+  bool ServeMetrics(unsigned short port) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    return m_scrape.Open(port);
+  }
+
+  void ScrapeMetrics() {
+    if (!m_scrape.IsOpen())
+      return; // Nothing to serve, and no lock to take for it.
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    m_scrape.Tick(GetTickCount(), [this](std::string &body) {
+      m_queuedGauge.Set(m_threadOutQueue.size());
+      m_fileQueuedGauge.Set(m_threadFileOutQueue.size());
+      m_linkGauge.Set(m_linkUp ? 1 : 0);
+      m_metrics.Render(body);
+    });
+  }
+
+  // Lock-free
+  // Queue the packets completed by |data|, counting them for metrics.
+  void QueueInbound(std::vector<char> &data) {
+    size_t before = m_threadInQueue.size();
+    LONGLONG read = trace::tracer.On() ? trace::Tracer::Now() : 0;
+    comms::QueueCompletePackets(data, m_threadInQueue);
+    CountInbound(m_threadInQueue, before);
+
+    for (size_t i = before; read && i < m_threadInQueue.size(); ++i) {
+      comms::PacketInfo &info = m_threadInQueue[i];
+      if (info.packet.hdr.type != PKT_MSG)
+        continue;
+      info.traceKey = trace::LogKey(info.packet.hdr.sequence);
+      info.stamp = trace::Tracer::Now();
+      trace::tracer.Record("client.recv", info.traceKey, read, info.stamp,
+                           trace::FlowStep);
+    }
+  }
   bool IsRunning() const { return m_connected; }
+  bool IsLinkUp() const { return m_linkUp; }
   comms::packetQueue &GetThreadOutQueue() { return m_threadOutQueue; }
   comms::packetQueue &GetThreadInQueue() { return m_threadInQueue; }
   unsigned short GetNextSequence() { return ++m_sequence; }
 
   void AddMessage(const std::string &text) {
-    AutoLocker locker(m_mutex);
+    AutoLocker locker(m_mutex, __FUNCTION__);
     std::string data(m_alias);
     data.append("|_+_|");
     data.append(text);
@@ -1010,17 +5094,33 @@ public:
         false,
         0};
 #endif
+    if (trace::tracer.On()) {
+      info.traceKey = trace::SenderKey(m_alias, info.packet.hdr.sequence);
+      info.queued = trace::Tracer::Now();
+      trace::tracer.Record("client.enqueue", info.traceKey, info.queued,
+                           info.queued, trace::FlowStart);
+    }
     m_threadOutQueue.push_back(info);
   }
 
   void GetMessages(print::printQueue &msg) {
-    AutoLocker locker(m_mutex);
+    AutoLocker locker(m_mutex, __FUNCTION__);
     msg.insert(msg.end(), m_printQueue.begin(), m_printQueue.end());
     m_printQueue.clear();
+
+    // Traced lines end when the caller takes them to print.
+    if (!m_printTraces.empty()) {
+      LONGLONG now = trace::Tracer::Now();
+      trace::tracer.NameThread("client ui");
+      for (auto &t : m_printTraces)
+        trace::tracer.Record("client.print", t.first, t.second, now,
+                             trace::FlowEnd);
+      m_printTraces.clear();
+    }
   }
 
   void SetAlias(const std::string &alias) {
-    AutoLocker locker(m_mutex);
+    AutoLocker locker(m_mutex, __FUNCTION__);
 
     if (m_connected) {
       m_printQueue.push_back(print::PrintInfo(
@@ -1037,7 +5137,7 @@ public:
   }
 
   void GetUserList() {
-    AutoLocker locker(m_mutex);
+    AutoLocker locker(m_mutex, __FUNCTION__);
     if (!m_connected) {
       m_printQueue.push_back(
           print::PrintInfo("You need to connect first.", "", false));
@@ -1047,7 +5147,55 @@ public:
     m_printQueue.push_back(
         print::PrintInfo("Fetching list from server....", "", false));
     comms::PacketInfo info{
-        {{PKT_LST, 0, 0, 0, 0, GetNextSequence(), 0}, ""}, false, 0};
+        {{PKT_LST, 0, 0, 0, 0, GetNextSequence(), m_listVersion}, ""},
+        false,
+        0};
+    m_threadOutQueue.push_back(info);
+  }
+
+  void SendPrivate(const std::string &user, const std::string &text) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    if (!m_connected) {
+      m_printQueue.push_back(
+          print::PrintInfo("You need to connect first.", "", false));
+      return;
+    }
+
+    // The server routes on the user, and fills in who it came from.
+    std::string data(user);
+    data.append("|");
+    data.append(text);
+    comms::PacketInfo info{
+        {{PKT_PVT, 0, 0, 0, data.length(), GetNextSequence(), 0}, data},
+        false,
+        0};
+    m_threadOutQueue.push_back(info);
+  }
+
+  void JoinChannel(const std::string &name) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    if (!m_connected) {
+      m_printQueue.push_back(
+          print::PrintInfo("You need to connect first.", "", false));
+      return;
+    }
+
+    comms::PacketInfo info{
+        {{PKT_CHAN_JOIN, 0, 0, 0, name.length(), GetNextSequence(), 0}, name},
+        false,
+        0};
+    m_threadOutQueue.push_back(info);
+  }
+
+  void LeaveChannel(const std::string &name) {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    if (!m_connected)
+      return;
+
+    comms::PacketInfo info{
+        {{PKT_CHAN_LEAVE, 0, 0, 0, name.length(), GetNextSequence(), 0}, name},
+        false,
+        0};
     m_threadOutQueue.push_back(info);
   }
 
@@ -1072,58 +5220,82 @@ public:
     }
     m_addy = ip;
 
-    struct addrinfo *result = NULL, *ptr = NULL;
-    struct addrinfo hints;
+    // if connection failed
+    if (!OpenSocket()) {
+      std::cout << "Unable to connect to server!" << std::endl;
+      m_printQueue.push_back(
+          print::PrintInfo("Unable to connect to the server.", "", false));
+      return;
+    }
 
-    // set address info
-    ZeroMemory(&hints, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP; // TCP connection!!!
+    m_connected = true;
+    m_linkUp = true;
 
-    int iResult =
-        ::getaddrinfo(m_addy.c_str(), CHATMIUM_PORT_ST, &hints, &result);
-    if (iResult == 0) {
-      // Attempt to connect to an address until one succeeds
-      for (ptr = result; ptr != NULL; ptr = ptr->ai_next) {
-        // Create a SOCKET for connecting to server
-        m_socket = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+    // Create the connect message with our alias.
+    comms::PacketInfo info{
+        {{PKT_ALIAS, comms::AckCumulative, 0, 0, m_alias.length(), 4,
+          m_lastLogSequence},
+         m_alias},
+        false,
+        0};
+    m_threadOutQueue.push_back(info);
 
-        if (m_socket != INVALID_SOCKET) {
-          // Connect to server.
-          iResult = connect(m_socket, ptr->ai_addr, (int)ptr->ai_addrlen);
+    if (m_thread == INVALID_HANDLE_VALUE)
+      m_thread =
+          CreateThread(NULL, 0, ClientCommsConnection, (LPVOID) this, 0, NULL);
+  }
 
-          if (iResult != SOCKET_ERROR)
-            break;
-        }
-      }
+  // Called from the comms thread when the socket to the server fails.
+  void LinkDropped() {
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    if (!m_linkUp)
+      return;
 
-      // no longer need address info for server
-      ::freeaddrinfo(result);
+    ::closesocket(m_socket);
+    m_linkUp = false;
+    m_backoff = MinReconnectMillis;
+    m_nextReconnect = GetTickCount() + m_backoff;
+    m_printQueue.push_back(
+        print::PrintInfo("Lost the server, reconnecting...", "", false));
+  }
 
-      // if connection failed
-      if (m_socket == INVALID_SOCKET || iResult == SOCKET_ERROR) {
-        std::cout << "Unable to connect to server!" << std::endl;
-        m_printQueue.push_back(
-            print::PrintInfo("Unable to connect to the server.", "", false));
-      } else {
+  // Called from the comms thread while the link is down. The backoff doubles
+  // and carries some jitter so a whole room does not reconnect in lock-step
+  // after an outage.
+  void TryReconnect() {
+    if (static_cast<int>(GetTickCount() - m_nextReconnect) < 0)
+      return;
 
-        // If iMode!=0, non-blocking mode is enabled.
-        u_long iMode = 1;
-        ioctlsocket(m_socket, FIONBIO, &iMode);
+    if (!OpenSocket()) {
+      m_backoff = m_backoff * 2 > MaxReconnectMillis ? MaxReconnectMillis
+                                                     : m_backoff * 2;
+      m_nextReconnect = GetTickCount() + m_backoff + rand() % (m_backoff / 4);
+      return;
+    }
 
-        m_connected = true;
+    AutoLocker locker(m_mutex, __FUNCTION__);
+    ClearClosedSockets();
+    m_linkUp = true;
 
-        // Create the connect message with our alias.
-        comms::PacketInfo info{
-            {{PKT_ALIAS, 0, 0, 0, m_alias.length(), 4, 0}, m_alias}, false, 0};
-        m_threadOutQueue.push_back(info);
+    // Everything still queued is unacknowledged, so it all goes again.
+    for (auto &i : m_threadOutQueue)
+      i.sent = false;
+    for (auto &i : m_threadFileOutQueue)
+      i.sent = false;
 
-        if (m_thread == INVALID_HANDLE_VALUE)
-          m_thread = CreateThread(NULL, 0, ClientCommsConnection, (LPVOID) this,
-                                  0, NULL);
-      }
+    if (m_sessionToken.empty()) {
+      PushAliasFront();
+      return;
     }
+
+    m_resuming = true;
+    RemoveOutboundPacket(m_threadOutQueue, PKT_RESUME);
+    comms::PacketInfo resume{{{PKT_RESUME, comms::AckCumulative, 0, 0,
+                               m_sessionToken.length(), GetNextSequence(), 0},
+                              m_sessionToken},
+                             false,
+                             0};
+    m_threadOutQueue.insert(m_threadOutQueue.begin(), resume);
   }
 
   void RemoveOutboundPacket(comms::packetQueue &queue, char msgtype,
@@ -1136,6 +5308,7 @@ public:
       // unsigned int reformedSequence = htonl(sequence);
       for (; out_it != out_eit; ++out_it) {
         if (out_it->packet.hdr.sequence == sequence) {
+          RecordAck(*out_it);
           queue.erase(out_it);
           break;
         }
@@ -1145,51 +5318,136 @@ public:
 
     for (; out_it != out_eit; ++out_it) {
       if (out_it->packet.hdr.type == msgtype) {
+        RecordAck(*out_it);
         queue.erase(out_it);
         break;
       }
     }
   }
 
+  // Lock-free
+  // Drop what an ack for |lane| covers. Only the front of the lane's queue
+  // is ever in flight, so that is all we look at.
+  void HandleAck(unsigned int lane, unsigned int newest, unsigned int bits) {
+    comms::packetQueue &queue =
+        lane == comms::AckLaneFile ? m_threadFileOutQueue : m_threadOutQueue;
+    while (!queue.empty() && queue.front().sent &&
+           comms::AckCovers(newest, bits, queue.front().packet.hdr.sequence)) {
+      RecordAck(queue.front());
+      queue.erase(queue.begin());
+    }
+  }
+
+  // Lock-free
+  // Packets which were sent more than once have no stamp, we can not tell
+  // which send the ack was for.
+  void RecordAck(const comms::PacketInfo &info) {
+    if (info.sent && info.stamp)
+      m_ackRtt.Record(MicrosSince(info.stamp));
+  }
+
   void ProcessQueues() {
-    AutoLocker locker(m_mutex);
+    AutoLocker locker(m_mutex, __FUNCTION__);
     auto in_it = m_threadInQueue.begin();
     auto in_eit = m_threadInQueue.end();
 
     for (; in_it != in_eit; ++in_it) {
       bool erasePacket = false;
-      if (in_it->packet.hdr.type == PKT_ALIAS_ACK) {
-        std::cout << "Got alias Ack." << std::endl;
+      unsigned int lane, newest, bits;
+      if (comms::TakePiggybackedAck(in_it->packet.hdr, lane, newest, bits))
+        HandleAck(lane, newest, bits);
+
+      if (in_it->packet.hdr.type == PKT_ACK) {
+        const comms::Header &hdr = in_it->packet.hdr;
+        if (hdr.flags & (1u << comms::AckLaneChat))
+          HandleAck(comms::AckLaneChat, hdr.sequence, hdr.parts);
+        if (hdr.flags & (1u << comms::AckLaneFile))
+          HandleAck(comms::AckLaneFile, hdr.id, hdr.current);
+        erasePacket = true;
+      } else if (in_it->packet.hdr.type == PKT_ALIAS_ACK) {
+        LOG_INFO("Got alias Ack.");
         RemoveOutboundPacket(m_threadOutQueue, PKT_ALIAS);
-        PvtAddPrintQueueHelper(in_it->packet.data, erasePacket, false);
+        m_sessionToken = in_it->packet.data;
+        m_listVersion = 0; // A new session, our list may be from elsewhere.
+        erasePacket = true;
+      } else if (in_it->packet.hdr.type == PKT_RESUME_ACK) {
+        LOG_INFO("Got resume Ack.");
+        HandleResumeAck(in_it->packet);
+        erasePacket = true;
       } else if (in_it->packet.hdr.type == PKT_QRY_ACK) {
-        std::cout << "Got query Ack." << std::endl;
+        LOG_INFO("Got query Ack.");
         RemoveOutboundPacket(m_threadOutQueue, PKT_QRY);
         PvtAddPrintQueueHelper(in_it->packet.data, erasePacket, false);
       } else if (in_it->packet.hdr.type == PKT_MSG_ACK) {
-        std::cout << "Got message Ack." << std::endl;
+        LOG_INFO("Got message Ack.");
         RemoveOutboundPacket(m_threadOutQueue, PKT_MSG,
                              in_it->packet.hdr.sequence);
         PvtAddPrintQueueHelper(in_it->packet.data, erasePacket, false);
       } else if (in_it->packet.hdr.type == PKT_PVT_ACK) {
-        std::cout << "Got private Ack." << std::endl;
-        RemoveOutboundPacket(m_threadOutQueue, PKT_PVT);
-        PvtAddPrintQueueHelper(in_it->packet.data, erasePacket, false);
+        LOG_INFO("Got private Ack.");
+        RemoveOutboundPacket(m_threadOutQueue, PKT_PVT,
+                             in_it->packet.hdr.sequence);
+        if (in_it->packet.hdr.flags == 0)
+          m_printQueue.push_back(print::PrintInfo(
+              "That user is not on this server.", "", false));
+        erasePacket = true;
+      } else if (in_it->packet.hdr.type == PKT_PVT) {
+        LOG_INFO("Got private message.");
+        std::string data("(private) ");
+        data.append(in_it->packet.data);
+        PvtAddPrintQueueHelper(data, erasePacket, false);
       } else if (in_it->packet.hdr.type == PKT_MSG) {
-        std::cout << "Got general message." << std::endl;
+        LOG_INFO("Got general message.");
         RemoveOutboundPacket(m_threadOutQueue, PKT_QRY);
-        PvtAddPrintQueueHelper(in_it->packet.data, erasePacket, true);
-      } else if (in_it->packet.hdr.type == PKT_LST_ACK) {
-        std::cout << "Got list users Ack." << std::endl;
-        RemoveOutboundPacket(m_threadOutQueue, PKT_LST);
+
+        // Lobby chat prints as it always has, other channels are named.
+        std::string prefix;
+        auto channel = m_channelNames.find(in_it->packet.hdr.id);
+        if (in_it->packet.hdr.id != 0 && channel != m_channelNames.end())
+          prefix = "#" + channel->second + " ";
+        PvtAddPrintQueueHelper(in_it->packet.data, erasePacket, true, prefix);
+        m_lastLogSequence = in_it->packet.hdr.sequence;
+        if (in_it->traceKey)
+          m_printTraces.push_back(
+              std::make_pair(in_it->traceKey, in_it->stamp));
+      } else if (in_it->packet.hdr.type == PKT_MSG_JOIN) {
+        LOG_INFO("Got join message.");
+        PvtAddPrintQueueHelper(in_it->packet.data, erasePacket, true,
+                               "Joined: ");
+        m_lastLogSequence = in_it->packet.hdr.sequence;
+      } else if (in_it->packet.hdr.type == PKT_MSG_LEAVE) {
+        LOG_INFO("Got leave message.");
         PvtAddPrintQueueHelper(in_it->packet.data, erasePacket, false);
+        m_lastLogSequence = in_it->packet.hdr.sequence;
+      } else if (in_it->packet.hdr.type == PKT_CHAN_JOIN_ACK) {
+        LOG_INFO("Got channel join Ack.");
+        RemoveOutboundPacket(m_threadOutQueue, PKT_CHAN_JOIN,
+                             in_it->packet.hdr.sequence);
+        m_channelNames[in_it->packet.hdr.id] = in_it->packet.data;
+        PvtAddPrintQueueHelper("Now talking in #" + std::string(in_it->packet.data),
+                               erasePacket, false);
+      } else if (in_it->packet.hdr.type == PKT_CHAN_LEAVE_ACK) {
+        LOG_INFO("Got channel leave Ack.");
+        RemoveOutboundPacket(m_threadOutQueue, PKT_CHAN_LEAVE,
+                             in_it->packet.hdr.sequence);
+        m_channelNames.erase(in_it->packet.hdr.id);
+        PvtAddPrintQueueHelper("Left #" + std::string(in_it->packet.data),
+                               erasePacket, false);
+      } else if (in_it->packet.hdr.type == PKT_LST_ACK) {
+        LOG_INFO("Got list users Ack.");
+        RemoveOutboundPacket(m_threadOutQueue, PKT_LST,
+                             in_it->packet.hdr.sequence);
+        HandleUserList(in_it->packet);
+        erasePacket = true;
       } else if (in_it->packet.hdr.type == PKT_FILE_OUT_ACK) {
-        std::cout << "Got file_out Ack." << std::endl;
+        LOG_INFO("Got file_out Ack.");
         RemoveOutboundPacket(m_threadFileOutQueue, PKT_FILE_OUT,
                              in_it->packet.hdr.sequence);
+        if (in_it->packet.hdr.flags & comms::FileTargetGone)
+          DropOutboundFile(in_it->packet.hdr.id);
         erasePacket = true;
       } else if (in_it->packet.hdr.type == PKT_FILE_IN) {
-        std::cout << "Got file_in packet." << std::endl;
+        LOG_INFO("Got file_in packet.");
         HandleFile(in_it->packet);
         erasePacket = true;
       }
@@ -1205,8 +5463,11 @@ public:
     }
 
     HandlePacketLockStepSend(m_threadOutQueue.begin(), m_threadOutQueue.end());
-    HandlePacketLockStepSend(m_threadFileOutQueue.begin(),
-                             m_threadFileOutQueue.end());
+
+    // File chunks wait until the server has our session back.
+    if (!m_resuming)
+      HandlePacketLockStepSend(m_threadFileOutQueue.begin(),
+                               m_threadFileOutQueue.end());
   }
 }; // NetClient
 
@@ -1214,27 +5475,39 @@ public:
 DWORD WINAPI ServerAcceptConnections(LPVOID param) {
   net::NetServer *server = reinterpret_cast<net::NetServer *>(param);
 
-  // Great, we have the netserver.
+  // Great, we have the netserver. Workers also take links from each other
+  // on their bus socket.
+  SOCKET listeners[] = {server->GetAcceptSocket(), server->GetBusSocket()};
   bool running = true;
   while (running) {
-    SOCKADDR_IN from;
-    int fromlen = sizeof(SOCKADDR_IN);
-
-    SOCKET clientSocket =
-        accept(server->GetAcceptSocket(), (struct sockaddr *)&from, &fromlen);
-
-    if (clientSocket != INVALID_SOCKET) {
-      // Push the socket to the list of clients.
-      char *ip{inet_ntoa(from.sin_addr)};
-      size_t len{strlen(ip)};
-      std::string ip_addy(ip, len);
-      std::cout << "Connection from : " << ip_addy.c_str() << std::endl;
-
-      unsigned long mode = 1;
-      ioctlsocket(clientSocket, FIONBIO, &mode); //  Non-blocking.
-      server->PushConnection(clientSocket, ip_addy);
+    for (auto listener : listeners) {
+      if (listener == INVALID_SOCKET)
+        continue;
+
+      SOCKADDR_IN from;
+      int fromlen = sizeof(SOCKADDR_IN);
+
+      SOCKET clientSocket =
+          accept(listener, (struct sockaddr *)&from, &fromlen);
+
+      if (clientSocket != INVALID_SOCKET) {
+        // Push the socket to the list of clients.
+        char *ip{inet_ntoa(from.sin_addr)};
+        size_t len{strlen(ip)};
+        std::string ip_addy(ip, len);
+        LOG_INFO("Connection from : %s", ip_addy);
+
+        unsigned long mode = 1;
+        ioctlsocket(clientSocket, FIONBIO, &mode); //  Non-blocking.
+        server->PushConnection(clientSocket, ip_addy);
+      }
     }
 
+    // A new process may ask for our sockets, after which we are done here.
+    server->ServeHandoff();
+    if (server->HandedOff())
+      running = false;
+
     // Try to accept a new connection every 10 ms.
     Sleep(10);
   }
@@ -1245,21 +5518,22 @@ DWORD WINAPI ServerCommsConnections(LPVOID param) {
   net::NetServer *server = reinterpret_cast<net::NetServer *>(param);
   bool running = true;
   char stack[comms::TransferSize];
+  trace::tracer.NameThread("server comms");
 
   while (running) {
     {
-      net::AutoLocker lock(server->GetMutex());
-      std::vector<net::SocketData> &clients{server->GetClients()};
-      for (auto &i : clients) {
-        comms::ReadSocketFully(i.socket, stack, i.packetData);
-        comms::QueueCompletePackets(i.packetData, i.inboundMessages);
-      }
-
-      server->HandleClosedSockets(clients);
+      net::AutoLocker lock(server->GetMutex(), __FUNCTION__);
+      server->ReadClients(stack);
+      server->HandleClosedSockets();
     }
 
+    server->ConnectPeers();
     server->ProcessMessages();
     server->SendMessages();
+    server->FlushWrites();
+    server->ExpireSessions();
+    server->Announce();
+    server->ScrapeMetrics();
 
     Sleep(10);
   }
@@ -1267,17 +5541,48 @@ DWORD WINAPI ServerCommsConnections(LPVOID param) {
   return true;
 }
 
+// The stages of a pipelined server, see net::Pipeline.
+DWORD WINAPI ServerReaderStage(LPVOID param) {
+  net::Stage *stage = reinterpret_cast<net::Stage *>(param);
+  trace::tracer.NameThread("server reader");
+  stage->server->RunReader(*stage);
+  return 0;
+}
+
+DWORD WINAPI ServerWriterStage(LPVOID param) {
+  net::Stage *stage = reinterpret_cast<net::Stage *>(param);
+  trace::tracer.NameThread("server writer");
+  stage->server->RunWriter(*stage);
+  return 0;
+}
+
 // Client thread functions.
 DWORD WINAPI ClientCommsConnection(LPVOID param) {
   net::NetClient *client{reinterpret_cast<net::NetClient *>(param)};
   char stack[comms::TransferSize];
   std::vector<char> packetData;
+  trace::tracer.NameThread("client comms");
 
   while (client->IsRunning()) {
-    comms::ReadSocketFully(client->GetSocket(), stack, packetData);
-    comms::QueueCompletePackets(packetData, client->GetThreadInQueue());
+    if (!client->IsLinkUp()) {
+      // Anything half read belonged to the dead socket.
+      packetData.clear();
+      client->TryReconnect();
+      client->ScrapeMetrics();
+      Sleep(5);
+      continue;
+    }
+
+    if (!comms::ReadSocketFully(client->GetSocket(), stack, packetData)) {
+      client->LinkDropped();
+      continue;
+    }
+    client->QueueInbound(packetData);
 
     client->ProcessQueues();
+    if (client->HasClosedSockets())
+      client->LinkDropped();
+    client->ScrapeMetrics();
 
     Sleep(5);
   }
@@ -1285,48 +5590,6 @@ DWORD WINAPI ClientCommsConnection(LPVOID param) {
   return 0;
 }
 
-// Ping the covalent server to notify it of my ip address.
-DWORD WINAPI ServerPingCovalent(LPVOID param) {
-  // Perform the post to my website where it can record my ip address.
-  while (true) {
-    SOCKET Socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    struct hostent *host;
-    host = gethostbyname("www.shaheedabdol.co.za");
-    if (host == NULL) {
-      DWORD error = WSAGetLastError();
-      std::cout << "Could not resolve host name " << error << std::endl;
-    } else {
-      SOCKADDR_IN SockAddr;
-      SockAddr.sin_port = htons(80);
-      SockAddr.sin_family = AF_INET;
-      SockAddr.sin_addr.s_addr = *((unsigned long *)host->h_addr);
-      std::cout << "Connecting...to covalent." << std::endl;
-
-      if (connect(Socket, (SOCKADDR *)(&SockAddr), sizeof(SockAddr)) != 0) {
-        std::cout << "Could not connect to covalent." << std::endl;
-      } else {
-        std::cout << "Connected to covalent, sending data.";
-        // We connected to covalent, send our ping data.
-        std::string requestHeader;
-        requestHeader.append(
-            "GET "
-            "/covalent.php?register=fs_srv_2635_6253&port=54547&"
-            "timeout=2 HTTP/1.1\r\n");
-        requestHeader.append("Host: www.shaheedabdol.co.za\r\n");
-        requestHeader.append("\r\n");
-
-        std::cout << requestHeader << std::endl;
-
-        send(Socket, requestHeader.data(), requestHeader.size(), NULL);
-      }
-    }
-    closesocket(Socket);
-    Sleep(30000);
-  }
-
-  return 0;
-}
-
 }; // namespace net
 
 #endif // _CHAT_COMMON_HPP_
\ No newline at end of file
@@ -0,0 +1,159 @@
+#ifndef _COMPLETION_READER_HPP
+#define _COMPLETION_READER_HPP
+#pragma once
+
+#include <WinSock2.h>
+#include <Windows.h>
+#include <vector>
+
+namespace iocp {
+
+// Reads sockets through an I/O completion port. Every watched socket keeps
+// one overlapped receive posted, and Poll takes a whole batch of finished
+// receives with a single call, so idle sockets cost nothing per tick.
+class CompletionReader {
+  // One per watched socket. It is handed to the kernel with each receive,
+  // so it is only freed once no receive is outstanding.
+  struct Context {
+    OVERLAPPED overlapped; // First, so a completion leads back to us.
+    SOCKET socket;
+    WSABUF buffer;
+    bool pending;
+    bool closed;
+    bool draining; // Deliver what is in flight but read no more.
+    char data[16384];
+  };
+
+  HANDLE m_port;
+  std::vector<Context *> m_contexts;
+
+  bool Post(Context *ctx) {
+    ZeroMemory(&ctx->overlapped, sizeof(ctx->overlapped));
+    ctx->buffer.buf = ctx->data;
+    ctx->buffer.len = sizeof(ctx->data);
+    DWORD flags = 0;
+    if (WSARecv(ctx->socket, &ctx->buffer, 1, NULL, &flags, &ctx->overlapped,
+                NULL) == SOCKET_ERROR &&
+        WSAGetLastError() != WSA_IO_PENDING)
+      return false;
+
+    // Finishing straight away still queues a completion.
+    ctx->pending = true;
+    return true;
+  }
+
+  void Free(Context *ctx) {
+    for (auto it = m_contexts.begin(); it != m_contexts.end(); ++it) {
+      if (*it == ctx) {
+        m_contexts.erase(it);
+        break;
+      }
+    }
+    delete ctx;
+  }
+
+public:
+  CompletionReader() : m_port(NULL) {}
+
+  ~CompletionReader() {
+    if (m_port)
+      CloseHandle(m_port);
+  }
+
+  bool Open() {
+    m_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    return m_port != NULL;
+  }
+
+  bool IsOpen() const { return m_port != NULL; }
+
+  // Start reading |s|, false when it could not be tied to the port.
+  bool Watch(SOCKET s) {
+    if (CreateIoCompletionPort(reinterpret_cast<HANDLE>(s), m_port, 0, 0) ==
+        NULL)
+      return false;
+
+    Context *ctx = new Context;
+    ctx->socket = s;
+    ctx->pending = false;
+    ctx->closed = false;
+    ctx->draining = false;
+    m_contexts.push_back(ctx);
+    if (!Post(ctx)) {
+      Free(ctx);
+      return false;
+    }
+    return true;
+  }
+
+  // Stop reading |s|, call before closing it. A receive still in flight is
+  // aborted by the close and cleaned up by the next Poll.
+  void Forget(SOCKET s) {
+    for (auto ctx : m_contexts) {
+      if (ctx->socket == s && !ctx->closed) {
+        ctx->closed = true;
+        if (!ctx->pending)
+          Free(ctx);
+        return;
+      }
+    }
+  }
+
+  // Cancel every posted receive. Data which already arrived still comes out
+  // of Poll, after which Idle is true and the sockets are left unread.
+  void Drain() {
+    for (auto ctx : m_contexts) {
+      ctx->draining = true;
+      if (ctx->pending)
+        CancelIoEx(reinterpret_cast<HANDLE>(ctx->socket), &ctx->overlapped);
+    }
+    for (size_t i = 0; i < m_contexts.size();) {
+      if (!m_contexts[i]->pending)
+        Free(m_contexts[i]);
+      else
+        ++i;
+    }
+  }
+
+  bool Idle() const { return m_contexts.empty(); }
+
+  // Take up to |max| finished receives without waiting. |sink| is called as
+  // sink(socket, data, bytes) and bytes is 0 when the socket has gone away.
+  // Returns how many completions were taken.
+  template <typename Sink> unsigned long Poll(unsigned long max, Sink sink) {
+    OVERLAPPED_ENTRY entries[64];
+    ULONG count = 0;
+    if (max > 64)
+      max = 64;
+    if (!GetQueuedCompletionStatusEx(m_port, entries, max, &count, 0, FALSE))
+      return 0; // Nothing finished.
+
+    for (ULONG i = 0; i < count; ++i) {
+      Context *ctx = reinterpret_cast<Context *>(entries[i].lpOverlapped);
+      ctx->pending = false;
+      if (ctx->closed) {
+        Free(ctx);
+        continue;
+      }
+
+      DWORD bytes = entries[i].dwNumberOfBytesTransferred;
+      if (bytes != 0)
+        sink(ctx->socket, ctx->data, bytes);
+      if (ctx->draining) {
+        Free(ctx);
+        continue;
+      }
+      if (bytes != 0 && Post(ctx))
+        continue;
+
+      // Closed or failed, the owner closes the socket and we are done.
+      sink(ctx->socket, ctx->data, 0);
+      Free(ctx);
+    }
+    return count;
+  }
+};
+
+} // namespace iocp
+
+#endif // _COMPLETION_READER_HPP
@@ -0,0 +1,413 @@
+#ifndef _DISCOVERY_HPP
+#define _DISCOVERY_HPP
+#pragma once
+
+#include <ws2tcpip.h>
+#include <WinSock2.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace discovery {
+
+// Servers announce themselves on the LAN on the port just below the chat
+// port, the same one the old broadcast prototype used.
+const unsigned short LanPort = 54546;
+const char LanAnnounce[] = "chatmium ";
+const char LanProbe[] = "chatmium?";
+
+const DWORD ResolveTimeoutMillis = 5000;
+const DWORD RequestTimeoutMillis = 10000;
+const DWORD LanIntervalMillis = 5000;
+const DWORD LanAnswerMillis = 1000; // At most one answer to probes a second.
+
+// Something that tells the world where the server is. Tick is called from
+// the server event loop and must never block.
+class Announcer {
+public:
+  virtual ~Announcer() {}
+  virtual void Tick(DWORD now) = 0;
+};
+
+// Looks a host name up on a throwaway thread, so the event loop never waits
+// on DNS. The lookup is shared with the thread and freed by whichever lets
+// go last, so one given up on after the timeout cleans up after itself.
+class Resolver {
+  struct Lookup {
+    volatile long refs;
+    volatile long done;
+    std::string host;
+    unsigned long address; // Network order, INADDR_NONE when not found.
+  };
+
+  Lookup *m_lookup;
+  DWORD m_deadline;
+
+  static void Release(Lookup *lookup) {
+    if (InterlockedDecrement(&lookup->refs) == 0)
+      delete lookup;
+  }
+
+  static DWORD WINAPI Run(LPVOID param) {
+    Lookup *lookup = reinterpret_cast<Lookup *>(param);
+    addrinfo hints;
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *result = nullptr;
+    if (getaddrinfo(lookup->host.c_str(), NULL, &hints, &result) == 0 &&
+        result) {
+      lookup->address =
+          reinterpret_cast<SOCKADDR_IN *>(result->ai_addr)->sin_addr.s_addr;
+      freeaddrinfo(result);
+    }
+    InterlockedExchange(&lookup->done, 1);
+    Release(lookup);
+    return 0;
+  }
+
+public:
+  enum State { Idle, Busy, Found, Failed };
+
+  Resolver() : m_lookup(nullptr), m_deadline(0) {}
+  ~Resolver() { Cancel(); }
+
+  void Start(const std::string &host, DWORD now) {
+    Cancel();
+    m_lookup = new Lookup;
+    m_lookup->refs = 1;
+    m_lookup->done = 0;
+    m_lookup->host = host;
+    m_lookup->address = inet_addr(host.c_str());
+    m_deadline = now + ResolveTimeoutMillis;
+
+    // Addresses need no lookup.
+    if (m_lookup->address != INADDR_NONE) {
+      m_lookup->done = 1;
+      return;
+    }
+
+    InterlockedIncrement(&m_lookup->refs);
+    HANDLE thread = CreateThread(NULL, 0, Run, m_lookup, 0, NULL);
+    if (thread == NULL) {
+      m_lookup->done = 1;
+      Release(m_lookup);
+    } else {
+      CloseHandle(thread);
+    }
+  }
+
+  void Cancel() {
+    if (m_lookup) {
+      Release(m_lookup);
+      m_lookup = nullptr;
+    }
+  }
+
+  // |address| is set, in network order, once the lookup is Found.
+  State Poll(DWORD now, unsigned long &address) {
+    if (!m_lookup)
+      return Idle;
+    if (InterlockedCompareExchange(&m_lookup->done, 1, 1)) {
+      address = m_lookup->address;
+      Cancel();
+      return address == INADDR_NONE ? Failed : Found;
+    }
+    if (static_cast<int>(now - m_deadline) >= 0) {
+      Cancel();
+      return Failed;
+    }
+    return Busy;
+  }
+};
+
+// Registers with a web server by fetching |path| every so often, which is
+// how the server has always let the world know where it is. Every step is
+// non-blocking and the whole request gives up after RequestTimeoutMillis.
+class HttpRegistrar : public Announcer {
+  enum Step { Waiting, Resolving, Connecting, Sending, Reading };
+
+  std::string m_host;
+  unsigned short m_port;
+  std::string m_request;
+  DWORD m_interval;
+
+  Step m_step;
+  Resolver m_resolver;
+  SOCKET m_socket;
+  DWORD m_next;
+  DWORD m_deadline;
+  size_t m_sent;
+  std::string m_response;
+
+  void Finish(const char *problem) {
+    if (problem)
+      std::cout << "Registrar " << m_host.c_str() << ": " << problem
+                << std::endl;
+    if (m_socket != INVALID_SOCKET)
+      ::closesocket(m_socket);
+    m_socket = INVALID_SOCKET;
+    m_step = Waiting;
+  }
+
+  void Connect(unsigned long address, DWORD now) {
+    SOCKADDR_IN addr;
+    ZeroMemory(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(m_port);
+    addr.sin_addr.s_addr = address;
+
+    m_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (m_socket == INVALID_SOCKET)
+      return Finish("could not create socket");
+    unsigned long mode = 1;
+    ioctlsocket(m_socket, FIONBIO, &mode); //  Non-blocking.
+    if (connect(m_socket, (LPSOCKADDR)&addr, sizeof(addr)) == SOCKET_ERROR &&
+        WSAGetLastError() != WSAEWOULDBLOCK)
+      return Finish("could not connect");
+
+    m_deadline = now + RequestTimeoutMillis;
+    m_step = Connecting;
+  }
+
+  // Poll the connect without waiting.
+  void CheckConnected() {
+    fd_set writable, failed;
+    FD_ZERO(&writable);
+    FD_ZERO(&failed);
+    FD_SET(m_socket, &writable);
+    FD_SET(m_socket, &failed);
+    timeval poll = {0, 0};
+    if (select(0, NULL, &writable, &failed, &poll) <= 0)
+      return;
+    if (FD_ISSET(m_socket, &failed))
+      return Finish("could not connect");
+    if (FD_ISSET(m_socket, &writable)) {
+      m_sent = 0;
+      m_response.clear();
+      m_step = Sending;
+    }
+  }
+
+  void Send() {
+    int sent = send(m_socket, m_request.data() + m_sent,
+                    static_cast<int>(m_request.length() - m_sent), 0);
+    if (sent == SOCKET_ERROR) {
+      if (WSAGetLastError() != WSAEWOULDBLOCK)
+        Finish("could not send");
+      return;
+    }
+    m_sent += sent;
+    if (m_sent == m_request.length())
+      m_step = Reading;
+  }
+
+  // Only the status line matters.
+  void Read() {
+    char buffer[512];
+    int got = recv(m_socket, buffer, sizeof(buffer), 0);
+    if (got == SOCKET_ERROR) {
+      if (WSAGetLastError() != WSAEWOULDBLOCK)
+        Finish("no response");
+      return;
+    }
+    m_response.append(buffer, got);
+    std::string::size_type end = m_response.find("\r\n");
+    if (end == std::string::npos && got != 0 && m_response.length() < 512)
+      return;
+
+    std::string::size_type code = m_response.find(' ');
+    if (code == std::string::npos || code + 1 >= m_response.length() ||
+        m_response[code + 1] != '2') {
+      std::string status(m_response.substr(0, end));
+      std::cout << "Registrar " << m_host.c_str() << " said: "
+                << status.c_str() << std::endl;
+    }
+    Finish(nullptr);
+  }
+
+public:
+  HttpRegistrar(const std::string &host, unsigned short port,
+                const std::string &path, DWORD interval)
+      : m_host(host), m_port(port), m_interval(interval), m_step(Waiting),
+        m_socket(INVALID_SOCKET), m_next(GetTickCount()), m_deadline(0),
+        m_sent(0) {
+    m_request.append("GET " + path + " HTTP/1.1\r\n");
+    m_request.append("Host: " + host + "\r\n");
+    m_request.append("Connection: close\r\n");
+    m_request.append("\r\n");
+  }
+
+  ~HttpRegistrar() { Finish(nullptr); }
+
+  virtual void Tick(DWORD now) {
+    if (m_step != Waiting && m_step != Resolving &&
+        static_cast<int>(now - m_deadline) >= 0)
+      return Finish("timed out");
+
+    switch (m_step) {
+    case Waiting:
+      if (static_cast<int>(now - m_next) < 0)
+        return;
+      m_next = now + m_interval;
+      m_resolver.Start(m_host, now);
+      m_step = Resolving;
+      break;
+
+    case Resolving: {
+      unsigned long address = INADDR_NONE;
+      Resolver::State state = m_resolver.Poll(now, address);
+      if (state == Resolver::Found)
+        Connect(address, now);
+      else if (state != Resolver::Busy)
+        Finish("could not resolve host name");
+    } break;
+
+    case Connecting:
+      CheckConnected();
+      break;
+
+    case Sending:
+      Send();
+      break;
+
+    case Reading:
+      Read();
+      break;
+    }
+  }
+};
+
+// Opens the UDP socket both ends of LAN discovery share. Several servers and
+// clients on one machine can all listen, and broadcasts reach every one.
+inline SOCKET OpenLanSocket(unsigned short port) {
+  SOCKET s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (s == INVALID_SOCKET)
+    return s;
+
+  BOOL on = TRUE;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on));
+  setsockopt(s, SOL_SOCKET, SO_BROADCAST, (const char *)&on, sizeof(on));
+
+  SOCKADDR_IN addr;
+  ZeroMemory(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(s, (LPSOCKADDR)&addr, sizeof(addr)) == SOCKET_ERROR) {
+    ::closesocket(s);
+    return INVALID_SOCKET;
+  }
+
+  unsigned long mode = 1;
+  ioctlsocket(s, FIONBIO, &mode); //  Non-blocking.
+  return s;
+}
+
+inline void Broadcast(SOCKET s, unsigned short port, const std::string &data) {
+  SOCKADDR_IN addr;
+  ZeroMemory(&addr, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = INADDR_BROADCAST;
+  sendto(s, data.data(), static_cast<int>(data.length()), 0,
+         (LPSOCKADDR)&addr, sizeof(addr));
+}
+
+// Broadcasts the chat port every LanIntervalMillis and straight away when a
+// client probes, so nobody needs the internet to find a server next door.
+class LanAnnouncer : public Announcer {
+  SOCKET m_socket;
+  unsigned short m_lanPort;
+  std::string m_announce;
+  DWORD m_next;
+  DWORD m_lastAnswer;
+
+public:
+  LanAnnouncer(unsigned short chatPort, unsigned short lanPort = LanPort)
+      : m_lanPort(lanPort), m_next(GetTickCount()),
+        m_lastAnswer(GetTickCount() - LanAnswerMillis) {
+    m_announce = LanAnnounce + std::to_string(chatPort);
+    m_socket = OpenLanSocket(lanPort);
+    if (m_socket == INVALID_SOCKET)
+      std::cout << "Could not open the LAN announce port." << std::endl;
+  }
+
+  ~LanAnnouncer() {
+    if (m_socket != INVALID_SOCKET)
+      ::closesocket(m_socket);
+  }
+
+  virtual void Tick(DWORD now) {
+    if (m_socket == INVALID_SOCKET)
+      return;
+
+    bool probed = false;
+    char buffer[64];
+    int got;
+    while ((got = recvfrom(m_socket, buffer, sizeof(buffer), 0, NULL, NULL)) >
+           0) {
+      if (std::string(buffer, got) == LanProbe)
+        probed = true;
+    }
+
+    if (probed && now - m_lastAnswer >= LanAnswerMillis)
+      m_next = now;
+    if (static_cast<int>(now - m_next) < 0)
+      return;
+
+    Broadcast(m_socket, m_lanPort, m_announce);
+    m_lastAnswer = now;
+    m_next = now + LanIntervalMillis;
+  }
+};
+
+// A server heard on the LAN.
+struct LanServer {
+  std::string address;
+  unsigned short port;
+};
+
+// Listens for servers on the LAN, waiting at most |waitMillis| for them to
+// answer a probe.
+inline void FindLanServers(DWORD waitMillis, std::vector<LanServer> &servers,
+                           unsigned short lanPort = LanPort) {
+  SOCKET s = OpenLanSocket(lanPort);
+  if (s == INVALID_SOCKET)
+    return;
+
+  Broadcast(s, lanPort, LanProbe);
+  DWORD deadline = GetTickCount() + waitMillis;
+  while (static_cast<int>(GetTickCount() - deadline) < 0) {
+    char buffer[64];
+    SOCKADDR_IN from;
+    int fromlen = sizeof(from);
+    int got = recvfrom(s, buffer, sizeof(buffer) - 1, 0, (LPSOCKADDR)&from,
+                       &fromlen);
+    if (got <= 0) {
+      Sleep(10);
+      continue;
+    }
+
+    std::string data(buffer, got);
+    const size_t prefix = sizeof(LanAnnounce) - 1;
+    if (data.compare(0, prefix, LanAnnounce) != 0 ||
+        data.length() == prefix || data.length() > prefix + 5 ||
+        data.find_first_not_of("0123456789", prefix) != std::string::npos)
+      continue;
+
+    LanServer server{inet_ntoa(from.sin_addr),
+                     static_cast<unsigned short>(std::stoul(data.substr(prefix)))};
+    bool known = false;
+    for (auto &found : servers)
+      known = known || (found.address == server.address &&
+                        found.port == server.port);
+    if (!known)
+      servers.push_back(server);
+  }
+  ::closesocket(s);
+}
+
+} // namespace discovery
+
+#endif // _DISCOVERY_HPP
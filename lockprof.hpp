@@ -0,0 +1,182 @@
+#ifndef _LOCKPROF_HPP
+#define _LOCKPROF_HPP
+#pragma once
+
+#include <Windows.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace lockprof {
+
+// Distinct lock and call site pairs we keep numbers for, any past this are
+// counted together under one overflow slot.
+const LONG MaxSites = 256;
+
+// Timings are in performance counter ticks until reported.
+struct Site {
+  volatile LONG state; // 0 free, 1 being claimed, 2 in use.
+  const CRITICAL_SECTION *lock;
+  const char *site;
+  volatile LONGLONG acquisitions;
+  volatile LONGLONG contended; // Had to wait for another thread.
+  volatile LONGLONG reentered; // Already held by this thread.
+  volatile LONGLONG waitTicks;
+  volatile LONGLONG holdTicks;
+  volatile LONGLONG maxWaitTicks;
+  volatile LONGLONG maxHoldTicks;
+};
+
+class Profiler {
+  volatile LONG m_on;
+  LARGE_INTEGER m_frequency;
+  LARGE_INTEGER m_since; // Start of the current report.
+  Site m_sites[MaxSites + 1];
+
+  struct Name {
+    const CRITICAL_SECTION *lock;
+    const char *name;
+  };
+  std::vector<Name> m_names; // Filled in before the threads start.
+
+  static void Max(volatile LONGLONG &max, LONGLONG value) {
+    LONGLONG seen = max;
+    while (value > seen) {
+      LONGLONG was = InterlockedCompareExchange64(&max, value, seen);
+      if (was == seen)
+        break;
+      seen = was;
+    }
+  }
+
+  const char *NameOf(const CRITICAL_SECTION *lock) const {
+    for (auto &n : m_names) {
+      if (n.lock == lock)
+        return n.name;
+    }
+    return "unnamed";
+  }
+
+  double Micros(LONGLONG ticks) const {
+    return ticks * 1000000.0 / m_frequency.QuadPart;
+  }
+
+public:
+  Profiler() : m_on(0) {
+    QueryPerformanceFrequency(&m_frequency);
+    QueryPerformanceCounter(&m_since);
+    ZeroMemory(const_cast<Site *>(m_sites), sizeof(m_sites));
+    m_sites[MaxSites].state = 2; // The overflow, always in use.
+  }
+
+  bool On() const { return m_on != 0; }
+
+  void Start() {
+    QueryPerformanceCounter(&m_since);
+    InterlockedExchange(&m_on, 1);
+  }
+
+  // Report |lock| as |name|, which must be a literal. Locks which share a
+  // name, like those of several workers, are reported together.
+  void NameLock(const CRITICAL_SECTION *lock, const char *name) {
+    Name n{lock, name};
+    m_names.push_back(n);
+  }
+
+  // The slot for |site| taking |lock|, claimed the first time it is seen.
+  Site &Find(const CRITICAL_SECTION *lock, const char *site) {
+    size_t hash = (reinterpret_cast<size_t>(lock) >> 4) * 31 +
+                  (reinterpret_cast<size_t>(site) >> 2);
+    for (LONG probe = 0; probe < MaxSites; ++probe) {
+      Site &s = m_sites[(hash + probe) % MaxSites];
+      if (s.state == 0 && InterlockedCompareExchange(&s.state, 1, 0) == 0) {
+        s.lock = lock;
+        s.site = site;
+        InterlockedExchange(&s.state, 2);
+        return s;
+      }
+      while (s.state == 1)
+        YieldProcessor();
+      if (s.lock == lock && s.site == site)
+        return s;
+    }
+    return m_sites[MaxSites];
+  }
+
+  void Acquired(Site &s, LONGLONG waited, bool contended, bool reentered) {
+    InterlockedIncrement64(&s.acquisitions);
+    if (reentered) {
+      InterlockedIncrement64(&s.reentered);
+      return;
+    }
+    if (contended) {
+      InterlockedIncrement64(&s.contended);
+      InterlockedExchangeAdd64(&s.waitTicks, waited);
+      Max(s.maxWaitTicks, waited);
+    }
+  }
+
+  void Released(Site &s, LONGLONG held) {
+    InterlockedExchangeAdd64(&s.holdTicks, held);
+    Max(s.maxHoldTicks, held);
+  }
+
+  // A table by lock then call site, most waited on first, covering the
+  // time since the last report when |reset|.
+  void Report(std::string &out, bool reset) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    double wall = Micros(now.QuadPart - m_since.QuadPart);
+    wall = wall > 0 ? wall : 1;
+
+    std::vector<Site *> used;
+    for (auto &s : m_sites) {
+      if (s.state == 2 && s.acquisitions)
+        used.push_back(&s);
+    }
+    std::sort(used.begin(), used.end(), [this](Site *a, Site *b) {
+      int order = strcmp(NameOf(a->lock), NameOf(b->lock));
+      return order != 0 ? order < 0 : a->waitTicks > b->waitTicks;
+    });
+
+    char line[256];
+    sprintf_s(line, sizeof(line), "%-10s %-34s %9s %6s %9s %9s %6s %9s\n",
+              "lock", "site", "acquired", "cont%", "wait_us", "max_wait",
+              "held%", "max_held");
+    out.append(line);
+    for (auto s : used) {
+      LONGLONG count = s->acquisitions - s->reentered;
+      count = count ? count : 1;
+      sprintf_s(line, sizeof(line),
+                "%-10s %-34s %9lld %6.1f %9.0f %9.0f %6.1f %9.0f\n",
+                NameOf(s->lock),
+                s == &m_sites[MaxSites] ? "(overflow)"
+                                        : s->site ? s->site : "(unknown)",
+                s->acquisitions, s->contended * 100.0 / count,
+                Micros(s->waitTicks), Micros(s->maxWaitTicks),
+                Micros(s->holdTicks) * 100.0 / wall, Micros(s->maxHoldTicks));
+      out.append(line);
+
+      if (reset) {
+        InterlockedExchange64(&s->acquisitions, 0);
+        InterlockedExchange64(&s->contended, 0);
+        InterlockedExchange64(&s->reentered, 0);
+        InterlockedExchange64(&s->waitTicks, 0);
+        InterlockedExchange64(&s->holdTicks, 0);
+        InterlockedExchange64(&s->maxWaitTicks, 0);
+        InterlockedExchange64(&s->maxHoldTicks, 0);
+      }
+    }
+    if (reset)
+      m_since = now;
+  }
+};
+
+// One profiler for the process, off until Start.
+Profiler profiler;
+
+} // namespace lockprof
+
+#endif // _LOCKPROF_HPP
@@ -0,0 +1,327 @@
+#ifndef _MESSAGE_LOG_HPP
+#define _MESSAGE_LOG_HPP
+#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace msglog {
+
+// Every routed chat message is appended to a run of fixed size segment files
+// which stay mapped into memory. Records hold the frame exactly as it goes
+// out on the wire, so a backlog is copied from the mapped pages as it is.
+//
+// Segment layout: records packed back to back, the rest of the file zero.
+// Each record is a RecordHeader followed by the frame, padded to 4 bytes.
+// The sequence is written last, so a record with sequence 0 marks the end.
+
+struct RecordHeader {
+  unsigned int sequence;
+  unsigned int channel;
+  unsigned int bytes;
+};
+
+// A record as handed out by ReadSince, |frame| points into a mapped view and
+// stays valid until an Append rolls the oldest segment out.
+struct Record {
+  unsigned int sequence;
+  unsigned int channel;
+  const char *frame;
+  unsigned int bytes;
+};
+
+// One index entry per this many records.
+const unsigned int IndexInterval = 64;
+
+class MessageLog {
+  struct Segment {
+    unsigned int number;
+    HANDLE file;
+    HANDLE mapping;
+    char *view;
+    unsigned int used;
+    unsigned int firstSequence;
+  };
+
+  struct IndexEntry {
+    unsigned int sequence;
+    unsigned int segment; // Segment number, not position.
+    unsigned int offset;
+  };
+
+  std::string m_dir;
+  unsigned int m_segmentBytes;
+  unsigned int m_maxSegments;
+
+  std::vector<Segment> m_segments; // Oldest first.
+  std::vector<IndexEntry> m_index; // Sparse, ascending by sequence.
+  unsigned int m_nextSequence;
+  unsigned int m_sinceIndexed;
+
+  std::string SegmentPath(unsigned int number) const {
+    std::string path(m_dir);
+    path.append("segment_");
+    path.append(std::to_string(number));
+    path.append(".log");
+    return path;
+  }
+
+  static unsigned int RecordSize(unsigned int bytes) {
+    return sizeof(RecordHeader) + ((bytes + 3) & ~3u);
+  }
+
+  bool MapSegment(Segment &segment, DWORD disposition) {
+    segment.file = CreateFile(SegmentPath(segment.number).c_str(),
+                              GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+                              NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (segment.file == INVALID_HANDLE_VALUE)
+      return false;
+
+    // Mapping past the end of the file grows it with zeros.
+    segment.mapping = CreateFileMapping(segment.file, NULL, PAGE_READWRITE, 0,
+                                        m_segmentBytes, NULL);
+    if (segment.mapping == NULL) {
+      CloseHandle(segment.file);
+      return false;
+    }
+
+    segment.view = reinterpret_cast<char *>(
+        MapViewOfFile(segment.mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+    if (segment.view == NULL) {
+      CloseHandle(segment.mapping);
+      CloseHandle(segment.file);
+      return false;
+    }
+    return true;
+  }
+
+  void UnmapSegment(Segment &segment) {
+    UnmapViewOfFile(segment.view);
+    CloseHandle(segment.mapping);
+    CloseHandle(segment.file);
+  }
+
+  // Walk the records of a segment we found on disk, indexing as we go.
+  void RecoverSegment(Segment &segment) {
+    segment.used = 0;
+    segment.firstSequence = 0;
+    while (segment.used + sizeof(RecordHeader) <= m_segmentBytes) {
+      const RecordHeader *hdr =
+          reinterpret_cast<const RecordHeader *>(segment.view + segment.used);
+      if (hdr->sequence == 0 ||
+          segment.used + RecordSize(hdr->bytes) > m_segmentBytes)
+        break;
+
+      if (segment.firstSequence == 0)
+        segment.firstSequence = hdr->sequence;
+      NoteRecord(hdr->sequence, segment.number, segment.used);
+      m_nextSequence = hdr->sequence + 1;
+      segment.used += RecordSize(hdr->bytes);
+    }
+  }
+
+  void NoteRecord(unsigned int sequence, unsigned int segment,
+                  unsigned int offset) {
+    if (m_sinceIndexed++ % IndexInterval == 0) {
+      IndexEntry entry = {sequence, segment, offset};
+      m_index.push_back(entry);
+    }
+  }
+
+  bool StartSegment() {
+    Segment segment = {m_segments.empty() ? 1 : m_segments.back().number + 1};
+    if (!MapSegment(segment, CREATE_ALWAYS))
+      return false;
+
+    segment.used = 0;
+    segment.firstSequence = m_nextSequence;
+    m_segments.push_back(segment);
+    m_sinceIndexed = 0;
+
+    // Retention, the oldest segment goes along with its index entries.
+    while (m_segments.size() > m_maxSegments) {
+      Segment &oldest = m_segments.front();
+      while (!m_index.empty() && m_index.front().segment == oldest.number)
+        m_index.erase(m_index.begin());
+      UnmapSegment(oldest);
+      DeleteFile(SegmentPath(oldest.number).c_str());
+      m_segments.erase(m_segments.begin());
+    }
+    return true;
+  }
+
+  Segment *FindSegment(unsigned int number) {
+    for (auto &s : m_segments) {
+      if (s.number == number)
+        return &s;
+    }
+    return nullptr;
+  }
+
+  static bool Wanted(const std::vector<unsigned int> &channels,
+                     unsigned int channel) {
+    return std::find(channels.begin(), channels.end(), channel) !=
+           channels.end();
+  }
+
+  // Append the records in |channels| with sequences from |start| up to but
+  // not including |end|, scanning from |entry|, until |out| holds |count|.
+  void Scan(const IndexEntry &entry, unsigned int start, unsigned int end,
+            const std::vector<unsigned int> &channels, size_t count,
+            std::vector<Record> &out) {
+    unsigned int number = entry.segment;
+    unsigned int offset = entry.offset;
+    Segment *segment = FindSegment(number);
+    while (segment && out.size() < count) {
+      if (offset + sizeof(RecordHeader) > m_segmentBytes) {
+        segment = FindSegment(++number);
+        offset = 0;
+        continue;
+      }
+
+      const RecordHeader *hdr =
+          reinterpret_cast<const RecordHeader *>(segment->view + offset);
+      if (hdr->sequence == 0) {
+        segment = FindSegment(++number);
+        offset = 0;
+        continue;
+      }
+      if (hdr->sequence >= end)
+        break;
+
+      if (hdr->sequence >= start && Wanted(channels, hdr->channel)) {
+        Record record = {hdr->sequence, hdr->channel,
+                         segment->view + offset + sizeof(RecordHeader),
+                         hdr->bytes};
+        out.push_back(record);
+      }
+      offset += RecordSize(hdr->bytes);
+    }
+  }
+
+public:
+  MessageLog()
+      : m_segmentBytes(0), m_maxSegments(0), m_nextSequence(1),
+        m_sinceIndexed(0) {}
+
+  ~MessageLog() { Close(); }
+
+  // Open the log in |dir|, picking up whatever segments are already there.
+  bool Open(const std::string &dir, unsigned int segmentBytes,
+            unsigned int maxSegments) {
+    m_dir = dir;
+    m_segmentBytes = segmentBytes;
+    m_maxSegments = maxSegments;
+    CreateDirectory(m_dir.c_str(), NULL);
+
+    std::vector<unsigned int> numbers;
+    WIN32_FIND_DATA found;
+    HANDLE find = FindFirstFile((m_dir + "segment_*.log").c_str(), &found);
+    if (find != INVALID_HANDLE_VALUE) {
+      do {
+        numbers.push_back(
+            static_cast<unsigned int>(std::stoul(std::string(found.cFileName + 8))));
+      } while (FindNextFile(find, &found));
+      FindClose(find);
+    }
+    std::sort(numbers.begin(), numbers.end());
+
+    for (auto number : numbers) {
+      Segment segment = {number};
+      if (!MapSegment(segment, OPEN_EXISTING))
+        continue;
+      m_sinceIndexed = 0;
+      RecoverSegment(segment);
+      m_segments.push_back(segment);
+    }
+
+    if (m_segments.empty() && !StartSegment())
+      return false;
+
+    std::cout << "Message log: " << m_segments.size() << " segments, next ["
+              << m_nextSequence << "]" << std::endl;
+    return true;
+  }
+
+  void Close() {
+    for (auto &s : m_segments)
+      UnmapSegment(s);
+    m_segments.clear();
+    m_index.clear();
+  }
+
+  bool IsOpen() const { return !m_segments.empty(); }
+  unsigned int NextSequence() const { return m_nextSequence; }
+  unsigned int LastSequence() const { return m_nextSequence - 1; }
+
+  // Append |frame| under the sequence from NextSequence().
+  bool Append(unsigned int channel, const char *frame, unsigned int bytes) {
+    if (!IsOpen() || RecordSize(bytes) > m_segmentBytes)
+      return false;
+
+    if (m_segments.back().used + RecordSize(bytes) > m_segmentBytes &&
+        !StartSegment())
+      return false;
+
+    Segment &segment = m_segments.back();
+    RecordHeader *hdr =
+        reinterpret_cast<RecordHeader *>(segment.view + segment.used);
+    memcpy(segment.view + segment.used + sizeof(RecordHeader), frame, bytes);
+    hdr->channel = channel;
+    hdr->bytes = bytes;
+    MemoryBarrier();
+    hdr->sequence = m_nextSequence;
+
+    NoteRecord(m_nextSequence, segment.number, segment.used);
+    segment.used += RecordSize(bytes);
+    ++m_nextSequence;
+    return true;
+  }
+
+  // Collect up to |count| records in |channels| after |since|. When |since|
+  // is 0 the last |count| records in |channels| are returned instead.
+  void ReadSince(unsigned int since, unsigned int count,
+                 const std::vector<unsigned int> &channels,
+                 std::vector<Record> &out) {
+    if (!IsOpen() || count == 0 || LastSequence() == 0 || m_index.empty() ||
+        channels.empty())
+      return;
+
+    if (since != 0 && since <= LastSequence()) {
+      // The last index entry at or before |start| tells us where to scan
+      // from.
+      unsigned int start = since + 1;
+      auto entry = std::upper_bound(
+          m_index.begin(), m_index.end(), start,
+          [](unsigned int seq, const IndexEntry &e) { return seq < e.sequence; });
+      if (entry != m_index.begin())
+        --entry;
+      Scan(*entry, start, LastSequence() + 1, channels, count, out);
+      return;
+    }
+
+    // Newest first, one index interval at a time, until we have enough. An
+    // interval is at most IndexInterval records, so it is scanned whole.
+    std::vector<Record> newer, chunk;
+    unsigned int end = LastSequence() + 1;
+    for (size_t i = m_index.size(); i-- > 0 && newer.size() < count;) {
+      chunk.clear();
+      Scan(m_index[i], m_index[i].sequence, end, channels, IndexInterval,
+           chunk);
+      chunk.insert(chunk.end(), newer.begin(), newer.end());
+      newer.swap(chunk);
+      end = m_index[i].sequence;
+    }
+    size_t skip = newer.size() > count ? newer.size() - count : 0;
+    out.insert(out.end(), newer.begin() + skip, newer.end());
+  }
+};
+
+} // namespace msglog
+
+#endif // _MESSAGE_LOG_HPP
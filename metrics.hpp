@@ -0,0 +1,313 @@
+#ifndef _METRICS_HPP
+#define _METRICS_HPP
+#pragma once
+
+#include <WinSock2.h>
+#include <Windows.h>
+#include <string>
+#include <vector>
+
+namespace metrics {
+
+// Every update is a single interlocked operation, so any thread counts
+// without holding a lock and a scrape reads whatever is there.
+
+class Counter {
+  volatile LONGLONG m_value;
+
+public:
+  Counter() : m_value(0) {}
+  void Add(LONGLONG n) { InterlockedExchangeAdd64(&m_value, n); }
+  void Increment() { InterlockedIncrement64(&m_value); }
+  LONGLONG Value() const { return m_value; }
+};
+
+class Gauge {
+  volatile LONGLONG m_value;
+
+public:
+  Gauge() : m_value(0) {}
+  void Set(LONGLONG n) { InterlockedExchange64(&m_value, n); }
+  LONGLONG Value() const { return m_value; }
+};
+
+// An HDR style histogram of 32 bit values. Values below 16 get a bucket
+// each, above that every power of two is split into 16 buckets, so what a
+// bucket stands for is never more than 1/16th off whatever the magnitude.
+class Histogram {
+  static const unsigned int SubBuckets = 16;
+  static const unsigned int SubBits = 4;
+  static const unsigned int Buckets = SubBuckets + (32 - SubBits) * SubBuckets;
+
+  volatile LONGLONG m_counts[Buckets];
+  volatile LONGLONG m_count;
+  volatile LONGLONG m_sum;
+
+  static unsigned int Bucket(unsigned int value) {
+    if (value < SubBuckets)
+      return value;
+    unsigned int top = SubBits;
+    while (top < 31 && (value >> (top + 1)) != 0)
+      ++top;
+    unsigned int sub = (value >> (top - SubBits)) - SubBuckets;
+    return SubBuckets + (top - SubBits) * SubBuckets + sub;
+  }
+
+public:
+  // The largest value which lands in |bucket|.
+  static unsigned long long Upper(unsigned int bucket) {
+    if (bucket < SubBuckets)
+      return bucket;
+    unsigned int top = (bucket - SubBuckets) / SubBuckets + SubBits;
+    unsigned long long sub = (bucket - SubBuckets) % SubBuckets;
+    return ((SubBuckets + sub + 1) << (top - SubBits)) - 1;
+  }
+
+  Histogram() : m_count(0), m_sum(0) {
+    for (auto &c : m_counts)
+      c = 0;
+  }
+
+  void Record(unsigned int value) {
+    InterlockedIncrement64(&m_counts[Bucket(value)]);
+    InterlockedIncrement64(&m_count);
+    InterlockedExchangeAdd64(&m_sum, value);
+  }
+
+  LONGLONG Count() const { return m_count; }
+  LONGLONG Sum() const { return m_sum; }
+
+  // How many values are at most |bound|, to within a bucket.
+  LONGLONG CountUpTo(unsigned long long bound) const {
+    LONGLONG total = 0;
+    for (unsigned int b = 0; b < Buckets && Upper(b) <= bound; ++b)
+      total += m_counts[b];
+    return total;
+  }
+
+  // The value below which |q| of the recorded values fall.
+  unsigned long long Quantile(double q) const {
+    LONGLONG want = static_cast<LONGLONG>(q * m_count);
+    LONGLONG seen = 0;
+    for (unsigned int b = 0; b < Buckets; ++b) {
+      seen += m_counts[b];
+      if (seen > want)
+        return Upper(b);
+    }
+    return 0;
+  }
+};
+
+// Histogram buckets as scraped, in microseconds.
+const unsigned long long ScrapeBounds[] = {100,    250,    500,    1000,
+                                           2500,   5000,   10000,  25000,
+                                           50000,  100000, 250000, 500000,
+                                           1000000};
+
+// Names the metrics for scraping. Everything is registered before any
+// thread starts, after which the registry is only read.
+class Registry {
+  enum Kind { KindCounter, KindGauge, KindHistogram };
+
+  struct Entry {
+    std::string name;
+    std::string help;
+    std::string labels; // Without the braces, like type="msg".
+    Kind kind;
+    const void *metric;
+  };
+
+  std::vector<Entry> m_entries;
+
+  void Add(const std::string &name, const std::string &help,
+           const std::string &labels, Kind kind, const void *metric) {
+    Entry entry{name, help, labels, kind, metric};
+    m_entries.push_back(entry);
+  }
+
+  static std::string Series(const std::string &name, const std::string &labels,
+                            const std::string &extra = "") {
+    std::string series(name);
+    if (labels.empty() && extra.empty())
+      return series;
+    series.append("{" + labels);
+    if (!labels.empty() && !extra.empty())
+      series.append(",");
+    series.append(extra + "}");
+    return series;
+  }
+
+public:
+  // Series of one name go together, so add them one after the other.
+  void Add(const std::string &name, const std::string &help,
+           const Counter &counter, const std::string &labels = "") {
+    Add(name, help, labels, KindCounter, &counter);
+  }
+  void Add(const std::string &name, const std::string &help,
+           const Gauge &gauge, const std::string &labels = "") {
+    Add(name, help, labels, KindGauge, &gauge);
+  }
+  void Add(const std::string &name, const std::string &help,
+           const Histogram &histogram, const std::string &labels = "") {
+    Add(name, help, labels, KindHistogram, &histogram);
+  }
+
+  // Write everything out in the Prometheus text format.
+  void Render(std::string &out) const {
+    static const char *types[] = {"counter", "gauge", "histogram"};
+    for (size_t i = 0; i < m_entries.size(); ++i) {
+      const Entry &e = m_entries[i];
+      if (i == 0 || m_entries[i - 1].name != e.name) {
+        out.append("# HELP " + e.name + " " + e.help + "\n");
+        out.append("# TYPE " + e.name + " " + types[e.kind] + "\n");
+      }
+
+      if (e.kind == KindCounter) {
+        const Counter *c = reinterpret_cast<const Counter *>(e.metric);
+        out.append(Series(e.name, e.labels) + " " +
+                   std::to_string(c->Value()) + "\n");
+      } else if (e.kind == KindGauge) {
+        const Gauge *g = reinterpret_cast<const Gauge *>(e.metric);
+        out.append(Series(e.name, e.labels) + " " +
+                   std::to_string(g->Value()) + "\n");
+      } else {
+        const Histogram *h = reinterpret_cast<const Histogram *>(e.metric);
+        for (auto bound : ScrapeBounds) {
+          out.append(Series(e.name + "_bucket", e.labels,
+                            "le=\"" + std::to_string(bound) + "\"") +
+                     " " + std::to_string(h->CountUpTo(bound)) + "\n");
+        }
+        out.append(Series(e.name + "_bucket", e.labels, "le=\"+Inf\"") + " " +
+                   std::to_string(h->Count()) + "\n");
+        out.append(Series(e.name + "_sum", e.labels) + " " +
+                   std::to_string(h->Sum()) + "\n");
+        out.append(Series(e.name + "_count", e.labels) + " " +
+                   std::to_string(h->Count()) + "\n");
+      }
+    }
+  }
+};
+
+// How long a scrape may take before we hang up on it.
+const DWORD ScrapeTimeoutMillis = 2000;
+
+// Answers plain HTTP scrapes on a loopback port. Tick never blocks, so it
+// runs on the comms thread between everything else.
+class Endpoint {
+  struct Scrape {
+    SOCKET socket;
+    std::string request;
+    std::string response;
+    size_t sent;
+    DWORD deadline;
+  };
+
+  SOCKET m_listener;
+  std::vector<Scrape> m_scrapes;
+
+public:
+  Endpoint() : m_listener(INVALID_SOCKET) {}
+
+  ~Endpoint() {
+    for (auto &s : m_scrapes)
+      ::closesocket(s.socket);
+    if (m_listener != INVALID_SOCKET)
+      ::closesocket(m_listener);
+  }
+
+  // Listen on |port|, in place of any port this was listening on before.
+  bool Open(unsigned short port) {
+    if (m_listener != INVALID_SOCKET) {
+      ::closesocket(m_listener);
+      m_listener = INVALID_SOCKET;
+    }
+
+    SOCKADDR_IN addr;
+    ZeroMemory(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    m_listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (m_listener == INVALID_SOCKET)
+      return false;
+    if (bind(m_listener, (LPSOCKADDR)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        listen(m_listener, 4) == SOCKET_ERROR) {
+      ::closesocket(m_listener);
+      m_listener = INVALID_SOCKET;
+      return false;
+    }
+    unsigned long mode = 1;
+    ioctlsocket(m_listener, FIONBIO, &mode); //  Non-blocking.
+    return true;
+  }
+
+  bool IsOpen() const { return m_listener != INVALID_SOCKET; }
+
+  // |render| is called as render(body) for every scrape of /metrics.
+  template <typename Render> void Tick(DWORD now, Render render) {
+    if (m_listener == INVALID_SOCKET)
+      return;
+
+    SOCKET s;
+    while ((s = accept(m_listener, NULL, NULL)) != INVALID_SOCKET) {
+      unsigned long mode = 1;
+      ioctlsocket(s, FIONBIO, &mode); //  Non-blocking.
+      Scrape scrape{s, "", "", 0, now + ScrapeTimeoutMillis};
+      m_scrapes.push_back(scrape);
+    }
+
+    for (size_t i = 0; i < m_scrapes.size();) {
+      Scrape &scrape = m_scrapes[i];
+      bool done = static_cast<int>(now - scrape.deadline) >= 0;
+
+      if (!done && scrape.response.empty()) {
+        char buffer[1024];
+        int got = recv(scrape.socket, buffer, sizeof(buffer), 0);
+        if (got == 0 ||
+            (got == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK))
+          done = true;
+        else if (got > 0)
+          scrape.request.append(buffer, got);
+
+        if (scrape.request.find("\r\n\r\n") != std::string::npos) {
+          std::string body;
+          std::string status("200 OK");
+          if (scrape.request.compare(0, 13, "GET /metrics ") == 0)
+            render(body);
+          else
+            status = "404 Not Found";
+          scrape.response = "HTTP/1.0 " + status +
+                            "\r\nContent-Type: text/plain; version=0.0.4"
+                            "\r\nContent-Length: " +
+                            std::to_string(body.length()) +
+                            "\r\nConnection: close\r\n\r\n" + body;
+        } else if (scrape.request.length() > 8192) {
+          done = true;
+        }
+      }
+
+      if (!done && !scrape.response.empty()) {
+        int sent = send(scrape.socket, scrape.response.data() + scrape.sent,
+                        static_cast<int>(scrape.response.length() - scrape.sent),
+                        0);
+        if (sent > 0)
+          scrape.sent += sent;
+        else if (WSAGetLastError() != WSAEWOULDBLOCK)
+          done = true;
+        done = done || scrape.sent == scrape.response.length();
+      }
+
+      if (done) {
+        ::closesocket(scrape.socket);
+        m_scrapes.erase(m_scrapes.begin() + i);
+      } else {
+        ++i;
+      }
+    }
+  }
+};
+
+} // namespace metrics
+
+#endif // _METRICS_HPP
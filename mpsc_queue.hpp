@@ -0,0 +1,90 @@
+#ifndef _MPSC_QUEUE_HPP
+#define _MPSC_QUEUE_HPP
+#pragma once
+
+#include <Windows.h>
+#include <utility>
+#include <vector>
+
+namespace mpsc {
+
+// A bounded queue any number of threads push to and one thread pops from,
+// without a lock. Each cell carries a sequence number which says whether it
+// is ready to be filled or to be taken, so producers only contend on the
+// tail they claim and never on the consumer.
+//
+// Values are swapped in and out, so T needs a swap that does not copy its
+// buffers, found by argument dependent lookup.
+template <typename T> class BoundedQueue {
+  struct Cell {
+    volatile LONG sequence;
+    T value;
+  };
+
+  std::vector<Cell> m_cells;
+  LONG m_mask;
+  char m_pad0[64]; // Keep the producers' tail off the consumer's line.
+  volatile LONG m_tail;
+  char m_pad1[64];
+  volatile LONG m_head; // Only moved by the consumer.
+
+public:
+  // |capacity| is rounded up to a power of two.
+  explicit BoundedQueue(LONG capacity) : m_tail(0), m_head(0) {
+    LONG size = 2;
+    while (size < capacity)
+      size *= 2;
+    m_cells.resize(size);
+    m_mask = size - 1;
+    for (LONG i = 0; i < size; ++i)
+      m_cells[i].sequence = i;
+  }
+
+  // Swap |value| into the queue, false when it is full and |value| is
+  // left as it was.
+  bool Push(T &value) {
+    LONG pos = m_tail;
+    Cell *cell;
+    for (;;) {
+      cell = &m_cells[pos & m_mask];
+      LONG diff = cell->sequence - pos;
+      if (diff == 0) {
+        LONG was = InterlockedCompareExchange(&m_tail, pos + 1, pos);
+        if (was == pos)
+          break;
+        pos = was;
+      } else if (diff < 0) {
+        return false; // The consumer has not taken this cell yet.
+      } else {
+        pos = m_tail; // Another producer got here first.
+      }
+    }
+
+    using std::swap;
+    swap(cell->value, value);
+    InterlockedExchange(&cell->sequence, pos + 1); // Publish it.
+    return true;
+  }
+
+  // Swap the oldest value into |value|, false when there is none. Only one
+  // thread may pop.
+  bool Pop(T &value) {
+    LONG pos = m_head;
+    Cell &cell = m_cells[pos & m_mask];
+    if (cell.sequence - (pos + 1) < 0)
+      return false;
+
+    using std::swap;
+    swap(value, cell.value);
+    InterlockedExchange(&cell.sequence, pos + m_mask + 1); // Free it.
+    InterlockedExchange(&m_head, pos + 1);
+    return true;
+  }
+
+  // Values waiting, only a guide while producers are pushing.
+  LONG Size() const { return m_tail - m_head; }
+};
+
+} // namespace mpsc
+
+#endif // _MPSC_QUEUE_HPP
@@ -0,0 +1,88 @@
+#ifndef _RING_QUEUE_HPP
+#define _RING_QUEUE_HPP
+#pragma once
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace ring {
+
+// A double ended queue over a power of two ring. It grows by doubling until
+// it holds |limit| values, after which pushes fail and the caller decides
+// what to drop.
+template <typename T> class RingQueue {
+  std::vector<T> m_values;
+  size_t m_head;
+  size_t m_count;
+  size_t m_limit;
+
+  bool Grow() {
+    if (m_count < m_values.size())
+      return true;
+    if (m_values.size() >= m_limit)
+      return false;
+
+    std::vector<T> values(m_values.empty() ? 16 : m_values.size() * 2);
+    for (size_t i = 0; i < m_count; ++i)
+      values[i] = m_values[(m_head + i) & (m_values.size() - 1)];
+    m_values.swap(values);
+    m_head = 0;
+    return true;
+  }
+
+public:
+  explicit RingQueue(size_t limit = 8192)
+      : m_head(0), m_count(0), m_limit(limit) {}
+
+  bool push_back(const T &value) {
+    if (!Grow())
+      return false;
+    m_values[(m_head + m_count) & (m_values.size() - 1)] = value;
+    ++m_count;
+    return true;
+  }
+
+  bool push_front(const T &value) {
+    if (!Grow())
+      return false;
+    m_head = (m_head + m_values.size() - 1) & (m_values.size() - 1);
+    m_values[m_head] = value;
+    ++m_count;
+    return true;
+  }
+
+  T &front() { return m_values[m_head]; }
+  const T &front() const { return m_values[m_head]; }
+
+  void pop_front() {
+    m_values[m_head] = T();
+    m_head = (m_head + 1) & (m_values.size() - 1);
+    --m_count;
+  }
+
+  T &operator[](size_t i) {
+    return m_values[(m_head + i) & (m_values.size() - 1)];
+  }
+  const T &operator[](size_t i) const {
+    return m_values[(m_head + i) & (m_values.size() - 1)];
+  }
+
+  size_t size() const { return m_count; }
+  bool empty() const { return m_count == 0; }
+
+  void clear() {
+    while (!empty())
+      pop_front();
+  }
+
+  void swap(RingQueue &other) {
+    m_values.swap(other.m_values);
+    std::swap(m_head, other.m_head);
+    std::swap(m_count, other.m_count);
+    std::swap(m_limit, other.m_limit);
+  }
+};
+
+} // namespace ring
+
+#endif // _RING_QUEUE_HPP
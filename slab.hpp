@@ -0,0 +1,141 @@
+#ifndef _SLAB_HPP
+#define _SLAB_HPP
+#pragma once
+
+#include <Windows.h>
+#include <cstddef>
+#include <malloc.h>
+#include <new>
+#include <utility>
+
+namespace slab {
+
+// Blocks come in powers of two up to 128 KB, anything bigger goes straight
+// to the heap. A freed block goes back on the lock-free list
+// of its size, so once traffic has warmed the lists up packets stop going
+// to the heap at all.
+const size_t MinBlockShift = 6; // 64 bytes.
+const size_t MaxBlockShift = 17; // 128 KB, more than a whole frame.
+const size_t Classes = MaxBlockShift - MinBlockShift + 1;
+
+// Each list keeps at most this many bytes of free blocks, the rest are
+// given back to the heap.
+const size_t MaxFreeBytes = 4 * 1024 * 1024;
+
+// In front of every block. Free blocks use it as their list link, blocks
+// in use remember their size class in it.
+union BlockHeader {
+  SLIST_ENTRY link;
+  size_t sizeClass;
+  char pad[MEMORY_ALLOCATION_ALIGNMENT > 16 ? MEMORY_ALLOCATION_ALIGNMENT
+                                            : 16];
+};
+
+const size_t Oversized = Classes;
+
+class Pool {
+  SLIST_HEADER m_free[Classes];
+  volatile LONGLONG m_heapAllocations;
+
+  static size_t ClassOf(size_t bytes) {
+    size_t c = 0;
+    while (c < Classes && BlockBytes(c) < bytes)
+      ++c;
+    return c;
+  }
+
+  static size_t BlockBytes(size_t sizeClass) {
+    return static_cast<size_t>(1) << (sizeClass + MinBlockShift);
+  }
+
+public:
+  Pool() : m_heapAllocations(0) {
+    for (auto &list : m_free)
+      InitializeSListHead(&list);
+  }
+
+  void *Allocate(size_t bytes) {
+    size_t sizeClass = ClassOf(bytes);
+    BlockHeader *block = nullptr;
+    if (sizeClass != Oversized)
+      block = reinterpret_cast<BlockHeader *>(
+          InterlockedPopEntrySList(&m_free[sizeClass]));
+    if (!block) {
+      InterlockedIncrement64(&m_heapAllocations);
+      size_t size = sizeClass == Oversized ? bytes : BlockBytes(sizeClass);
+      block = reinterpret_cast<BlockHeader *>(_aligned_malloc(
+          sizeof(BlockHeader) + size, MEMORY_ALLOCATION_ALIGNMENT));
+      if (!block)
+        throw std::bad_alloc();
+    }
+    block->sizeClass = sizeClass;
+    return block + 1;
+  }
+
+  void Free(void *p) {
+    if (!p)
+      return;
+    BlockHeader *block = reinterpret_cast<BlockHeader *>(p) - 1;
+    size_t sizeClass = block->sizeClass;
+    if (sizeClass == Oversized ||
+        QueryDepthSList(&m_free[sizeClass]) * BlockBytes(sizeClass) >=
+            MaxFreeBytes) {
+      _aligned_free(block);
+      return;
+    }
+    InterlockedPushEntrySList(&m_free[sizeClass], &block->link);
+  }
+
+  // Blocks which had to come from the heap, for benchmarks to count.
+  LONGLONG HeapAllocations() const { return m_heapAllocations; }
+};
+
+// One pool for the process, SLIST_HEADER wants its alignment. It is never
+// torn down, packets may be freed by other globals' destructors.
+__declspec(align(16)) Pool pool;
+
+// A standard allocator drawing on the pool, so containers of packet data
+// can use it.
+template <typename T> class Allocator {
+public:
+  typedef T value_type;
+  typedef T *pointer;
+  typedef const T *const_pointer;
+  typedef T &reference;
+  typedef const T &const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <typename U> struct rebind { typedef Allocator<U> other; };
+
+  Allocator() {}
+  template <typename U> Allocator(const Allocator<U> &) {}
+
+  pointer address(reference value) const { return &value; }
+  const_pointer address(const_reference value) const { return &value; }
+  size_type max_size() const { return static_cast<size_type>(-1) / sizeof(T); }
+
+  pointer allocate(size_type n, const void * = nullptr) {
+    return static_cast<pointer>(pool.Allocate(n * sizeof(T)));
+  }
+  void deallocate(pointer p, size_type) { pool.Free(p); }
+
+  template <typename U, typename... Args>
+  void construct(U *p, Args &&... args) {
+    new (p) U(std::forward<Args>(args)...);
+  }
+  template <typename U> void destroy(U *p) { p->~U(); }
+};
+
+template <typename T, typename U>
+bool operator==(const Allocator<T> &, const Allocator<U> &) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const Allocator<T> &, const Allocator<U> &) {
+  return false;
+}
+
+} // namespace slab
+
+#endif // _SLAB_HPP
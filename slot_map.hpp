@@ -0,0 +1,108 @@
+#ifndef _SLOT_MAP_HPP
+#define _SLOT_MAP_HPP
+#pragma once
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace slots {
+
+// Refers to a value in a SlotMap. The generation goes stale when the value
+// is erased, so a handle kept around never finds whatever reused its slot.
+struct Handle {
+  unsigned int index;
+  unsigned int generation;
+
+  bool operator==(const Handle &other) const {
+    return index == other.index && generation == other.generation;
+  }
+  bool operator!=(const Handle &other) const { return !(*this == other); }
+};
+
+const Handle InvalidHandle = {0xFFFFFFFF, 0};
+
+// Values live packed together so iterating them is a plain vector walk,
+// while handles give O(1) lookup and erase. Erasing moves the last value
+// into the gap, so pointers into the map only last until the next erase.
+template <typename T> class SlotMap {
+  struct Slot {
+    unsigned int dense;
+    unsigned int generation;
+  };
+
+  std::vector<Slot> m_slots;
+  std::vector<unsigned int> m_free;
+
+  std::vector<T> m_values;
+  std::vector<unsigned int> m_owners; // Slot index of each value.
+
+public:
+  typedef typename std::vector<T>::iterator iterator;
+  typedef typename std::vector<T>::const_iterator const_iterator;
+
+  Handle Insert(const T &value) {
+    unsigned int index;
+    if (m_free.empty()) {
+      index = m_slots.size();
+      Slot slot = {0, 1};
+      m_slots.push_back(slot);
+    } else {
+      index = m_free.back();
+      m_free.pop_back();
+    }
+
+    m_slots[index].dense = m_values.size();
+    m_values.push_back(value);
+    m_owners.push_back(index);
+
+    Handle handle = {index, m_slots[index].generation};
+    return handle;
+  }
+
+  T *Get(Handle handle) {
+    if (handle.index >= m_slots.size() ||
+        m_slots[handle.index].generation != handle.generation)
+      return nullptr;
+    return &m_values[m_slots[handle.index].dense];
+  }
+
+  bool Erase(Handle handle) {
+    if (Get(handle) == nullptr)
+      return false;
+
+    unsigned int dense = m_slots[handle.index].dense;
+    unsigned int last = m_values.size() - 1;
+    if (dense != last) {
+      // Swapped rather than assigned, values may own big buffers. T
+      // should have a swap of its own which does not copy them.
+      using std::swap;
+      swap(m_values[dense], m_values[last]);
+      m_owners[dense] = m_owners[last];
+      m_slots[m_owners[dense]].dense = dense;
+    }
+    m_values.pop_back();
+    m_owners.pop_back();
+
+    ++m_slots[handle.index].generation;
+    m_free.push_back(handle.index);
+    return true;
+  }
+
+  // Handle of the value at |pos| in iteration order.
+  Handle HandleAt(size_t pos) const {
+    Handle handle = {m_owners[pos], m_slots[m_owners[pos]].generation};
+    return handle;
+  }
+
+  size_t size() const { return m_values.size(); }
+  bool empty() const { return m_values.empty(); }
+
+  iterator begin() { return m_values.begin(); }
+  iterator end() { return m_values.end(); }
+  const_iterator begin() const { return m_values.begin(); }
+  const_iterator end() const { return m_values.end(); }
+};
+
+} // namespace slots
+
+#endif // _SLOT_MAP_HPP
@@ -0,0 +1,180 @@
+#ifndef _TRACE_HPP
+#define _TRACE_HPP
+#pragma once
+
+#include <Windows.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace trace {
+
+// Spans each thread keeps, once full the oldest are written over. A power of
+// two, so a slot is the count masked and stays right when the count wraps.
+const unsigned long RingEvents = 1 << 16;
+
+// A message is known by its sender and sequence until the server logs it,
+// and by its log sequence from then on. The two never collide, the top bit
+// tells them apart.
+unsigned long long SenderKey(const std::string &alias, unsigned int sequence) {
+  unsigned int hash = 2166136261u; // FNV-1a.
+  for (auto c : alias) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 16777619u;
+  }
+  return (static_cast<unsigned long long>(hash & 0x7fffffff) << 32) | sequence;
+}
+
+unsigned long long LogKey(unsigned int sequence) {
+  return (1ull << 63) | sequence;
+}
+
+// How a span links to the other spans of its message, Chrome draws an
+// arrow from each span of a flow to the next.
+enum Flow { FlowNone = 0, FlowStart = 's', FlowStep = 't', FlowEnd = 'f' };
+
+struct Event {
+  const char *name; // Always a literal, so it outlives the thread.
+  unsigned long long key;
+  LONGLONG start; // Performance counter.
+  LONGLONG end;
+  char flow;
+};
+
+// Only its own thread writes to a ring, so recording takes no lock.
+struct Ring {
+  DWORD thread;
+  const char *name;
+  volatile unsigned long written; // Events ever written, wrapping.
+  Event events[RingEvents];
+};
+
+class Tracer {
+  volatile LONG m_on;
+  DWORD m_ringSlot;
+  DWORD m_nameSlot;
+  LARGE_INTEGER m_frequency;
+  CRITICAL_SECTION m_mutex;
+  std::vector<Ring *> m_rings; // Never freed, a thread may write until exit.
+
+  Ring *ThreadRing() {
+    Ring *ring = reinterpret_cast<Ring *>(TlsGetValue(m_ringSlot));
+    if (ring)
+      return ring;
+
+    ring = new Ring;
+    ring->thread = GetCurrentThreadId();
+    ring->name = reinterpret_cast<const char *>(TlsGetValue(m_nameSlot));
+    ring->written = 0;
+    TlsSetValue(m_ringSlot, ring);
+    EnterCriticalSection(&m_mutex);
+    m_rings.push_back(ring);
+    LeaveCriticalSection(&m_mutex);
+    return ring;
+  }
+
+  double Micros(LONGLONG counter) const {
+    return counter * 1000000.0 / m_frequency.QuadPart;
+  }
+
+public:
+  Tracer() : m_on(0), m_ringSlot(TlsAlloc()), m_nameSlot(TlsAlloc()) {
+    QueryPerformanceFrequency(&m_frequency);
+    InitializeCriticalSection(&m_mutex);
+  }
+
+  bool On() const { return m_on != 0; }
+  void Start() { InterlockedExchange(&m_on, 1); }
+  void Stop() { InterlockedExchange(&m_on, 0); }
+
+  static LONGLONG Now() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+  }
+
+  // Name the calling thread in the trace, |name| must be a literal.
+  void NameThread(const char *name) {
+    TlsSetValue(m_nameSlot, const_cast<char *>(name));
+    Ring *ring = reinterpret_cast<Ring *>(TlsGetValue(m_ringSlot));
+    if (ring)
+      ring->name = name;
+  }
+
+  // Record that message |key| spent |start| to |end| in stage |name|.
+  void Record(const char *name, unsigned long long key, LONGLONG start,
+              LONGLONG end, Flow flow = FlowNone) {
+    if (!m_on)
+      return;
+    Ring *ring = ThreadRing();
+    unsigned long written = ring->written;
+    Event &e = ring->events[written & (RingEvents - 1)];
+    e.name = name;
+    e.key = key;
+    e.start = start;
+    e.end = end;
+    e.flow = static_cast<char>(flow);
+    // Publishes the event to Dump, only this thread moves the count.
+    MemoryBarrier();
+    ring->written = written + 1;
+  }
+
+  // Write every ring out as Chrome trace JSON. Timestamps come from the
+  // performance counter, which all processes on a machine share, so the
+  // traceEvents of a client and a server dump can be pasted into one file.
+  // Stop first for a clean cut, a span being written as we dump may be torn.
+  bool Dump(const std::string &path) {
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out)
+      return false;
+
+    EnterCriticalSection(&m_mutex);
+    std::vector<Ring *> rings(m_rings);
+    LeaveCriticalSection(&m_mutex);
+
+    DWORD pid = GetCurrentProcessId();
+    const char *separator = "";
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (auto ring : rings) {
+      if (ring->name) {
+        fprintf(out,
+                "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %lu, "
+                "\"tid\": %lu, \"args\": {\"name\": \"%s\"}}",
+                separator, pid, ring->thread, ring->name);
+        separator = ",\n";
+      }
+
+      unsigned long written = ring->written;
+      unsigned long count = written < RingEvents ? written : RingEvents;
+      for (unsigned long i = written - count; i != written; ++i) {
+        const Event &e = ring->events[i & (RingEvents - 1)];
+        double start = Micros(e.start);
+        fprintf(out,
+                "%s{\"name\": \"%s\", \"cat\": \"chat\", \"ph\": \"X\", "
+                "\"ts\": %.3f, \"dur\": %.3f, \"pid\": %lu, \"tid\": %lu, "
+                "\"args\": {\"key\": \"0x%llx\"}}",
+                separator, e.name, start, Micros(e.end) - start, pid,
+                ring->thread, e.key);
+        separator = ",\n";
+        if (e.flow != FlowNone) {
+          fprintf(out,
+                  ",\n{\"name\": \"message\", \"cat\": \"chat\", "
+                  "\"ph\": \"%c\", \"id\": \"0x%llx\", \"ts\": %.3f, "
+                  "\"pid\": %lu, \"tid\": %lu%s}",
+                  e.flow, e.key, start, pid, ring->thread,
+                  e.flow == FlowStart ? "" : ", \"bp\": \"e\"");
+        }
+      }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    return true;
+  }
+};
+
+// One tracer for the process, tracing is off until Start.
+Tracer tracer;
+
+} // namespace trace
+
+#endif // _TRACE_HPP